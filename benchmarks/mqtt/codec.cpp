@@ -2,6 +2,24 @@
 
 #include <benchmark/benchmark.h>
 
+#include "utils/alloc.h"
+
+namespace {
+std::unique_ptr<folly::IOBuf> encodeWithGrowth(warp::mqtt::Message const& msg) {
+  folly::IOBufQueue q(folly::IOBufQueue::cacheChainLength());
+  folly::io::QueueAppender a(&q, 1024);
+  std::visit([&](auto const& m) { m.encode(a); }, msg);
+  return q.move();
+}
+
+void setAllocations(benchmark::State& state, size_t before) {
+  state.counters["allocs"] = benchmark::Counter(
+      static_cast<double>(warp::bench::allocations() - before),
+      benchmark::Counter::kAvgIterations
+  );
+}
+}  // namespace
+
 class CodecTest : public benchmark::Fixture {
 public:
   void SetUp(const ::benchmark::State&) override {
@@ -11,6 +29,17 @@ public:
                    .withKeepAlive(60)
                    .withClient("CLIENT")
                    .build();
+    puback_ = warp::mqtt::PubAck::Builder{}.withPacketId(1).build();
+    publish_ = warp::mqtt::Publish::Builder{}
+                   .withTopic("plant/line/machine/sensor")
+                   .withPayload(std::string(1024, 'x'))
+                   .withQos(1)
+                   .withPacketId(1)
+                   .build();
+    small_ = warp::mqtt::Publish::Builder{}
+                 .withTopic("org/site/area/line/machine/sensor/metric")
+                 .withPayload("12345678")
+                 .build();
   }
 
   void TearDown(const ::benchmark::State&) override {
@@ -18,13 +47,145 @@ public:
   }
 
 protected:
-  warp::mqtt::Connect connect_;
+  static constexpr size_t kFanOut = 1000;
+
+  warp::mqtt::Message connect_;
+  warp::mqtt::Message puback_;
+  warp::mqtt::Message publish_;
+  warp::mqtt::Publish small_;
 };
 
 BENCHMARK_F(CodecTest, EncodeTest)(benchmark::State& state) {
+  auto const before = warp::bench::allocations();
   for (auto _ : state) {
     auto data = warp::mqtt::Codec::encode(connect_);
     benchmark::DoNotOptimize(data);
     benchmark::ClobberMemory();
   }
+  setAllocations(state, before);
+}
+
+BENCHMARK_F(CodecTest, EncodePubAckGrowthTest)(benchmark::State& state) {
+  auto const before = warp::bench::allocations();
+  for (auto _ : state) {
+    auto data = encodeWithGrowth(puback_);
+    benchmark::DoNotOptimize(data);
+    benchmark::ClobberMemory();
+  }
+  setAllocations(state, before);
+}
+
+BENCHMARK_F(CodecTest, EncodePubAckTest)(benchmark::State& state) {
+  auto const before = warp::bench::allocations();
+  for (auto _ : state) {
+    auto data = warp::mqtt::Codec::encode(puback_);
+    benchmark::DoNotOptimize(data);
+    benchmark::ClobberMemory();
+  }
+  setAllocations(state, before);
+}
+
+BENCHMARK_F(CodecTest, EncodePublishGrowthTest)(benchmark::State& state) {
+  auto const before = warp::bench::allocations();
+  for (auto _ : state) {
+    auto data = encodeWithGrowth(publish_);
+    benchmark::DoNotOptimize(data);
+    benchmark::ClobberMemory();
+  }
+  setAllocations(state, before);
+}
+
+BENCHMARK_F(CodecTest, EncodePublishTest)(benchmark::State& state) {
+  auto const before = warp::bench::allocations();
+  for (auto _ : state) {
+    auto data = warp::mqtt::Codec::encode(publish_);
+    benchmark::DoNotOptimize(data);
+    benchmark::ClobberMemory();
+  }
+  setAllocations(state, before);
+}
+
+BENCHMARK_F(CodecTest, EncodeQueueTest)(benchmark::State& state) {
+  folly::IOBufQueue q(folly::IOBufQueue::cacheChainLength());
+  auto const before = warp::bench::allocations();
+  for (auto _ : state) {
+    for (int i = 0; i < 64; ++i) {
+      warp::mqtt::Codec::encode(puback_, q);
+    }
+    benchmark::DoNotOptimize(q.front());
+    q.reset();
+  }
+  setAllocations(state, before);
+  state.SetItemsProcessed(state.iterations() * 64);
+}
+
+BENCHMARK_F(CodecTest, FanOutEncodeTest)(benchmark::State& state) {
+  auto const before = warp::bench::allocations();
+  for (auto _ : state) {
+    for (size_t i = 0; i < kFanOut; ++i) {
+      auto data = warp::mqtt::Codec::encode(publish_);
+      benchmark::DoNotOptimize(data);
+    }
+    benchmark::ClobberMemory();
+  }
+  setAllocations(state, before);
+  state.SetItemsProcessed(state.iterations() * kFanOut);
+}
+
+BENCHMARK_F(CodecTest, FanOutSharedTest)(benchmark::State& state) {
+  auto const& publish = std::get<warp::mqtt::Publish>(publish_);
+  auto const before = warp::bench::allocations();
+  for (auto _ : state) {
+    warp::mqtt::SharedPublish const shared(publish);
+    for (size_t i = 0; i < kFanOut; ++i) {
+      auto data = shared.clone(0, 0);
+      benchmark::DoNotOptimize(data);
+    }
+    benchmark::ClobberMemory();
+  }
+  setAllocations(state, before);
+  state.SetItemsProcessed(state.iterations() * kFanOut);
+}
+
+BENCHMARK_F(CodecTest, FanOutSharedQos1Test)(benchmark::State& state) {
+  auto const& publish = std::get<warp::mqtt::Publish>(publish_);
+  auto const before = warp::bench::allocations();
+  for (auto _ : state) {
+    warp::mqtt::SharedPublish const shared(publish);
+    for (size_t i = 0; i < kFanOut; ++i) {
+      auto data = shared.clone(1, static_cast<uint16_t>(i + 1));
+      benchmark::DoNotOptimize(data);
+    }
+    benchmark::ClobberMemory();
+  }
+  setAllocations(state, before);
+  state.SetItemsProcessed(state.iterations() * kFanOut);
+}
+
+BENCHMARK_F(CodecTest, FanOutV5Test)(benchmark::State& state) {
+  auto const before = warp::bench::allocations();
+  for (auto _ : state) {
+    warp::mqtt::SharedPublish const shared(small_);
+    for (size_t i = 0; i < kFanOut; ++i) {
+      auto data = shared.clone(0, 0, warp::mqtt::Level::V5);
+      benchmark::DoNotOptimize(data);
+    }
+    benchmark::ClobberMemory();
+  }
+  setAllocations(state, before);
+  state.SetItemsProcessed(state.iterations() * kFanOut);
+}
+
+BENCHMARK_F(CodecTest, FanOutAliasTest)(benchmark::State& state) {
+  auto const before = warp::bench::allocations();
+  for (auto _ : state) {
+    warp::mqtt::SharedPublish const shared(small_);
+    for (size_t i = 0; i < kFanOut; ++i) {
+      auto data = shared.clone(0, 0, warp::mqtt::TopicAlias{1, true});
+      benchmark::DoNotOptimize(data);
+    }
+    benchmark::ClobberMemory();
+  }
+  setAllocations(state, before);
+  state.SetItemsProcessed(state.iterations() * kFanOut);
 }
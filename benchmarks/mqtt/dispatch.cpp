@@ -0,0 +1,61 @@
+#include <benchmark/benchmark.h>
+#include <folly/executors/CPUThreadPoolExecutor.h>
+#include <folly/executors/SerialExecutor.h>
+#include <folly/synchronization/Baton.h>
+
+#include <atomic>
+#include <vector>
+
+namespace {
+constexpr size_t kConnections = 256;
+constexpr size_t kMessages = 64;
+constexpr size_t kThreads = 4;
+
+void work(std::atomic<size_t>& remaining, folly::Baton<>& done) {
+  size_t sum = 0;
+  for (size_t i = 0; i < 256; ++i) {
+    benchmark::DoNotOptimize(sum += i);
+  }
+  if (remaining.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+    done.post();
+  }
+}
+}  // namespace
+
+// Baseline: every packet goes straight to the shared pool, with no ordering.
+static void PoolDispatchTest(benchmark::State& state) {
+  folly::CPUThreadPoolExecutor pool(kThreads);
+  for (auto _ : state) {
+    std::atomic<size_t> remaining{kConnections * kMessages};
+    folly::Baton<> done;
+    for (size_t i = 0; i < kMessages; ++i) {
+      for (size_t c = 0; c < kConnections; ++c) {
+        pool.add([&]() { work(remaining, done); });
+      }
+    }
+    done.wait();
+  }
+  state.SetItemsProcessed(state.iterations() * kConnections * kMessages);
+}
+BENCHMARK(PoolDispatchTest)->UseRealTime();
+
+// One serial executor per connection over the same pool.
+static void SerialDispatchTest(benchmark::State& state) {
+  folly::CPUThreadPoolExecutor pool(kThreads);
+  std::vector<folly::Executor::KeepAlive<folly::SerialExecutor>> executors;
+  for (size_t c = 0; c < kConnections; ++c) {
+    executors.push_back(folly::SerialExecutor::create(folly::getKeepAliveToken(pool)));
+  }
+  for (auto _ : state) {
+    std::atomic<size_t> remaining{kConnections * kMessages};
+    folly::Baton<> done;
+    for (size_t i = 0; i < kMessages; ++i) {
+      for (auto& executor : executors) {
+        executor->add([&]() { work(remaining, done); });
+      }
+    }
+    done.wait();
+  }
+  state.SetItemsProcessed(state.iterations() * kConnections * kMessages);
+}
+BENCHMARK(SerialDispatchTest)->UseRealTime();
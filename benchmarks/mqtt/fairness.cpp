@@ -0,0 +1,74 @@
+#include "warp/mqtt/codec.h"
+
+#include <benchmark/benchmark.h>
+#include <folly/io/async/EventBase.h>
+
+#include <chrono>
+#include <limits>
+#include <vector>
+
+namespace {
+using Clock = std::chrono::steady_clock;
+
+constexpr size_t kQuiet = 255;
+constexpr size_t kBurst = 64 * 1024;
+
+std::unique_ptr<folly::IOBuf> packets(size_t n) {
+  folly::IOBufQueue q(folly::IOBufQueue::cacheChainLength());
+  auto const msg = warp::mqtt::Publish::Builder{}.withTopic("test/foo").withPayload("x").build();
+  for (size_t i = 0; i < n; ++i) {
+    q.append(warp::mqtt::Codec::encode(msg));
+  }
+  return q.move();
+}
+
+// Decodes up to budget packets, then yields the loop the way Handler::read does.
+void read(folly::EventBase& evb, folly::IOBufQueue& q, size_t budget, Clock::time_point& done) {
+  for (size_t n = 0; n < budget; ++n) {
+    auto msg = warp::mqtt::Codec::decode(q);
+    if (!msg) {
+      done = Clock::now();
+      return;
+    }
+    benchmark::DoNotOptimize(msg);
+  }
+  evb.runInLoop([&evb, &q, budget, &done]() { read(evb, q, budget, done); });
+}
+
+// One connection with a large burst queued shares a loop with many that each
+// have one packet; reports how long the quiet ones wait for theirs.
+void run(benchmark::State& state, size_t budget) {
+  auto const burst = packets(kBurst);
+  auto const one = packets(1);
+  double waited = 0;
+  for (auto _ : state) {
+    folly::EventBase evb;
+    std::vector<folly::IOBufQueue> queues(kQuiet + 1);
+    std::vector<Clock::time_point> done(kQuiet + 1);
+    queues[0].append(burst->clone());
+    for (size_t i = 1; i <= kQuiet; ++i) {
+      queues[i].append(one->clone());
+    }
+    auto const start = Clock::now();
+    for (size_t i = 0; i <= kQuiet; ++i) {
+      evb.runInLoop([&, i]() { read(evb, queues[i], budget, done[i]); });
+    }
+    evb.loop();
+    for (size_t i = 1; i <= kQuiet; ++i) {
+      waited += std::chrono::duration<double, std::micro>(done[i] - start).count();
+    }
+  }
+  state.counters["quiet_us"] = benchmark::Counter(
+      waited / kQuiet, benchmark::Counter::kAvgIterations
+  );
+}
+}  // namespace
+
+// Baseline: every read decodes all it can.
+static void UnboundedReadTest(benchmark::State& state) {
+  run(state, std::numeric_limits<size_t>::max());
+}
+BENCHMARK(UnboundedReadTest);
+
+static void BudgetReadTest(benchmark::State& state) { run(state, 64); }
+BENCHMARK(BudgetReadTest);
@@ -0,0 +1,119 @@
+#include "warp/mqtt/connection.h"
+
+#include <benchmark/benchmark.h>
+#include <folly/executors/InlineExecutor.h>
+#include <wangle/channel/Pipeline.h>
+
+#include <cstring>
+#include <memory>
+#include <variant>
+#include <vector>
+
+#include "utils/alloc.h"
+#include "warp/mqtt/codec.h"
+#include "warp/utils/buffer.h"
+
+namespace {
+constexpr size_t kConnections = 10000;
+constexpr size_t kReadSize = 2048;
+
+class Socket final : public warp::mqtt::WebSocketTransport::Socket {
+public:
+  folly::Future<folly::Unit> write(std::unique_ptr<folly::IOBuf>) override {
+    return folly::makeFuture();
+  }
+
+  void close() override {}
+
+  void setReading(bool) override {}
+};
+
+// Answers PingReq through the connection, as the service does inline.
+class Responder final : public wangle::Handler<
+                            folly::IOBufQueue&, warp::mqtt::Message, warp::mqtt::Message,
+                            std::unique_ptr<folly::IOBuf>> {
+public:
+  void read(Context*, folly::IOBufQueue& q) override {
+    while (auto msg = warp::mqtt::Codec::decode(q)) {
+      if (std::holds_alternative<warp::mqtt::PingReq>(*msg)) {
+        connection->send(warp::mqtt::PingResp::Builder{}.build());
+      }
+    }
+  }
+
+  warp::mqtt::Connection* connection{nullptr};
+};
+
+using Pipeline = wangle::Pipeline<folly::IOBufQueue&, warp::mqtt::Message>;
+
+// A client connection between packets: its pipeline, the connection behind
+// it, and the socket read queue, left with the buffer preallocated for the
+// read that found nothing.
+struct Peer {
+  Socket socket;
+  Pipeline::Ptr pipeline;
+  std::shared_ptr<warp::mqtt::Connection> connection;
+  folly::IOBufQueue read{folly::IOBufQueue::cacheChainLength()};
+};
+
+// Reads one PingReq the way the socket handler does.
+void ping(Peer& peer, folly::IOBuf const& req) {
+  auto space = peer.read.preallocate(kReadSize, kReadSize);
+  std::memcpy(space.first, req.data(), req.length());
+  peer.read.postallocate(req.length());
+  peer.pipeline->read(peer.read);
+  peer.read.preallocate(kReadSize, kReadSize);
+}
+}  // namespace
+
+// Bytes each connection holds once it has answered a ping, and once the idle
+// timer has trimmed its read queue and shrunk its outbound queue.
+static void IdleTest(benchmark::State& state) {
+  auto const req = warp::mqtt::Codec::encode(warp::mqtt::PingReq::Builder{}.build());
+  auto sessions = std::make_shared<warp::mqtt::SessionStore>(std::make_shared<warp::mqtt::Trie>());
+  auto registry = std::make_shared<warp::mqtt::Registry>();
+  auto* const executor = &folly::InlineExecutor::instance();
+  double busy = 0;
+  double idle = 0;
+  for (auto _ : state) {
+    folly::EventBase evb;
+    auto const before = warp::bench::allocated();
+    std::vector<std::unique_ptr<Peer>> peers;
+    peers.reserve(kConnections);
+    for (size_t i = 0; i < kConnections; ++i) {
+      auto& peer = *peers.emplace_back(std::make_unique<Peer>());
+      peer.pipeline = Pipeline::create();
+      peer.pipeline->addBack(warp::mqtt::WebSocketTransport(&evb, &peer.socket));
+      peer.pipeline->addBack(Responder());
+      peer.pipeline->finalize();
+      auto* responder = peer.pipeline->getHandler<Responder>();
+      peer.connection = std::make_shared<warp::mqtt::Connection>(
+          sessions, registry, &evb, responder->getContext(),
+          folly::SerialExecutor::create(folly::getKeepAliveToken(executor)),
+          warp::mqtt::ConnectionOptions{}
+      );
+      responder->connection = peer.connection.get();
+      ping(peer, *req);
+    }
+    // Sends the responses.
+    evb.loopOnce();
+    busy += static_cast<double>(warp::bench::allocated() - before) / kConnections;
+    for (auto& peer : peers) {
+      warp::utils::trim(peer->read);
+      peer->connection->shrink();
+    }
+    idle += static_cast<double>(warp::bench::allocated() - before) / kConnections;
+
+    state.PauseTiming();
+    for (auto& peer : peers) {
+      peer->connection->close();
+    }
+    evb.loop();
+    peers.clear();
+    state.ResumeTiming();
+  }
+  state.counters["busy"] = benchmark::Counter(busy, benchmark::Counter::kAvgIterations);
+  state.counters["idle"] = benchmark::Counter(idle, benchmark::Counter::kAvgIterations);
+  state.SetItemsProcessed(state.iterations() * kConnections);
+}
+BENCHMARK(IdleTest)->Unit(benchmark::kMillisecond);
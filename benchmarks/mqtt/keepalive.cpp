@@ -0,0 +1,64 @@
+#include "warp/mqtt/keepalive.h"
+
+#include <benchmark/benchmark.h>
+#include <folly/io/async/AsyncTimeout.h>
+
+#include <memory>
+#include <vector>
+
+namespace {
+constexpr size_t kConnections = 100000;
+constexpr std::chrono::seconds kTimeout{90};
+}  // namespace
+
+// Baseline: one AsyncTimeout per connection, rescheduled on every read.
+static void AsyncTimeoutTest(benchmark::State& state) {
+  folly::EventBase evb;
+  std::vector<std::unique_ptr<folly::AsyncTimeout>> timeouts;
+  timeouts.reserve(kConnections);
+  for (size_t i = 0; i < kConnections; ++i) {
+    timeouts.push_back(folly::AsyncTimeout::make(evb, []() noexcept {}));
+    timeouts.back()->scheduleTimeout(kTimeout);
+  }
+  size_t i = 0;
+  for (auto _ : state) {
+    timeouts[i]->scheduleTimeout(kTimeout);
+    i = (i + 1) % kConnections;
+  }
+  state.counters["bytes"] = sizeof(folly::AsyncTimeout);
+}
+BENCHMARK(AsyncTimeoutTest);
+
+static void KeepAliveTouchTest(benchmark::State& state) {
+  folly::EventBase evb;
+  std::vector<std::unique_ptr<warp::mqtt::KeepAlive>> timeouts;
+  timeouts.reserve(kConnections);
+  for (size_t i = 0; i < kConnections; ++i) {
+    timeouts.push_back(std::make_unique<warp::mqtt::KeepAlive>(evb, []() {}));
+    timeouts.back()->schedule(kTimeout);
+  }
+  size_t i = 0;
+  for (auto _ : state) {
+    timeouts[i]->touch();
+    i = (i + 1) % kConnections;
+  }
+  state.counters["bytes"] = sizeof(warp::mqtt::KeepAlive);
+}
+BENCHMARK(KeepAliveTouchTest);
+
+static void KeepAliveScheduleTest(benchmark::State& state) {
+  folly::EventBase evb;
+  std::vector<std::unique_ptr<warp::mqtt::KeepAlive>> timeouts;
+  timeouts.reserve(kConnections);
+  for (size_t i = 0; i < kConnections; ++i) {
+    timeouts.push_back(std::make_unique<warp::mqtt::KeepAlive>(evb, []() {}));
+    timeouts.back()->schedule(kTimeout);
+  }
+  size_t i = 0;
+  for (auto _ : state) {
+    timeouts[i]->schedule(kTimeout);
+    i = (i + 1) % kConnections;
+  }
+  state.counters["bytes"] = sizeof(warp::mqtt::KeepAlive);
+}
+BENCHMARK(KeepAliveScheduleTest);
@@ -0,0 +1,77 @@
+#include "utils/alloc.h"
+
+#include <atomic>
+#include <cerrno>
+
+// Counting wraps glibc's own allocator entry points; elsewhere the counters
+// would silently stay at zero.
+#if !defined(__GLIBC__)
+#error "allocation counting needs glibc"
+#endif
+
+#include <malloc.h>
+
+namespace {
+std::atomic<size_t> count{0};
+std::atomic<size_t> bytes{0};
+
+void* track(void* ptr) {
+  if (ptr) {
+    bytes.fetch_add(malloc_usable_size(ptr), std::memory_order_relaxed);
+  }
+  return ptr;
+}
+}  // namespace
+
+extern "C" {
+void* __libc_malloc(size_t size);
+void* __libc_calloc(size_t n, size_t size);
+void* __libc_realloc(void* ptr, size_t size);
+void* __libc_memalign(size_t alignment, size_t size);
+void __libc_free(void* ptr);
+
+void* malloc(size_t size) noexcept {
+  count.fetch_add(1, std::memory_order_relaxed);
+  return track(__libc_malloc(size));
+}
+
+void* calloc(size_t n, size_t size) noexcept {
+  count.fetch_add(1, std::memory_order_relaxed);
+  return track(__libc_calloc(n, size));
+}
+
+void* realloc(void* ptr, size_t size) noexcept {
+  count.fetch_add(1, std::memory_order_relaxed);
+  size_t const before = ptr ? malloc_usable_size(ptr) : 0;
+  void* out = __libc_realloc(ptr, size);
+  if (out || size == 0) {
+    bytes.fetch_sub(before, std::memory_order_relaxed);
+  }
+  return track(out);
+}
+
+void* memalign(size_t alignment, size_t size) noexcept {
+  count.fetch_add(1, std::memory_order_relaxed);
+  return track(__libc_memalign(alignment, size));
+}
+
+void* aligned_alloc(size_t alignment, size_t size) noexcept { return memalign(alignment, size); }
+
+int posix_memalign(void** out, size_t alignment, size_t size) noexcept {
+  *out = memalign(alignment, size);
+  return *out || size == 0 ? 0 : ENOMEM;
+}
+
+void free(void* ptr) noexcept {
+  if (ptr) {
+    bytes.fetch_sub(malloc_usable_size(ptr), std::memory_order_relaxed);
+  }
+  __libc_free(ptr);
+}
+}
+
+namespace warp::bench {
+size_t allocations() { return count.load(std::memory_order_relaxed); }
+
+size_t allocated() { return bytes.load(std::memory_order_relaxed); }
+}  // namespace warp::bench
@@ -0,0 +1,13 @@
+#pragma once
+
+#include <cstddef>
+
+namespace warp::bench {
+// Number of heap allocations made by the process so far. Counts every call
+// into the C allocator, so IOBuf buffers are included along with operator new.
+// Only linked into warp_alloc_bench, and only builds against glibc.
+size_t allocations();
+
+// Bytes currently allocated, by usable size, through the same calls.
+size_t allocated();
+}  // namespace warp::bench
@@ -0,0 +1,75 @@
+#include "warp/websocket/stream.h"
+
+#include <benchmark/benchmark.h>
+
+#include <vector>
+
+namespace {
+constexpr uint8_t kMask[4] = {0x12, 0x34, 0x56, 0x78};
+
+std::vector<uint8_t> payload(size_t size) {
+  std::vector<uint8_t> out(size);
+  for (size_t i = 0; i < size; ++i) {
+    out[i] = static_cast<uint8_t>(i);
+  }
+  return out;
+}
+
+// A masked binary frame, as a browser sends it.
+std::unique_ptr<folly::IOBuf> frame(size_t size) {
+  std::vector<uint8_t> out{0x82};
+  if (size < 126) {
+    out.push_back(static_cast<uint8_t>(0x80 | size));
+  } else if (size <= 0xFFFF) {
+    out.insert(out.end(), {0xFE, static_cast<uint8_t>(size >> 8), static_cast<uint8_t>(size)});
+  } else {
+    out.push_back(0xFF);
+    for (int i = 7; i >= 0; --i) {
+      out.push_back(static_cast<uint8_t>(size >> (8 * i)));
+    }
+  }
+  out.insert(out.end(), kMask, kMask + 4);
+  auto const data = payload(size);
+  out.resize(out.size() + size);
+  warp::websocket::unmask(out.data() + out.size() - size, data.data(), size, kMask);
+  return folly::IOBuf::copyBuffer(out.data(), out.size());
+}
+}  // namespace
+
+// Baseline: one byte at a time.
+static void UnmaskBytesTest(benchmark::State& state) {
+  auto data = payload(static_cast<size_t>(state.range(0)));
+  for (auto _ : state) {
+    for (size_t i = 0; i < data.size(); ++i) {
+      data[i] ^= kMask[i & 3];
+    }
+    benchmark::DoNotOptimize(data.data());
+    benchmark::ClobberMemory();
+  }
+  state.SetBytesProcessed(state.iterations() * state.range(0));
+}
+BENCHMARK(UnmaskBytesTest)->RangeMultiplier(4)->Range(16, 1 << 20);
+
+static void UnmaskTest(benchmark::State& state) {
+  auto data = payload(static_cast<size_t>(state.range(0)));
+  for (auto _ : state) {
+    warp::websocket::unmask(data.data(), data.data(), data.size(), kMask);
+    benchmark::DoNotOptimize(data.data());
+    benchmark::ClobberMemory();
+  }
+  state.SetBytesProcessed(state.iterations() * state.range(0));
+}
+BENCHMARK(UnmaskTest)->RangeMultiplier(4)->Range(16, 1 << 20);
+
+// The input stays shared with the benchmark, so this takes the path that
+// unmasks into a copy.
+static void ParseTest(benchmark::State& state) {
+  auto const data = frame(static_cast<size_t>(state.range(0)));
+  warp::websocket::Stream stream;
+  for (auto _ : state) {
+    auto frames = stream.parse(data->clone());
+    benchmark::DoNotOptimize(frames);
+  }
+  state.SetBytesProcessed(state.iterations() * state.range(0));
+}
+BENCHMARK(ParseTest)->RangeMultiplier(4)->Range(16, 1 << 20);
@@ -0,0 +1,59 @@
+#pragma once
+
+#include <folly/container/F14Map.h>
+
+#include <cstdint>
+#include <list>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "warp/mqtt/message.h"
+
+namespace warp::mqtt {
+// An outbound alias; known means the client already has it mapped, so the
+// topic name can be left out.
+struct TopicAlias {
+  uint16_t id{0};
+  bool known{false};
+};
+
+// Aliases a client set up on its publishes, good for one network connection.
+// Storage grows only as far as the highest alias the client actually uses.
+class InboundAliases final {
+public:
+  explicit InboundAliases(uint16_t maximum = 0) : maximum_(maximum) {}
+
+  uint16_t maximum() const { return maximum_; }
+
+  // Fills in the topic of a publish sent by alias and records the aliases a
+  // publish sets up. False if the alias is out of range or was never set.
+  bool resolve(Publish& msg);
+
+private:
+  uint16_t maximum_;
+  std::vector<std::string> topics_;
+};
+
+// Aliases the broker hands out to a client, at most as many as it accepts.
+// Once all are taken the least recently used one is remapped.
+class OutboundAliases final {
+public:
+  explicit OutboundAliases(uint16_t maximum) : maximum_(maximum) {}
+
+  TopicAlias assign(std::string_view topic);
+
+  size_t size() const { return lru_.size(); }
+
+private:
+  struct Entry {
+    std::string topic;
+    uint16_t id{0};
+  };
+
+  uint16_t const maximum_;
+  // Most recently used first.
+  std::list<Entry> lru_;
+  folly::F14FastMap<std::string_view, std::list<Entry>::iterator> index_;
+};
+}  // namespace warp::mqtt
@@ -1,13 +1,84 @@
 #pragma once
 
+#include <folly/Expected.h>
 #include <folly/io/IOBufQueue.h>
 
+#include <chrono>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <string>
+
+#include "warp/mqtt/alias.h"
 #include "warp/mqtt/message.h"
 
 namespace warp::mqtt {
 class Codec final {
 public:
-  static std::optional<Message> decode(folly::IOBufQueue& q);
+  // Why there is no frame size yet: the fixed header is still arriving, or
+  // its remaining length runs past four bytes and never will be whole.
+  enum class Error { Incomplete, Malformed };
+
+  // Packets other than Connect are decoded for the connection's level.
+  static std::optional<Message> decode(folly::IOBufQueue& q, Level level = Level::V311);
+  // Size of the frame at the front of the queue, known once its fixed header
+  // is in, well before the rest of it.
+  static folly::Expected<size_t, Error> frameSize(folly::IOBufQueue const& q);
   static std::unique_ptr<folly::IOBuf> encode(Message const& msg);
+  static void encode(Message const& msg, folly::IOBufQueue& q);
+};
+
+// A publish encoded once for delivery to many subscribers. QoS 0 recipients
+// share the same buffer; others get a small header with their own QoS bits and
+// packet id chained in front of the shared payload. The MQTT 5 encoding, with
+// properties, is built the first time an MQTT 5 subscriber needs it.
+class SharedPublish final : public std::enable_shared_from_this<SharedPublish> {
+public:
+  using Clock = std::chrono::steady_clock;
+
+  explicit SharedPublish(Publish const& msg, bool retain = false);
+
+  std::string const& topic() const { return topic_; }
+  uint8_t qos() const { return qos_; }
+  size_t size() const { return data_->computeChainDataLength(); }
+  Properties const& properties() const { return properties_; }
+
+  // True once the message expiry interval has passed since it arrived.
+  bool expired() const;
+
+  std::unique_ptr<folly::IOBuf> clone(
+      uint8_t qos, uint16_t packetId, Level level = Level::V311
+  ) const;
+  // MQTT 5 encoding that carries a topic alias.
+  std::unique_ptr<folly::IOBuf> clone(uint8_t qos, uint16_t packetId, TopicAlias alias) const;
+
+private:
+  Properties const& current(Properties& scratch) const;
+  // The header alone, in one buffer.
+  std::unique_ptr<folly::IOBuf> header(
+      uint8_t qos, uint16_t packetId, Properties const* properties, TopicAlias alias = {}
+  ) const;
+  // A QoS 0 frame to share, with a small payload copied in behind the header.
+  std::unique_ptr<folly::IOBuf> encode(Properties const* properties) const;
+  // One recipient's frame: the header with the payload chained behind it.
+  std::unique_ptr<folly::IOBuf> chain(std::unique_ptr<folly::IOBuf> head) const;
+  // A copy of a pre-encoded QoS 1 header with the QoS bits and the packet id
+  // at offset rewritten.
+  std::unique_ptr<folly::IOBuf> stamp(
+      folly::IOBuf const& head, size_t offset, uint8_t qos, uint16_t packetId
+  ) const;
+
+  std::string topic_;
+  uint8_t qos_{0};
+  uint8_t retain_{0};
+  Properties properties_;
+  std::optional<uint32_t> expiry_;
+  Clock::time_point received_;
+  std::unique_ptr<folly::IOBuf> data_;
+  std::unique_ptr<folly::IOBuf> head_;
+  std::unique_ptr<folly::IOBuf> payload_;
+  mutable std::once_flag once_;
+  mutable std::unique_ptr<folly::IOBuf> data5_;
+  mutable std::unique_ptr<folly::IOBuf> head5_;
 };
 }  // namespace warp::mqtt
@@ -0,0 +1,234 @@
+#pragma once
+
+#include <folly/container/F14Map.h>
+#include <folly/executors/SerialExecutor.h>
+#include <folly/io/IOBufQueue.h>
+#include <folly/io/async/EventBase.h>
+#include <folly/io/async/Request.h>
+#include <wangle/channel/Handler.h>
+
+#include <atomic>
+#include <chrono>
+#include <memory>
+#include <mutex>
+
+#include "warp/mqtt/limit.h"
+#include "warp/mqtt/message.h"
+#include "warp/mqtt/registry.h"
+#include "warp/mqtt/session.h"
+#include "warp/utils/ring.h"
+
+namespace warp::mqtt {
+// What a connection does once its outbound queue is over the limits: drop
+// its oldest QoS 0 publishes (disconnecting if only QoS 1 and 2 are left),
+// disconnect, or stop reading from the clients publishing to it until the
+// queue drains to half. A paused queue that still grows to twice the limits
+// disconnects.
+enum class Overflow : uint8_t { DropOldest, Disconnect, Pause };
+
+class ConnectionOptions {
+public:
+  size_t bytes{8 * 1024 * 1024};
+  size_t messages{16 * 1024};
+  Overflow overflow{Overflow::DropOldest};
+  // Topic aliases an MQTT 5 client may set up, and the most handed out to it.
+  uint16_t aliases{64};
+  // Largest packet a client may send, advertised to MQTT 5 clients.
+  uint32_t packet{16 * 1024 * 1024};
+  // Quiet period after which a connection gives back its buffers; zero keeps them.
+  std::chrono::seconds idle{30};
+};
+
+// Stands in for the socket at the front of the pipeline of a client that
+// speaks MQTT over WebSocket, so it gets the same handlers as a TCP client.
+class WebSocketTransport final : public wangle::OutboundBytesToBytesHandler {
+public:
+  // The WebSocket end of the pipeline; its EventBase only.
+  class Socket {
+  public:
+    virtual ~Socket() = default;
+    // Completes once the bytes are handed off and egress is not paused.
+    virtual folly::Future<folly::Unit> write(std::unique_ptr<folly::IOBuf> buf) = 0;
+    virtual void close() = 0;
+    virtual void setReading(bool on) = 0;
+  };
+
+  WebSocketTransport(folly::EventBase* evb, Socket* socket) : evb_(evb), socket_(socket) {}
+
+  folly::Future<folly::Unit> write(Context* ctx, std::unique_ptr<folly::IOBuf> buf) override {
+    if (!buf) return folly::makeFuture();
+    if (!evb_->isInEventBaseThread()) {
+      evb_->runInEventBaseThread(
+          [this, pipeline = ctx->getPipelineShared(), buf = std::move(buf)]() mutable {
+            if (socket_) socket_->write(std::move(buf));
+          }
+      );
+      return folly::makeFuture();
+    }
+    return socket_ ? socket_->write(std::move(buf)) : folly::makeFuture();
+  }
+
+  folly::Future<folly::Unit> close(Context*) override {
+    if (auto* socket = std::exchange(socket_, nullptr)) {
+      socket->close();
+    }
+    return folly::makeFuture();
+  }
+
+  folly::EventBase* eventBase() const { return evb_; }
+
+  void setReading(bool on) {
+    if (socket_) socket_->setReading(on);
+  }
+
+  // The socket is going away; nothing reaches it from here on.
+  void detach() { socket_ = nullptr; }
+
+private:
+  folly::EventBase* evb_;
+  Socket* socket_;
+};
+
+// Everything written on the IO thread during one loop iteration is gathered
+// into a single chain and handed to the socket once, as one writev. While a
+// write is in flight new data waits in a bounded queue; see Overflow for what
+// happens when a slow reader lets it fill up.
+class Connection final : public Channel,
+                         public Quota::Holder,
+                         public folly::EventBase::LoopCallback,
+                         public std::enable_shared_from_this<Connection> {
+public:
+  using Context = wangle::HandlerContext<Message, std::unique_ptr<folly::IOBuf>>;
+
+  Connection(
+      std::shared_ptr<SessionStore> sessions, std::shared_ptr<Registry> registry,
+      folly::EventBase* evb, Context* ctx,
+      folly::Executor::KeepAlive<folly::SerialExecutor> executor,
+      ConnectionOptions const& options
+  );
+
+  void write(std::unique_ptr<folly::IOBuf> buf) override;
+
+  // IO thread only. Acks and other small packets are encoded straight into
+  // a shared pack buffer, which joins the queue once anything else does.
+  // Responses count against the same limits as deliveries.
+  void send(Message const& msg);
+
+  void runLoopCallback() noexcept override;
+
+  // Packets of one connection run one at a time, in arrival order.
+  folly::Executor* executor() const { return executor_.get(); }
+
+  // Offloaded packets whose responses have not been written yet; IO thread only.
+  bool idle() const { return pending_ == 0; }
+  void enqueue() { ++pending_; }
+  void complete(Message msg);
+
+  // Stops reading from the socket until every pause has been resumed.
+  void pause();
+  void resume();
+
+  size_t queued() const override { return bytes(); }
+
+  Level level() const override { return level_.load(std::memory_order_relaxed); }
+  void setLevel(Level level) { level_.store(level, std::memory_order_relaxed); }
+
+  uint16_t aliases() const override { return aliases_.load(std::memory_order_relaxed); }
+  void setAliases(uint16_t aliases) { aliases_.store(aliases, std::memory_order_relaxed); }
+
+  ConnectionOptions const& options() const { return options_; }
+
+  folly::EventBase* eventBase() const override { return evb_; }
+
+  void evict(Reason reason) override;
+
+  // Holds the partial frames read from the client against the server's cap.
+  void reclaim() override { evict(Reason::QuotaExceeded); }
+
+  // Outbound bytes and messages queued or in flight, and messages dropped.
+  size_t bytes() const { return bytes_.load(std::memory_order_relaxed); }
+  size_t messages() const { return messages_.load(std::memory_order_relaxed); }
+  size_t dropped() const { return dropped_.load(std::memory_order_relaxed); }
+
+  bool attach(std::shared_ptr<Session> session);
+  std::shared_ptr<Session> session() const;
+
+  // Frees the outbound queue and bookkeeping of a quiet connection; IO thread only.
+  void shrink();
+
+  void close();
+
+private:
+  struct Entry {
+    std::unique_ptr<folly::IOBuf> buf;
+    size_t size{0};
+    bool droppable{false};
+    // More than one for a pack buffer.
+    size_t messages{1};
+  };
+
+  static constexpr size_t kBatchSize = 2048;
+  static constexpr size_t kMaxPack = 64;
+  // How far past the limits a paused queue may grow.
+  static constexpr size_t kHeadroom = 2;
+
+  bool over() const {
+    return bytes() > options_.bytes || messages() > options_.messages;
+  }
+
+  // Accounts for a delivery or response before it is queued, and applies
+  // the overflow policy; false if it must not be.
+  bool admit(size_t size);
+  void push(std::unique_ptr<folly::IOBuf> buf, size_t size);
+  // Moves what send() packed into the queue, behind everything before it.
+  void seal();
+  void schedule();
+  bool droppable(folly::IOBuf const& buf) const;
+  bool trim();
+  void flush();
+  void drained(size_t bytes, size_t messages);
+
+  void release(size_t bytes, size_t messages) {
+    bytes_.fetch_sub(bytes, std::memory_order_relaxed);
+    messages_.fetch_sub(messages, std::memory_order_relaxed);
+  }
+
+  void disconnect();
+  void setReading(bool on);
+  void throttle();
+  void resumePublishers();
+
+  std::shared_ptr<SessionStore> sessions_;
+  std::shared_ptr<Registry> registry_;
+  folly::EventBase* evb_;
+  Context* ctx_;
+  folly::Executor::KeepAlive<folly::SerialExecutor> executor_;
+  ConnectionOptions const options_;
+  size_t pending_{0};
+  utils::Ring<Entry> queue_;
+  // Small packets send() encoded since the last entry was queued.
+  folly::IOBufQueue pack_{folly::IOBufQueue::cacheChainLength()};
+  struct {
+    size_t size{0};
+    size_t messages{0};
+  } packed_;
+  size_t scan_{0};
+  bool writing_{false};
+  size_t paused_{0};
+  std::atomic<size_t> bytes_{0};
+  std::atomic<size_t> messages_{0};
+  std::atomic<size_t> dropped_{0};
+  std::atomic<Level> level_{Level::V311};
+  std::atomic<uint16_t> aliases_{0};
+  std::shared_ptr<Connection> self_;
+  std::mutex publishersMutex_;
+  folly::F14FastMap<Connection const*, std::weak_ptr<Connection>> publishers_;
+  mutable std::mutex mutex_;
+  std::shared_ptr<Session> session_;
+  bool closed_{false};
+};
+
+// The connection whose packets the current request context belongs to, if any.
+std::shared_ptr<Connection> getConnection() noexcept;
+void setConnection(folly::RequestContext& context, std::shared_ptr<Connection> connection);
+}  // namespace warp::mqtt
@@ -0,0 +1,38 @@
+#pragma once
+
+#include <folly/Function.h>
+#include <folly/io/async/EventBase.h>
+#include <folly/io/async/HHWheelTimer.h>
+
+#include <chrono>
+
+namespace warp::mqtt {
+// Keep-alive tracking on a coarse per-EventBase timing wheel. Activity only
+// records a timestamp; the wheel entry is moved when it fires early.
+class KeepAlive final : private folly::HHWheelTimer::Callback {
+public:
+  using Clock = std::chrono::steady_clock;
+
+  static constexpr std::chrono::milliseconds kTick{1000};
+
+  KeepAlive(folly::EventBase& evb, folly::Function<void()> expired);
+
+  void touch() noexcept { last_ = Clock::now(); }
+
+  void schedule(std::chrono::milliseconds timeout);
+  void cancel();
+
+  bool scheduled() const { return isScheduled(); }
+
+  static folly::HHWheelTimer& timer(folly::EventBase& evb);
+
+private:
+  void timeoutExpired() noexcept override;
+  void callbackCanceled() noexcept override {}
+
+  folly::HHWheelTimer& timer_;
+  folly::Function<void()> expired_;
+  std::chrono::milliseconds timeout_{0};
+  Clock::time_point last_{Clock::now()};
+};
+}  // namespace warp::mqtt
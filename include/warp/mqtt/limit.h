@@ -0,0 +1,87 @@
+#pragma once
+
+#include <folly/TokenBucket.h>
+#include <folly/container/F14Map.h>
+#include <folly/lang/Align.h>
+
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <memory>
+#include <mutex>
+#include <optional>
+
+namespace warp::mqtt {
+// Sustained rates a client, or a listener for new connections, is held to;
+// zero turns a limit off. Each may burst up to burst seconds worth of its rate.
+class LimitOptions {
+public:
+  double packets{0};
+  double bytes{0};
+  double connections{0};
+  double burst{1.0};
+};
+
+// A token bucket that never refuses: what is taken beyond the balance is
+// borrowed, and the caller is told how long to stay idle to pay it back.
+// Safe to share between threads.
+class Limiter final {
+public:
+  Limiter(double rate, double burst);
+
+  bool enabled() const { return bucket_.has_value(); }
+
+  std::chrono::milliseconds take(double n);
+  std::chrono::milliseconds take(double n, double now);
+
+private:
+  std::optional<folly::TokenBucket> bucket_;
+  double burst_{0};
+};
+
+// Bytes held by many holders against one cap; zero turns the cap off. Once
+// the cap is hit the largest holders are told to let go of what they hold,
+// so one client sitting on a huge partial frame cannot starve the rest.
+// Updates under the cap only lock the holder's shard.
+class Quota final {
+public:
+  class Holder {
+  public:
+    virtual ~Holder() = default;
+    // Gives back everything held, from any thread; usually by disconnecting.
+    virtual void reclaim() = 0;
+  };
+
+  explicit Quota(size_t limit) : limit_(limit) {}
+
+  // Sets what holder holds. Past the cap the largest holders are dropped,
+  // and told to reclaim, until the rest fits; false if holder is among them,
+  // in which case it is not told and is left to let go itself.
+  bool update(std::shared_ptr<Holder> const& holder, size_t bytes);
+
+  size_t used() const { return used_.load(std::memory_order_relaxed); }
+
+private:
+  static constexpr size_t kShards = 16;
+
+  struct Share {
+    std::weak_ptr<Holder> holder;
+    size_t bytes{0};
+  };
+
+  // used_ only changes with a shard locked, so with all of them it is still.
+  struct alignas(folly::hardware_destructive_interference_size) Shard {
+    std::mutex mutex;
+    folly::F14FastMap<Holder const*, Share> shares;
+  };
+
+  // Drops the largest holders, with every shard locked, until the rest fits;
+  // false if self is among them.
+  bool evict(Holder const* self);
+
+  size_t const limit_;
+  std::atomic<size_t> used_{0};
+  std::array<Shard, kShards> shards_;
+};
+}  // namespace warp::mqtt
@@ -2,11 +2,14 @@
 
 #include <folly/Varint.h>
 #include <folly/io/Cursor.h>
+#include <folly/io/IOBuf.h>
 
 #include <cstdint>
 #include <string>
 #include <variant>
 
+#include "warp/mqtt/properties.h"
+
 namespace warp::mqtt {
 enum class Type : uint8_t {
   None = 0,
@@ -38,9 +41,40 @@ enum class Level : uint8_t {
   V5,
 };
 
+// Reason codes of MQTT 5; anything from 0x80 up is a failure.
+enum class Reason : uint8_t {
+  Success = 0x00,
+  GrantedQos1 = 0x01,
+  GrantedQos2 = 0x02,
+  NoMatchingSubscribers = 0x10,
+  NoSubscriptionExisted = 0x11,
+  UnspecifiedError = 0x80,
+  MalformedPacket = 0x81,
+  ProtocolError = 0x82,
+  ImplementationError = 0x83,
+  UnsupportedVersion = 0x84,
+  ClientInvalid = 0x85,
+  NotAuthorized = 0x87,
+  ServerBusy = 0x89,
+  KeepAliveTimeout = 0x8D,
+  SessionTakenOver = 0x8E,
+  TopicFilterInvalid = 0x8F,
+  TopicNameInvalid = 0x90,
+  PacketIdInUse = 0x91,
+  PacketIdNotFound = 0x92,
+  ReceiveMaximumExceeded = 0x93,
+  TopicAliasInvalid = 0x94,
+  PacketTooLarge = 0x95,
+  MessageRateTooHigh = 0x96,
+  QuotaExceeded = 0x97,
+};
+
+// The protocol level is not on the wire after Connect; it is whatever the
+// connection negotiated, and the decoder carries it along.
 struct FixedHeader {
   uint8_t data{0};
   uint32_t size{0};
+  Level level{Level::V311};
 };
 
 enum class Flags : uint8_t {};
@@ -62,6 +96,18 @@ static inline void writeUTF8(folly::io::QueueAppender& a, folly::StringPiece str
   if (!str.empty()) a.push(reinterpret_cast<const uint8_t*>(str.data()), str.size());
 }
 
+static constexpr size_t kMaxPayloadCopy = 4096;
+
+static inline void writePayload(folly::io::QueueAppender& a, folly::IOBuf const& buf) {
+  if (buf.computeChainDataLength() > kMaxPayloadCopy) {
+    a.insert(buf);
+    return;
+  }
+  for (auto const range : buf) {
+    a.push(range.data(), range.size());
+  }
+}
+
 static inline bool readUTF8(folly::io::Cursor& cur, uint32_t& left, std::string& out) {
   if (left < 2) return false;
   uint16_t n = cur.readBE<uint16_t>();
@@ -84,6 +130,10 @@ static inline void writeFixedHeader(
   a.push(tmp, n);
 }
 
+static inline size_t sizeWithFixedHeader(uint32_t size) {
+  return 1u + folly::encodeVarintSize(size) + size;
+}
+
 static inline std::optional<FixedHeader> readFixedHeader(folly::io::Cursor& cur, size_t& size) {
   if (!cur.canAdvance(1)) return std::nullopt;
   const uint8_t first = cur.read<uint8_t>();
@@ -111,6 +161,7 @@ struct Connect {
     Level level{Level::V311};
     uint8_t flags{0};
     uint16_t timeout{0};
+    Properties properties{};
   };
 
   struct Payload {
@@ -122,6 +173,7 @@ struct Connect {
     uint8_t flags_{0};
     uint16_t timeout_{0};
     std::string client_{};
+    Properties properties_{};
 
     Builder& withLevel(Level const& level) {
       level_ = level;
@@ -147,13 +199,19 @@ struct Connect {
       return *this;
     }
 
+    Builder& withProperties(Properties properties) {
+      properties_ = std::move(properties);
+      return *this;
+    }
+
     Connect build() const {
       return Connect{
           .head{
               .head{.data = static_cast<uint8_t>(Type::Connect) << 4, .size = 0},
               .level = level_,
               .flags = flags_,
-              .timeout = timeout_
+              .timeout = timeout_,
+              .properties = properties_
           },
           .data{.client = client_}
       };
@@ -163,6 +221,8 @@ struct Connect {
   Header head{};
   Payload data{};
 
+  uint32_t length() const;
+  size_t size() const { return sizeWithFixedHeader(length()); }
   void encode(folly::io::QueueAppender& a) const;
   static std::optional<Connect> decode(FixedHeader const& head, folly::io::Cursor& cur);
 };
@@ -171,11 +231,15 @@ struct ConnAck {
   struct Header {
     uint8_t session{0};
     uint8_t reason{0};
+    Level level{Level::V311};
+    Properties properties{};
   };
 
   struct Builder final {
     uint8_t session_{0};
     uint8_t reason_{0};
+    Level level_{Level::V311};
+    Properties properties_{};
 
     Builder& withSession(uint8_t const session) {
       session_ = session;
@@ -187,11 +251,34 @@ struct ConnAck {
       return *this;
     }
 
-    ConnAck build() const { return ConnAck{.head{.session = session_, .reason = reason_}}; }
+    Builder& withReason(Reason const reason) { return withReason(static_cast<uint8_t>(reason)); }
+
+    Builder& withLevel(Level const level) {
+      level_ = level;
+      return *this;
+    }
+
+    Builder& withProperties(Properties properties) {
+      properties_ = std::move(properties);
+      return *this;
+    }
+
+    ConnAck build() const {
+      return ConnAck{
+          .head{
+              .session = session_,
+              .reason = reason_,
+              .level = level_,
+              .properties = properties_
+          }
+      };
+    }
   };
 
   Header head{};
 
+  uint32_t length() const;
+  size_t size() const { return sizeWithFixedHeader(length()); }
   void encode(folly::io::QueueAppender& a) const;
   static std::optional<ConnAck> decode(FixedHeader const& head, folly::io::Cursor& cur);
 };
@@ -204,19 +291,23 @@ struct Publish {
     uint8_t qos{0};
     uint8_t dup{0};
     uint8_t retain{0};
+    Level level{Level::V311};
+    Properties properties{};
   };
 
   struct Payload {
-    std::string data;
+    folly::IOBuf data{};
   };
 
   struct Builder final {
     std::string topic_{};
-    std::string data_{};
+    folly::IOBuf data_{};
     uint16_t packetId_{0};
     uint8_t qos_{0};
     uint8_t dup_{0};
     uint8_t retain_{0};
+    Level level_{Level::V311};
+    Properties properties_{};
 
     Builder& withTopic(std::string const& topic) {
       topic_ = topic;
@@ -224,7 +315,12 @@ struct Publish {
     }
 
     Builder& withPayload(std::string const& data) {
-      data_ = data;
+      data_ = folly::IOBuf(folly::IOBuf::COPY_BUFFER, data);
+      return *this;
+    }
+
+    Builder& withPayload(folly::IOBuf data) {
+      data_ = std::move(data);
       return *this;
     }
 
@@ -248,6 +344,16 @@ struct Publish {
       return *this;
     }
 
+    Builder& withLevel(Level const level) {
+      level_ = level;
+      return *this;
+    }
+
+    Builder& withProperties(Properties properties) {
+      properties_ = std::move(properties);
+      return *this;
+    }
+
     Publish build() const {
       Publish msg;
       msg.head.topic = topic_;
@@ -255,6 +361,8 @@ struct Publish {
       msg.head.qos = qos_;
       msg.head.dup = dup_;
       msg.head.retain = retain_;
+      msg.head.level = level_;
+      msg.head.properties = properties_;
       msg.data.data = data_;
       return msg;
     }
@@ -263,6 +371,8 @@ struct Publish {
   Header head{};
   Payload data{};
 
+  uint32_t length() const;
+  size_t size() const { return sizeWithFixedHeader(length()); }
   void encode(folly::io::QueueAppender& a) const;
   static std::optional<Publish> decode(FixedHeader const& head, folly::io::Cursor& cur);
 };
@@ -270,24 +380,43 @@ struct Publish {
 struct PubAck {
   struct Header {
     uint16_t packetId{0};
+    uint8_t reason{0};
+    Properties properties{};
   };
 
   struct Builder final {
     uint16_t packetId_{0};
+    uint8_t reason_{0};
+    Properties properties_{};
 
     Builder& withPacketId(uint16_t id) {
       packetId_ = id;
       return *this;
     }
+
+    Builder& withReason(Reason const reason) {
+      reason_ = static_cast<uint8_t>(reason);
+      return *this;
+    }
+
+    Builder& withProperties(Properties properties) {
+      properties_ = std::move(properties);
+      return *this;
+    }
+
     PubAck build() const {
       PubAck msg;
       msg.head.packetId = packetId_;
+      msg.head.reason = reason_;
+      msg.head.properties = properties_;
       return msg;
     }
   };
 
   Header head{};
 
+  uint32_t length() const;
+  size_t size() const { return sizeWithFixedHeader(length()); }
   void encode(folly::io::QueueAppender& a) const;
   static std::optional<PubAck> decode(FixedHeader const& head, folly::io::Cursor& cur);
 };
@@ -295,25 +424,43 @@ struct PubAck {
 struct PubRec {
   struct Header {
     uint16_t packetId{0};
+    uint8_t reason{0};
+    Properties properties{};
   };
 
   struct Builder final {
     uint16_t packetId_{0};
+    uint8_t reason_{0};
+    Properties properties_{};
 
     Builder& withPacketId(uint16_t id) {
       packetId_ = id;
       return *this;
     }
 
+    Builder& withReason(Reason const reason) {
+      reason_ = static_cast<uint8_t>(reason);
+      return *this;
+    }
+
+    Builder& withProperties(Properties properties) {
+      properties_ = std::move(properties);
+      return *this;
+    }
+
     PubRec build() const {
       PubRec msg;
       msg.head.packetId = packetId_;
+      msg.head.reason = reason_;
+      msg.head.properties = properties_;
       return msg;
     }
   };
 
   Header head{};
 
+  uint32_t length() const;
+  size_t size() const { return sizeWithFixedHeader(length()); }
   void encode(folly::io::QueueAppender& a) const;
   static std::optional<PubRec> decode(FixedHeader const& head, folly::io::Cursor& cur);
 };
@@ -321,25 +468,43 @@ struct PubRec {
 struct PubRel {
   struct Header {
     uint16_t packetId{0};
+    uint8_t reason{0};
+    Properties properties{};
   };
 
   struct Builder final {
     uint16_t packetId_{0};
+    uint8_t reason_{0};
+    Properties properties_{};
 
     Builder& withPacketId(uint16_t id) {
       packetId_ = id;
       return *this;
     }
 
+    Builder& withReason(Reason const reason) {
+      reason_ = static_cast<uint8_t>(reason);
+      return *this;
+    }
+
+    Builder& withProperties(Properties properties) {
+      properties_ = std::move(properties);
+      return *this;
+    }
+
     PubRel build() const {
       PubRel msg;
       msg.head.packetId = packetId_;
+      msg.head.reason = reason_;
+      msg.head.properties = properties_;
       return msg;
     }
   };
 
   Header head{};
 
+  uint32_t length() const;
+  size_t size() const { return sizeWithFixedHeader(length()); }
   void encode(folly::io::QueueAppender& a) const;
   static std::optional<PubRel> decode(FixedHeader const& head, folly::io::Cursor& cur);
 };
@@ -347,37 +512,60 @@ struct PubRel {
 struct PubComp {
   struct Header {
     uint16_t packetId{0};
+    uint8_t reason{0};
+    Properties properties{};
   };
 
   struct Builder final {
     uint16_t packetId_{0};
+    uint8_t reason_{0};
+    Properties properties_{};
 
     Builder& withPacketId(uint16_t id) {
       packetId_ = id;
       return *this;
     }
 
+    Builder& withReason(Reason const reason) {
+      reason_ = static_cast<uint8_t>(reason);
+      return *this;
+    }
+
+    Builder& withProperties(Properties properties) {
+      properties_ = std::move(properties);
+      return *this;
+    }
+
     PubComp build() const {
       PubComp msg;
       msg.head.packetId = packetId_;
+      msg.head.reason = reason_;
+      msg.head.properties = properties_;
       return msg;
     }
   };
 
   Header head{};
 
+  uint32_t length() const;
+  size_t size() const { return sizeWithFixedHeader(length()); }
   void encode(folly::io::QueueAppender& a) const;
   static std::optional<PubComp> decode(FixedHeader const& head, folly::io::Cursor& cur);
 };
 
 struct Subscribe {
+  // Options holds the MQTT 5 subscription bits: no local, retain as
+  // published and retain handling.
   struct Topic {
     std::string filter;
     uint8_t qos{0};
+    uint8_t options{0};
   };
 
   struct Header {
     uint16_t packetId{0};
+    Level level{Level::V311};
+    Properties properties{};
   };
 
   struct Payload {
@@ -390,24 +578,41 @@ struct Subscribe {
   struct Builder final {
     uint16_t packetId_{0};
     std::vector<Topic> topics_;
+    Level level_{Level::V311};
+    Properties properties_{};
 
     Builder& withPacketId(uint16_t id) {
       packetId_ = id;
       return *this;
     }
-    Builder& addTopic(std::string filter, uint8_t qos) {
-      topics_.push_back(Topic{std::move(filter), static_cast<uint8_t>(qos & 0x03)});
+    Builder& addTopic(std::string filter, uint8_t qos, uint8_t options = 0) {
+      auto const bits = static_cast<uint8_t>(options & 0x3C);
+      topics_.push_back(Topic{std::move(filter), static_cast<uint8_t>(qos & 0x03), bits});
+      return *this;
+    }
+
+    Builder& withLevel(Level const level) {
+      level_ = level;
+      return *this;
+    }
+
+    Builder& withProperties(Properties properties) {
+      properties_ = std::move(properties);
       return *this;
     }
 
     Subscribe build() const {
       Subscribe msg;
       msg.head.packetId = packetId_;
+      msg.head.level = level_;
+      msg.head.properties = properties_;
       msg.data.topics = topics_;
       return msg;
     }
   };
 
+  uint32_t length() const;
+  size_t size() const { return sizeWithFixedHeader(length()); }
   void encode(folly::io::QueueAppender& a) const;
   static std::optional<Subscribe> decode(FixedHeader const& head, folly::io::Cursor& cur);
 };
@@ -415,6 +620,8 @@ struct Subscribe {
 struct SubAck {
   struct Header {
     uint16_t packetId{0};
+    Level level{Level::V311};
+    Properties properties{};
   };
 
   struct Payload {
@@ -427,6 +634,8 @@ struct SubAck {
   struct Builder final {
     uint16_t packetId_{0};
     std::vector<uint8_t> codes_;
+    Level level_{Level::V311};
+    Properties properties_{};
 
     Builder& withPacketId(uint16_t id) {
       packetId_ = id;
@@ -449,14 +658,28 @@ struct SubAck {
       return *this;
     }
 
+    Builder& withLevel(Level const level) {
+      level_ = level;
+      return *this;
+    }
+
+    Builder& withProperties(Properties properties) {
+      properties_ = std::move(properties);
+      return *this;
+    }
+
     SubAck build() const {
       SubAck msg;
       msg.head.packetId = packetId_;
+      msg.head.level = level_;
+      msg.head.properties = properties_;
       msg.data.codes = codes_;
       return msg;
     }
   };
 
+  uint32_t length() const;
+  size_t size() const { return sizeWithFixedHeader(length()); }
   void encode(folly::io::QueueAppender& a) const;
   static std::optional<SubAck> decode(FixedHeader const& head, folly::io::Cursor& cur);
 };
@@ -464,6 +687,8 @@ struct SubAck {
 struct Unsubscribe {
   struct Header {
     uint16_t packetId{0};
+    Level level{Level::V311};
+    Properties properties{};
   };
 
   struct Payload {
@@ -476,6 +701,8 @@ struct Unsubscribe {
   struct Builder final {
     uint16_t packetId_{0};
     std::vector<std::string> topics_;
+    Level level_{Level::V311};
+    Properties properties_{};
 
     Builder& withPacketId(uint16_t id) {
       packetId_ = id;
@@ -487,40 +714,85 @@ struct Unsubscribe {
       return *this;
     }
 
+    Builder& withLevel(Level const level) {
+      level_ = level;
+      return *this;
+    }
+
+    Builder& withProperties(Properties properties) {
+      properties_ = std::move(properties);
+      return *this;
+    }
+
     Unsubscribe build() const {
       Unsubscribe msg;
       msg.head.packetId = packetId_;
+      msg.head.level = level_;
+      msg.head.properties = properties_;
       msg.data.topics = topics_;
       return msg;
     }
   };
 
+  uint32_t length() const;
+  size_t size() const { return sizeWithFixedHeader(length()); }
   void encode(folly::io::QueueAppender& a) const;
   static std::optional<Unsubscribe> decode(FixedHeader const& head, folly::io::Cursor& cur);
 };
 
+// Reason codes per topic are only sent to MQTT 5 clients.
 struct UnsubAck {
   struct Header {
     uint16_t packetId{0};
+    Level level{Level::V311};
+    Properties properties{};
+  };
+
+  struct Payload {
+    std::vector<uint8_t> codes;
   };
 
   struct Builder final {
     uint16_t packetId_{0};
+    std::vector<uint8_t> codes_;
+    Level level_{Level::V311};
+    Properties properties_{};
 
     Builder& withPacketId(uint16_t id) {
       packetId_ = id;
       return *this;
     }
 
+    Builder& addCode(Reason code) {
+      codes_.push_back(static_cast<uint8_t>(code));
+      return *this;
+    }
+
+    Builder& withLevel(Level const level) {
+      level_ = level;
+      return *this;
+    }
+
+    Builder& withProperties(Properties properties) {
+      properties_ = std::move(properties);
+      return *this;
+    }
+
     UnsubAck build() const {
       UnsubAck msg;
       msg.head.packetId = packetId_;
+      msg.head.level = level_;
+      msg.head.properties = properties_;
+      msg.data.codes = codes_;
       return msg;
     }
   };
 
   Header head{};
+  Payload data{};
 
+  uint32_t length() const;
+  size_t size() const { return sizeWithFixedHeader(length()); }
   void encode(folly::io::QueueAppender& a) const;
   static std::optional<UnsubAck> decode(FixedHeader const& head, folly::io::Cursor& cur);
 };
@@ -530,6 +802,7 @@ struct PingReq {
     PingReq build() const { return PingReq{}; }
   };
 
+  size_t size() const { return sizeWithFixedHeader(0u); }
   void encode(folly::io::QueueAppender& a) const;
   static std::optional<PingReq> decode(FixedHeader const& head, folly::io::Cursor&);
 };
@@ -539,20 +812,49 @@ struct PingResp {
     PingResp build() const { return PingResp{}; }
   };
 
+  size_t size() const { return sizeWithFixedHeader(0u); }
   void encode(folly::io::QueueAppender& a) const;
   static std::optional<PingResp> decode(FixedHeader const& head, folly::io::Cursor&);
 };
 
 struct Disconnect {
+  struct Header {
+    uint8_t reason{0};
+    Properties properties{};
+  };
+
   struct Builder final {
-    Disconnect build() const { return Disconnect{}; }
+    uint8_t reason_{0};
+    Properties properties_{};
+
+    Builder& withReason(Reason const reason) {
+      reason_ = static_cast<uint8_t>(reason);
+      return *this;
+    }
+
+    Builder& withProperties(Properties properties) {
+      properties_ = std::move(properties);
+      return *this;
+    }
+
+    Disconnect build() const {
+      Disconnect msg;
+      msg.head.reason = reason_;
+      msg.head.properties = properties_;
+      return msg;
+    }
   };
 
+  Header head{};
+
+  uint32_t length() const;
+  size_t size() const { return sizeWithFixedHeader(length()); }
   void encode(folly::io::QueueAppender& a) const;
-  static std::optional<Disconnect> decode(FixedHeader const& head, folly::io::Cursor&);
+  static std::optional<Disconnect> decode(FixedHeader const& head, folly::io::Cursor& cur);
 };
 
 struct None {
+  size_t size() const { return 0; }
   void encode(folly::io::QueueAppender&) const {}
 };
 
@@ -0,0 +1,100 @@
+#pragma once
+
+#include <folly/Varint.h>
+#include <folly/io/Cursor.h>
+#include <folly/io/IOBuf.h>
+
+#include <cstdint>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+namespace warp::mqtt {
+static inline bool readVarint(folly::io::Cursor& cur, uint32_t& left, uint32_t& out) {
+  out = 0;
+  for (int i = 0; i < 4; ++i) {
+    if (left < 1 || !cur.canAdvance(1)) return false;
+    uint8_t const encoded = cur.read<uint8_t>();
+    left -= 1;
+    out |= static_cast<uint32_t>(encoded & 0x7F) << (7 * i);
+    if ((encoded & 0x80) == 0) return true;
+  }
+  return false;
+}
+
+// MQTT 5 properties, kept as the bytes they arrived in. Nothing is decoded
+// up front; each accessor scans for the property it is asked for, so routing
+// a publish never pays for user properties it only passes along.
+class Properties final {
+public:
+  enum class Id : uint8_t {
+    PayloadFormat = 0x01,
+    MessageExpiry = 0x02,
+    ContentType = 0x03,
+    ResponseTopic = 0x08,
+    CorrelationData = 0x09,
+    SubscriptionId = 0x0B,
+    SessionExpiry = 0x11,
+    AssignedClient = 0x12,
+    ServerKeepAlive = 0x13,
+    AuthMethod = 0x15,
+    AuthData = 0x16,
+    RequestProblem = 0x17,
+    WillDelay = 0x18,
+    RequestResponse = 0x19,
+    ResponseInfo = 0x1A,
+    ServerReference = 0x1C,
+    ReasonString = 0x1F,
+    ReceiveMaximum = 0x21,
+    TopicAliasMaximum = 0x22,
+    TopicAlias = 0x23,
+    MaximumQos = 0x24,
+    RetainAvailable = 0x25,
+    UserProperty = 0x26,
+    MaximumPacketSize = 0x27,
+    WildcardAvailable = 0x28,
+    SubscriptionIdAvailable = 0x29,
+    SharedAvailable = 0x2A,
+  };
+
+  Properties() = default;
+  explicit Properties(folly::IOBuf data) : data_(std::move(data)) {}
+
+  bool empty() const { return data_.empty(); }
+  folly::IOBuf const& data() const { return data_; }
+
+  // Encoded size including the length prefix.
+  uint32_t size() const;
+
+  bool contains(Id id) const;
+  std::optional<uint32_t> integer(Id id) const;
+  // String and binary properties.
+  std::optional<std::string> string(Id id) const;
+  std::vector<std::pair<std::string, std::string>> users() const;
+
+  std::optional<uint32_t> sessionExpiry() const { return integer(Id::SessionExpiry); }
+  std::optional<uint32_t> messageExpiry() const { return integer(Id::MessageExpiry); }
+  std::optional<uint32_t> topicAlias() const { return integer(Id::TopicAlias); }
+  std::optional<std::string> reasonString() const { return string(Id::ReasonString); }
+
+  Properties& add(Id id, uint32_t value);
+  Properties& add(Id id, std::string_view value);
+  Properties& addUser(std::string_view key, std::string_view value);
+
+  // A copy without any property with the given id.
+  Properties without(Id id) const;
+  // A copy with the integer property set to value.
+  Properties with(Id id, uint32_t value) const;
+
+  // False if the bytes are not a well-formed property list.
+  bool valid() const;
+
+  void encode(folly::io::QueueAppender& a) const;
+  static bool decode(folly::io::Cursor& cur, uint32_t& left, Properties& out);
+
+private:
+  folly::IOBuf data_{};
+};
+}  // namespace warp::mqtt
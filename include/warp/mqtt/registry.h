@@ -0,0 +1,28 @@
+#pragma once
+
+#include <folly/concurrency/ConcurrentHashMap.h>
+
+#include <memory>
+#include <string>
+
+#include "warp/mqtt/session.h"
+
+namespace warp::mqtt {
+// Live connections by client id. The map is sharded and a takeover swaps the
+// entry in place, so a reconnect storm only contends on the shard each client
+// id hashes to and never on one lock.
+class Registry final {
+public:
+  // Registers channel for the client and returns the channel it took over
+  // from, if any; the caller closes that one.
+  std::shared_ptr<Channel> add(std::string const& client, std::shared_ptr<Channel> channel);
+  // Removes the client only while channel is still the one registered for it.
+  bool remove(std::string const& client, Channel const* channel);
+
+  std::shared_ptr<Channel> find(std::string const& client) const;
+  size_t size() const;
+
+private:
+  folly::ConcurrentHashMap<std::string, std::shared_ptr<Channel>> channels_;
+};
+}  // namespace warp::mqtt
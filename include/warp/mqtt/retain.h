@@ -0,0 +1,38 @@
+#pragma once
+
+#include <folly/SharedMutex.h>
+
+#include <memory>
+#include <string_view>
+#include <vector>
+
+#include "warp/mqtt/codec.h"
+#include "warp/mqtt/topic.h"
+
+namespace warp::mqtt {
+class RetainStore final {
+public:
+  explicit RetainStore(size_t limit = 64 * 1024 * 1024);
+  ~RetainStore();
+
+  bool retain(Publish const& msg);
+  bool retain(Publish const& msg, Topic const& topic);
+
+  void match(std::string_view filter, std::vector<std::shared_ptr<SharedPublish const>>& out)
+      const;
+
+  size_t size() const;
+  size_t bytes() const;
+
+private:
+  struct Node;
+
+  bool retain(Publish const& msg, TopicLevels const& levels);
+
+  mutable folly::SharedMutex mutex_;
+  std::unique_ptr<Node> root_;
+  size_t limit_;
+  size_t size_{0};
+  size_t bytes_{0};
+};
+}  // namespace warp::mqtt
@@ -2,14 +2,47 @@
 
 #include <proxygen/httpserver/RequestHandlerFactory.h>
 
+#include <chrono>
 #include <memory>
 
+#include "warp/mqtt/connection.h"
+#include "warp/mqtt/limit.h"
+#include "warp/mqtt/registry.h"
+#include "warp/mqtt/session.h"
+#include "warp/websocket/deflate.h"
+
 namespace warp::mqtt {
+// Where the service handles decoded packets: always on the CPU executor,
+// inline on the IO thread for everything but Publish and Subscribe, or
+// always inline.
+enum class Dispatch : uint8_t { Executor, Control, Inline };
+
+// How much one read may decode before the connection yields its EventBase
+// to the others on it; the rest is picked up later in the same iteration.
+class ReadOptions {
+public:
+  size_t messages{64};
+  size_t bytes{256 * 1024};
+};
+
 class ServerOptions {
 public:
   uint16_t port{1883};
   size_t threads{0};
+  Dispatch dispatch{Dispatch::Executor};
+  Balance balance{Balance::RoundRobin};
   std::string path{"/mqtt"};
+  // Compression offered to clients connecting over WebSocket.
+  websocket::DeflateOptions deflate{};
+  size_t retained{64 * 1024 * 1024};
+  size_t topics{1024 * 1024};
+  // Bytes all connections may hold read but not yet decoded, which is
+  // mostly frames still arriving.
+  size_t partial{256 * 1024 * 1024};
+  SessionOptions session{};
+  ConnectionOptions connection{};
+  LimitOptions limits{};
+  ReadOptions read{};
 };
 
 class Server final {
@@ -22,7 +55,11 @@ public:
 
   std::shared_ptr<proxygen::RequestHandlerFactory> getHandlerFactory();
 
+  // Connected clients by id.
+  std::shared_ptr<Registry> registry() const { return registry_; }
+
 private:
   std::shared_ptr<ServerOptions> options_;
+  std::shared_ptr<Registry> registry_;
 };
 }  // namespace warp::mqtt
@@ -0,0 +1,198 @@
+#pragma once
+
+#include <folly/concurrency/ConcurrentHashMap.h>
+#include <folly/container/F14Map.h>
+#include <folly/container/F14Set.h>
+#include <folly/io/IOBuf.h>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <utility>
+
+#include "warp/mqtt/alias.h"
+#include "warp/mqtt/trie.h"
+#include "warp/utils/ring.h"
+
+namespace folly {
+class EventBase;
+}  // namespace folly
+
+namespace warp::mqtt {
+// The live transport a session delivers to while its client is connected.
+class Channel {
+public:
+  virtual ~Channel() = default;
+
+  virtual void write(std::unique_ptr<folly::IOBuf> buf) = 0;
+
+  // Bytes written but not yet sent.
+  virtual size_t queued() const { return 0; }
+
+  // Protocol level deliveries are encoded for.
+  virtual Level level() const { return Level::V311; }
+
+  // Topic aliases the client accepts.
+  virtual uint16_t aliases() const { return 0; }
+
+  // The loop the connection runs on, if any.
+  virtual folly::EventBase* eventBase() const { return nullptr; }
+
+  // Closes the connection, telling an MQTT 5 client why.
+  virtual void evict(Reason) {}
+};
+
+class SessionOptions {
+public:
+  size_t bytes{1024 * 1024};
+  size_t messages{1024};
+  size_t total{256 * 1024 * 1024};
+  // QoS 1 and 2 deliveries a client may leave unacknowledged; further ones
+  // wait in the queue, with its limits, until it catches up.
+  size_t inflight{1024};
+};
+
+// A session outlives its connection for its expiry interval: zero ends it
+// with the connection, kNever keeps it until a clean start replaces it.
+// QoS 1 and 2 deliveries stay with it until the client acknowledges them,
+// and go out again, marked as duplicates, when it reconnects.
+class Session final : public Subscriber, public std::enable_shared_from_this<Session> {
+public:
+  using Clock = std::chrono::steady_clock;
+
+  static constexpr std::chrono::seconds kNever = std::chrono::seconds::max();
+
+  // Offline queue limits and the byte count shared by every session of a store.
+  struct Budget {
+    SessionOptions options;
+    std::atomic<size_t> bytes{0};
+  };
+
+  Session(
+      std::string client, std::chrono::seconds expiry, std::shared_ptr<Trie> trie,
+      std::shared_ptr<Budget> budget
+  );
+  ~Session() override;
+
+  std::string const& client() const { return client_; }
+  bool clean() const;
+
+  void setExpiry(std::chrono::seconds expiry);
+  // True once the session has been offline for longer than its expiry.
+  bool expired(Clock::time_point now) const;
+
+  void publish(SharedPublish const& msg, uint8_t qos) override;
+  // Reads an atomic, so balancing a shared subscription never takes mutex_.
+  size_t load() const override;
+  // The channel's outbound bytes, reported as it drains. Ignored once the
+  // session is offline.
+  void setBacklog(size_t bytes);
+
+  bool subscribe(std::string const& filter, uint8_t qos);
+  // Also tells whether the session was already subscribed to filter.
+  bool subscribe(std::string const& filter, uint8_t qos, bool& existed);
+  bool unsubscribe(std::string const& filter);
+
+  // The client's PubAck or PubComp: the delivery with packetId is done.
+  bool acknowledge(uint16_t packetId);
+  // The client's PubRec: only the PubRel of packetId is left to deliver.
+  bool received(uint16_t packetId);
+
+  // The client's QoS 2 Publish: false if packetId is already held, so the
+  // message was routed before and this is a resend.
+  bool accept(uint16_t packetId);
+  // The client's PubRel: packetId may be used for a new message.
+  bool complete(uint16_t packetId);
+
+  // Binds the session to a connection and flushes what was queued while offline.
+  void attach(std::shared_ptr<Channel> channel);
+  // False if the session has moved on to another channel.
+  bool detach(Channel const* channel);
+  void clear();
+
+  size_t queued() const;
+  size_t inflight() const;
+  size_t bytes() const;
+  size_t dropped() const;
+
+private:
+  struct Entry {
+    std::shared_ptr<SharedPublish const> msg;
+    uint8_t qos{0};
+  };
+
+  struct Flight {
+    // Dropped once the client has it and only the PubRel is left.
+    std::shared_ptr<SharedPublish const> msg;
+    uint8_t qos{0};
+    // Order the deliveries went out in, which is the order they go out again.
+    uint64_t sequence{0};
+  };
+
+  // Encodes a delivery and, for QoS 1 and 2, holds it until acknowledged.
+  std::unique_ptr<folly::IOBuf> encode(SharedPublish const& msg, uint8_t qos);
+  std::unique_ptr<folly::IOBuf> clone(SharedPublish const& msg, uint8_t qos, uint16_t packetId);
+  // Encodes what is queued, oldest first, while the client has room for it.
+  void drain(std::unique_ptr<folly::IOBuf>& chain);
+  // Packet ids are 16 bits, so there are never more in flight than that.
+  bool full() const {
+    return inflight_.size() >= std::min<size_t>(budget_->options.inflight, 0xFFFF);
+  }
+  uint16_t nextPacketId();
+  void release(size_t size);
+
+  std::string const client_;
+  std::shared_ptr<Trie> trie_;
+  std::shared_ptr<Budget> budget_;
+  mutable std::mutex mutex_;
+  std::chrono::seconds expiry_;
+  Clock::time_point offline_;
+  std::shared_ptr<Channel> channel_;
+  Level level_{Level::V311};
+  // Outbound aliases belong to the connection, so they start over on attach.
+  std::unique_ptr<OutboundAliases> aliases_;
+  // What load() returns: the channel's outbound bytes, or kOffline.
+  std::atomic<size_t> backlog_{kOffline};
+  folly::F14FastSet<std::string> filters_;
+  utils::Ring<Entry> queue_;
+  folly::F14FastMap<uint16_t, Flight> inflight_;
+  // Inbound QoS 2 packet ids between the client's Publish and its PubRel.
+  folly::F14FastSet<uint16_t> incoming_;
+  uint64_t sequence_{0};
+  size_t bytes_{0};
+  size_t dropped_{0};
+  uint16_t packetId_{1};
+};
+
+class SessionStore final {
+public:
+  explicit SessionStore(std::shared_ptr<Trie> trie, SessionOptions const& options = {});
+  ~SessionStore();
+
+  // Returns the session for a client and whether an existing one was resumed.
+  // Without an expiry, clean sessions end with the connection and others
+  // never expire.
+  std::pair<std::shared_ptr<Session>, bool> open(std::string const& client, bool clean);
+  std::pair<std::shared_ptr<Session>, bool> open(
+      std::string const& client, bool clean, std::chrono::seconds expiry
+  );
+  void close(std::shared_ptr<Session> const& session, Channel const* channel);
+
+  // Drops sessions that expired while offline; also runs every kSweep opens.
+  size_t expire();
+
+  size_t size() const;
+  size_t bytes() const;
+
+private:
+  static constexpr size_t kSweep = 1024;
+
+  std::shared_ptr<Trie> trie_;
+  std::shared_ptr<Session::Budget> budget_;
+  folly::ConcurrentHashMap<std::string, std::shared_ptr<Session>> sessions_;
+  std::atomic<size_t> opens_{0};
+};
+}  // namespace warp::mqtt
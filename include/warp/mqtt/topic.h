@@ -0,0 +1,88 @@
+#pragma once
+
+#include <folly/SharedMutex.h>
+#include <folly/container/F14Map.h>
+#include <folly/lang/Align.h>
+#include <folly/small_vector.h>
+
+#include <array>
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+namespace warp::mqtt {
+class Subscriber;
+
+using TopicLevels = folly::small_vector<std::string_view, 8>;
+
+TopicLevels splitTopic(std::string_view topic);
+
+// A topic name split into levels once, along with the subscribers the trie
+// last matched it to. Interned, both are shared by every publish to it;
+// others cache no route.
+class Topic final {
+public:
+  Topic(std::string name, bool interned);
+  Topic(Topic const&) = delete;
+  Topic& operator=(Topic const&) = delete;
+
+  bool interned() const { return interned_; }
+  std::string const& name() const { return name_; }
+  TopicLevels const& levels() const { return levels_; }
+
+private:
+  friend class Trie;
+  friend class TopicTable;
+
+  // Subscribers the trie matched, kept until a subscription that could match
+  // the topic changes; see Trie. Held weakly, so a cached route does not keep
+  // a closed session alive.
+  struct Route {
+    size_t slot{0};
+    uint64_t generation{0};
+    uint64_t wildcard{0};
+    std::vector<std::pair<std::weak_ptr<Subscriber>, uint8_t>> matches;
+  };
+
+  // Whether a subscriber the trie last matched is still around.
+  bool routed() const;
+
+  bool const interned_;
+  std::string const name_;
+  TopicLevels const levels_;
+  mutable std::atomic<std::shared_ptr<Route const>> route_;
+};
+
+class TopicTable final {
+public:
+  explicit TopicTable(size_t limit = 1024 * 1024);
+
+  // Once the table is full, topics nothing holds and no subscriber is routed
+  // to make room; failing that, new names come back uninterned.
+  std::shared_ptr<Topic const> intern(std::string_view name);
+
+  size_t size() const { return size_.load(std::memory_order_relaxed); }
+
+private:
+  static constexpr size_t kShards = 16;
+  // A full table is swept once every this many names it turns away.
+  static constexpr size_t kSweep = 1024;
+
+  struct alignas(folly::hardware_destructive_interference_size) Shard {
+    mutable folly::SharedMutex mutex;
+    folly::F14FastMap<std::string_view, std::shared_ptr<Topic const>> topics;
+  };
+
+  // Drops the topics that can go and returns how many did.
+  size_t evict();
+
+  size_t const limit_;
+  std::array<Shard, kShards> shards_;
+  std::atomic<size_t> size_{0};
+  std::atomic<size_t> misses_{0};
+};
+}  // namespace warp::mqtt
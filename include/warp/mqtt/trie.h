@@ -0,0 +1,90 @@
+#pragma once
+
+#include <folly/SharedMutex.h>
+#include <folly/container/F14Map.h>
+
+#include <array>
+#include <atomic>
+#include <cstdint>
+#include <limits>
+#include <memory>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+#include "warp/mqtt/codec.h"
+#include "warp/mqtt/topic.h"
+
+namespace warp::mqtt {
+class Subscriber {
+public:
+  static constexpr size_t kOffline = std::numeric_limits<size_t>::max();
+
+  virtual ~Subscriber() = default;
+
+  virtual void publish(SharedPublish const& msg, uint8_t qos) = 0;
+
+  // Outbound backlog used to balance shared subscriptions, or kOffline.
+  virtual size_t load() const { return 0; }
+};
+
+// How a shared subscription picks the member that gets a message.
+enum class Balance : uint8_t { RoundRobin, LeastLoaded };
+
+// Filters of the form $share/<group>/<filter> join a group that receives
+// each matching message once, delivered to one of its members.
+class Trie final {
+public:
+  struct Match {
+    std::shared_ptr<Subscriber> subscriber;
+    uint8_t qos{0};
+  };
+
+  explicit Trie(Balance balance = Balance::RoundRobin);
+  ~Trie();
+
+  bool subscribe(std::string_view filter, std::shared_ptr<Subscriber> subscriber, uint8_t qos);
+  bool unsubscribe(std::string_view filter, Subscriber const* subscriber);
+
+  void match(std::string_view topic, std::vector<Match>& out) const;
+  // Reuses the topic's cached matches unless a subscription that could match
+  // it changed since.
+  void match(Topic const& topic, std::vector<Match>& out) const;
+
+  size_t size() const;
+
+private:
+  struct Node;
+  class Group;
+
+  static constexpr size_t kSlots = 64;
+
+  bool insert(std::string_view filter, Match match);
+  bool remove(std::string_view filter, Subscriber const* subscriber);
+  // Invalidates the routes a change to a filter with these levels may affect.
+  void bump(TopicLevels const& levels);
+  static size_t slot(std::string_view level);
+
+  Balance const balance_;
+  mutable folly::SharedMutex mutex_;
+  std::unique_ptr<Node> root_;
+  folly::F14FastMap<std::string, std::shared_ptr<Group>> groups_;
+  size_t size_{0};
+  // Subscription changes, by a hash of the filter's first level, and for
+  // filters that start with a wildcard and so may match any topic. A route
+  // is current while both generations it was taken at are.
+  std::array<std::atomic<uint64_t>, kSlots> generations_{};
+  std::atomic<uint64_t> wildcard_{0};
+};
+
+bool isValidTopicName(std::string_view topic);
+bool isValidTopicFilter(std::string_view filter);
+
+// Splits $share/<group>/<filter> into group and filter; nothing if the
+// filter is not a well-formed shared one.
+std::optional<std::pair<std::string_view, std::string_view>> splitSharedFilter(
+    std::string_view filter
+);
+}  // namespace warp::mqtt
@@ -0,0 +1,16 @@
+#pragma once
+
+#include <folly/io/IOBufQueue.h>
+
+namespace warp::utils {
+// Gives back what a queue holds beyond its data: an empty queue lets go of
+// its buffers and a partial frame is copied into one that fits it exactly.
+inline void trim(folly::IOBufQueue& q) {
+  if (q.chainLength() == 0) {
+    q.reset();
+    return;
+  }
+  auto data = q.move();
+  q.append(folly::IOBuf::copyBuffer(data->coalesce()));
+}
+}  // namespace warp::utils
@@ -0,0 +1,53 @@
+#pragma once
+
+#include <algorithm>
+#include <cstddef>
+#include <utility>
+#include <vector>
+
+namespace warp::utils {
+// A FIFO queue over a single power-of-two sized array. Unlike std::deque it
+// keeps no per-block overhead and gives all of its memory back on clear().
+template <typename T>
+class Ring final {
+public:
+  bool empty() const { return size_ == 0; }
+  size_t size() const { return size_; }
+
+  T& front() { return data_[head_]; }
+  T& operator[](size_t i) { return data_[(head_ + i) & (data_.size() - 1)]; }
+
+  void push(T value) {
+    if (size_ == data_.size()) grow();
+    data_[(head_ + size_) & (data_.size() - 1)] = std::move(value);
+    ++size_;
+  }
+
+  T pop() {
+    T value = std::move(data_[head_]);
+    head_ = (head_ + 1) & (data_.size() - 1);
+    --size_;
+    return value;
+  }
+
+  void clear() {
+    std::vector<T>().swap(data_);
+    head_ = 0;
+    size_ = 0;
+  }
+
+private:
+  void grow() {
+    std::vector<T> data(std::max<size_t>(4, data_.size() * 2));
+    for (size_t i = 0; i < size_; ++i) {
+      data[i] = std::move(data_[(head_ + i) & (data_.size() - 1)]);
+    }
+    data_ = std::move(data);
+    head_ = 0;
+  }
+
+  std::vector<T> data_;
+  size_t head_{0};
+  size_t size_{0};
+};
+}  // namespace warp::utils
@@ -0,0 +1,67 @@
+#pragma once
+
+#include <folly/Expected.h>
+#include <folly/io/IOBuf.h>
+
+#include <cstdint>
+#include <memory>
+#include <optional>
+#include <string>
+#include <string_view>
+
+struct z_stream_s;
+
+namespace warp::websocket {
+// permessage-deflate (RFC 7692). Window bits bound the memory each side's
+// compressor keeps; without context takeover that side starts every message
+// from an empty window, giving up some ratio to keep nothing between them.
+class DeflateOptions {
+public:
+  bool enabled{true};
+  uint8_t serverWindowBits{15};
+  uint8_t clientWindowBits{15};
+  bool serverNoContextTakeover{false};
+  bool clientNoContextTakeover{false};
+  // Messages smaller than this go out uncompressed.
+  size_t threshold{256};
+  int level{6};
+};
+
+// What to agree to for the first offer in a Sec-WebSocket-Extensions header
+// that the options can satisfy, if any.
+std::optional<DeflateOptions> negotiate(DeflateOptions const& options, std::string_view offers);
+
+// The Sec-WebSocket-Extensions response for what was agreed.
+std::string accept(DeflateOptions const& agreed);
+
+// The server end of one connection's compression. Each direction keeps its
+// zlib stream across messages and sets it up only once it is first used.
+class Deflate {
+public:
+  enum class Error { TooLarge, Corrupt };
+
+  explicit Deflate(DeflateOptions const& agreed);
+  ~Deflate();
+
+  Deflate(Deflate const&) = delete;
+  Deflate& operator=(Deflate const&) = delete;
+
+  DeflateOptions const& options() const { return options_; }
+
+  // A whole outbound message, or nullptr if zlib fails.
+  std::unique_ptr<folly::IOBuf> compress(folly::IOBuf const& data);
+
+  // The next fragment of an inbound message, last being its final one. Fails
+  // once the message inflates past limit bytes.
+  folly::Expected<std::unique_ptr<folly::IOBuf>, Error> decompress(
+      folly::IOBuf const& data, bool last, size_t limit
+  );
+
+private:
+  DeflateOptions options_;
+  std::unique_ptr<z_stream_s> deflate_;
+  std::unique_ptr<z_stream_s> inflate_;
+  // Bytes the current inbound message has inflated to so far.
+  size_t inflated_{0};
+};
+}  // namespace warp::websocket
@@ -3,39 +3,17 @@
 #include <folly/io/IOBuf.h>
 #include <proxygen/httpserver/RequestHandler.h>
 
-#include <vector>
+#include <memory>
+#include <optional>
 
-namespace warp::websocket {
-enum class OpCode : uint8_t {
-  Continuation = 0x0,
-  Text = 0x1,
-  Binary = 0x2,
-  Close = 0x8,
-  Ping = 0x9,
-  Pong = 0xA,
-  Unknown = 0xFF
-};
-
-class Frame {
-public:
-  OpCode opcode{OpCode::Unknown};
-  bool fin{true};
-  std::unique_ptr<folly::IOBuf> data;
-};
-
-class Stream {
-public:
-  enum class Error {};
-
-  folly::Expected<std::vector<Frame>, Error> parse(std::unique_ptr<folly::IOBuf> chain);
-
-  std::unique_ptr<folly::IOBuf> frame(
-      std::unique_ptr<folly::IOBuf> data, uint8_t opcode, bool fin = true
-  );
-};
+#include "warp/websocket/stream.h"
 
+namespace warp::websocket {
 class Handler : public proxygen::RequestHandler {
 public:
+  explicit Handler(DeflateOptions const& deflate = {}, uint64_t limit = Stream::kMaxFrame)
+      : deflate_(deflate), limit_(limit) {}
+
   void onRequest(std::unique_ptr<proxygen::HTTPMessage> request) noexcept override;
   void onBody(std::unique_ptr<folly::IOBuf> body) noexcept override;
   void onEOM() noexcept override;
@@ -46,6 +24,9 @@ public:
 protected:
   virtual void onDataFrame(std::unique_ptr<folly::IOBuf> data, bool fin) = 0;
   virtual void onTextFrame(std::unique_ptr<folly::IOBuf>, bool) {}
+  // Bytes of a frame still arriving, after each chunk is parsed and before
+  // the frames in it are handed on.
+  virtual void onPending(size_t) {}
 
   void sendData(std::unique_ptr<folly::IOBuf> data, bool fin = true);
   void sendText(std::unique_ptr<folly::IOBuf> data, bool fin = true);
@@ -53,6 +34,12 @@ protected:
   void sendClose(uint16_t code = 1000, folly::StringPiece reason = "");
 
 private:
+  DeflateOptions deflate_;
+  uint64_t limit_;
+  // What the client agreed to, until the upgrade completes.
+  std::optional<DeflateOptions> agreed_;
   std::unique_ptr<Stream> stream_;
+  // Nothing may follow a close frame.
+  bool closed_{false};
 };
 }  // namespace warp::websocket
@@ -0,0 +1,88 @@
+#pragma once
+
+#include <folly/Expected.h>
+#include <folly/io/IOBuf.h>
+#include <folly/io/IOBufQueue.h>
+
+#include <cstdint>
+#include <memory>
+#include <optional>
+#include <vector>
+
+#include "warp/websocket/deflate.h"
+
+namespace warp::websocket {
+enum class OpCode : uint8_t {
+  Continuation = 0x0,
+  Text = 0x1,
+  Binary = 0x2,
+  Close = 0x8,
+  Ping = 0x9,
+  Pong = 0xA,
+  Unknown = 0xFF
+};
+
+class Frame {
+public:
+  OpCode opcode{OpCode::Unknown};
+  bool fin{true};
+  std::unique_ptr<folly::IOBuf> data;
+};
+
+// XORs size bytes of src with the mask into dst, starting offset bytes into
+// the mask; dst may be src. Runs a word or a SIMD register at a time.
+void unmask(
+    uint8_t* dst, uint8_t const* src, size_t size, uint8_t const mask[4], size_t offset = 0
+);
+
+// Frames are parsed straight out of the chain they arrive in. A payload is a
+// slice of that chain, unmasked in place unless its buffer is shared, and a
+// frame cut off at the end of a chunk waits in the stream until the rest of it
+// arrives.
+//
+// Once permessage-deflate is agreed, compressed messages are inflated as they
+// are parsed, and whole data messages at or over the threshold go out
+// compressed.
+//
+// The first error fails the stream: every later parse returns it again.
+class Stream {
+public:
+  enum class Error { TooLarge, Protocol, BadData };
+
+  // A server only takes masked frames, a client only unmasked ones.
+  enum class Role { Server, Client };
+
+  static constexpr uint64_t kMaxFrame = 256 * 1024 * 1024;
+  static constexpr uint64_t kMaxControl = 125;
+
+  // Frames, and messages once inflated, over limit bytes are refused.
+  explicit Stream(uint64_t limit = kMaxFrame, Role role = Role::Server)
+      : limit_(limit), role_(role) {}
+  explicit Stream(
+      DeflateOptions const& agreed, uint64_t limit = kMaxFrame, Role role = Role::Server
+  )
+      : deflate_(std::make_unique<Deflate>(agreed)), limit_(limit), role_(role) {}
+
+  folly::Expected<std::vector<Frame>, Error> parse(std::unique_ptr<folly::IOBuf> chain);
+
+  std::unique_ptr<folly::IOBuf> frame(
+      std::unique_ptr<folly::IOBuf> data, uint8_t opcode, bool fin = true
+  );
+
+  // Bytes of a partial frame waiting for the rest of it.
+  size_t pending() const { return queue_.chainLength(); }
+
+private:
+  // Parses the frames that are whole in queue_.
+  folly::Expected<std::vector<Frame>, Error> next();
+
+  folly::IOBufQueue queue_{folly::IOBufQueue::cacheChainLength()};
+  std::unique_ptr<Deflate> deflate_;
+  uint64_t limit_;
+  Role role_;
+  // Whether a fragmented data message is in progress, and whether it is compressed.
+  bool message_{false};
+  bool inflating_{false};
+  std::optional<Error> failed_;
+};
+}  // namespace warp::websocket
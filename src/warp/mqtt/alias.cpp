@@ -0,0 +1,41 @@
+#include "warp/mqtt/alias.h"
+
+#include <iterator>
+
+namespace warp::mqtt {
+bool InboundAliases::resolve(Publish& msg) {
+  auto const alias = msg.head.properties.topicAlias();
+  if (!alias) return true;
+  if (*alias == 0 || *alias > maximum_) return false;
+  if (topics_.size() < *alias) {
+    topics_.resize(*alias);
+  }
+  auto& topic = topics_[*alias - 1];
+  if (msg.head.topic.empty()) {
+    if (topic.empty()) return false;
+    msg.head.topic = topic;
+  } else {
+    topic = msg.head.topic;
+  }
+  return true;
+}
+
+TopicAlias OutboundAliases::assign(std::string_view topic) {
+  if (maximum_ == 0) return {};
+  if (auto it = index_.find(topic); it != index_.end()) {
+    lru_.splice(lru_.begin(), lru_, it->second);
+    return {it->second->id, true};
+  }
+  if (lru_.size() < maximum_) {
+    auto const id = static_cast<uint16_t>(lru_.size() + 1);
+    lru_.push_front(Entry{std::string(topic), id});
+  } else {
+    auto last = std::prev(lru_.end());
+    index_.erase(std::string_view(last->topic));
+    last->topic = std::string(topic);
+    lru_.splice(lru_.begin(), lru_, last);
+  }
+  index_.emplace(std::string_view(lru_.front().topic), lru_.begin());
+  return {lru_.front().id, false};
+}
+}  // namespace warp::mqtt
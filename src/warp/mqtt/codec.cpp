@@ -2,8 +2,64 @@
 
 #include <folly/io/Cursor.h>
 
+#include <algorithm>
+
 namespace warp::mqtt {
-std::optional<Message> Codec::decode(folly::IOBufQueue& q) {
+namespace {
+uint32_t publishSize(size_t topic, uint8_t qos, size_t properties, size_t payload) {
+  return static_cast<uint32_t>(2u + topic + (qos ? 2u : 0u) + properties + payload);
+}
+
+size_t publishHeaderSize(size_t topic, uint8_t qos, size_t properties, size_t payload) {
+  return sizeWithFixedHeader(publishSize(topic, qos, properties, payload)) - payload;
+}
+
+template <typename T>
+size_t reserveFor(T const& msg) {
+  return msg.size();
+}
+
+size_t reserveFor(Publish const& msg) {
+  auto const payload = msg.data.data.computeChainDataLength();
+  return payload > kMaxPayloadCopy ? msg.size() - payload : msg.size();
+}
+
+// An alias goes after the other properties, so they are written as they are.
+size_t propertiesSize(Properties const* properties, uint16_t alias) {
+  if (!properties) return 0;
+  if (!alias) return properties->size();
+  auto const n = properties->data().computeChainDataLength() + 3;
+  return folly::encodeVarintSize(n) + n;
+}
+
+void writePublishHeader(
+    folly::io::QueueAppender& a, folly::StringPiece topic, uint8_t qos, uint8_t retain,
+    uint16_t packetId, Properties const* properties, uint16_t alias, size_t payload
+) {
+  uint8_t const flags = static_cast<uint8_t>(((qos & 0x03) << 1) | (retain ? 0x01 : 0x00));
+  size_t const extra = propertiesSize(properties, alias);
+  writeFixedHeader(a, Type::Publish, Flags(flags), publishSize(topic.size(), qos, extra, payload));
+  writeUTF8(a, topic);
+  if (qos) {
+    a.writeBE<uint16_t>(packetId);
+  }
+  if (!properties) return;
+  if (!alias) {
+    properties->encode(a);
+    return;
+  }
+  auto const& data = properties->data();
+  uint8_t tmp[5];
+  a.push(tmp, folly::encodeVarint(data.computeChainDataLength() + 3, tmp));
+  for (auto const range : data) {
+    a.push(range.data(), range.size());
+  }
+  a.write<uint8_t>(static_cast<uint8_t>(Properties::Id::TopicAlias));
+  a.writeBE<uint16_t>(alias);
+}
+}  // namespace
+
+std::optional<Message> Codec::decode(folly::IOBufQueue& q, Level level) {
   if (q.empty()) return std::nullopt;
 
   folly::io::Cursor peek(q.front());
@@ -11,7 +67,8 @@ std::optional<Message> Codec::decode(folly::IOBufQueue& q) {
   auto opt = readFixedHeader(peek, size);
   if (!opt) return std::nullopt;
 
-  const auto head = *opt;
+  auto head = *opt;
+  head.level = level;
   if (q.chainLength() < size + head.size) return std::nullopt;
 
   auto frame = q.split(size + head.size);
@@ -66,10 +123,137 @@ std::optional<Message> Codec::decode(folly::IOBufQueue& q) {
   }
 }
 
+folly::Expected<size_t, Codec::Error> Codec::frameSize(folly::IOBufQueue const& q) {
+  if (q.empty()) return folly::makeUnexpected(Error::Incomplete);
+  folly::io::Cursor peek(q.front());
+  size_t size = 0;
+  auto const head = readFixedHeader(peek, size);
+  if (!head) {
+    // With the first byte and four length bytes in, the last of them still
+    // had its continuation bit set.
+    return folly::makeUnexpected(q.chainLength() >= 5 ? Error::Malformed : Error::Incomplete);
+  }
+  return size + head->size;
+}
+
 std::unique_ptr<folly::IOBuf> Codec::encode(Message const& msg) {
   folly::IOBufQueue q(folly::IOBufQueue::cacheChainLength());
-  folly::io::QueueAppender a(&q, 1024);
-  std::visit([&](auto const& m) { m.encode(a); }, msg);
+  encode(msg, q);
   return q.chainLength() ? q.move() : nullptr;
 }
+
+void Codec::encode(Message const& msg, folly::IOBufQueue& q) {
+  std::visit(
+      [&](auto const& m) {
+        size_t const size = reserveFor(m);
+        if (size == 0) return;
+        q.preallocate(size, size);
+        folly::io::QueueAppender a(&q, size);
+        m.encode(a);
+      },
+      msg
+  );
+}
+
+SharedPublish::SharedPublish(Publish const& msg, bool retain)
+    : topic_(msg.head.topic),
+      qos_(static_cast<uint8_t>(msg.head.qos & 0x03)),
+      retain_(retain ? 1 : 0),
+      // An alias only means something on the connection it arrived on.
+      properties_(msg.head.properties.without(Properties::Id::TopicAlias)),
+      expiry_(msg.head.properties.messageExpiry()),
+      received_(expiry_ ? Clock::now() : Clock::time_point{}) {
+  if (!msg.data.data.empty()) {
+    payload_ = msg.data.data.clone();
+  }
+  data_ = encode(nullptr);
+  head_ = header(1, 0, nullptr);
+}
+
+bool SharedPublish::expired() const {
+  return expiry_ && Clock::now() - received_ >= std::chrono::seconds(*expiry_);
+}
+
+std::unique_ptr<folly::IOBuf> SharedPublish::clone(
+    uint8_t qos, uint16_t packetId, Level level
+) const {
+  if (level != Level::V5) {
+    return qos == 0 ? data_->clone() : stamp(*head_, head_->length() - 2, qos, packetId);
+  }
+  Properties scratch;
+  auto const& properties = current(scratch);
+  if (&properties != &properties_) {
+    return chain(header(qos, packetId, &properties));
+  }
+  std::call_once(once_, [this]() {
+    data5_ = encode(&properties_);
+    head5_ = header(1, 0, &properties_);
+  });
+  if (qos == 0) return data5_->clone();
+  // The packet id sits between the topic and the properties.
+  return stamp(*head5_, head5_->length() - 2 - properties_.size(), qos, packetId);
+}
+
+std::unique_ptr<folly::IOBuf> SharedPublish::clone(
+    uint8_t qos, uint16_t packetId, TopicAlias alias
+) const {
+  Properties scratch;
+  return chain(header(qos, packetId, &current(scratch), alias));
+}
+
+// A message that waited is forwarded with what is left of its expiry.
+Properties const& SharedPublish::current(Properties& scratch) const {
+  if (!expiry_) return properties_;
+  using std::chrono::seconds;
+  auto const elapsed = std::chrono::duration_cast<seconds>(Clock::now() - received_).count();
+  if (elapsed <= 0) return properties_;
+  auto const left = static_cast<uint32_t>(std::max<int64_t>(*expiry_ - elapsed, 0));
+  scratch = properties_.with(Properties::Id::MessageExpiry, left);
+  return scratch;
+}
+
+std::unique_ptr<folly::IOBuf> SharedPublish::header(
+    uint8_t qos, uint16_t packetId, Properties const* properties, TopicAlias alias
+) const {
+  folly::StringPiece const topic = alias.known ? folly::StringPiece() : topic_;
+  size_t const size = payload_ ? payload_->computeChainDataLength() : 0;
+  size_t const extra = propertiesSize(properties, alias.id);
+  size_t const head = publishHeaderSize(topic.size(), qos, extra, size);
+  folly::IOBufQueue q(folly::IOBufQueue::cacheChainLength());
+  folly::io::QueueAppender a(&q, head);
+  writePublishHeader(a, topic, qos, retain_, packetId, properties, alias.id, size);
+  auto out = q.move();
+  out->coalesce();
+  return out;
+}
+
+std::unique_ptr<folly::IOBuf> SharedPublish::encode(Properties const* properties) const {
+  size_t const size = payload_ ? payload_->computeChainDataLength() : 0;
+  size_t const head = publishHeaderSize(topic_.size(), 0, propertiesSize(properties, 0), size);
+  folly::IOBufQueue q(folly::IOBufQueue::cacheChainLength());
+  folly::io::QueueAppender a(&q, size <= kMaxPayloadCopy ? head + size : head);
+  writePublishHeader(a, topic_, 0, retain_, 0, properties, 0, size);
+  if (payload_) {
+    writePayload(a, *payload_);
+  }
+  return q.move();
+}
+
+std::unique_ptr<folly::IOBuf> SharedPublish::chain(std::unique_ptr<folly::IOBuf> head) const {
+  if (payload_) {
+    head->appendChain(payload_->clone());
+  }
+  return head;
+}
+
+std::unique_ptr<folly::IOBuf> SharedPublish::stamp(
+    folly::IOBuf const& head, size_t offset, uint8_t qos, uint16_t packetId
+) const {
+  auto out = folly::IOBuf::copyBuffer(head.data(), head.length());
+  auto* p = out->writableData();
+  p[0] = static_cast<uint8_t>((p[0] & ~0x06) | ((qos & 0x03) << 1));
+  p[offset] = static_cast<uint8_t>(packetId >> 8);
+  p[offset + 1] = static_cast<uint8_t>(packetId & 0xFF);
+  return chain(std::move(out));
+}
 }  // namespace warp::mqtt
@@ -0,0 +1,321 @@
+#include "warp/mqtt/connection.h"
+
+#include <wangle/channel/AsyncSocketHandler.h>
+#include <wangle/channel/Pipeline.h>
+
+#include "warp/mqtt/codec.h"
+
+namespace warp::mqtt {
+namespace {
+struct DataTraits {
+  static inline const folly::RequestToken kConnection{"warp.mqtt.connection"};
+};
+}  // namespace
+
+Connection::Connection(
+    std::shared_ptr<SessionStore> sessions, std::shared_ptr<Registry> registry,
+    folly::EventBase* evb, Context* ctx, folly::Executor::KeepAlive<folly::SerialExecutor> executor,
+    ConnectionOptions const& options
+)
+    : sessions_(std::move(sessions)),
+      registry_(std::move(registry)),
+      evb_(evb),
+      ctx_(ctx),
+      executor_(std::move(executor)),
+      options_(options) {}
+
+void Connection::write(std::unique_ptr<folly::IOBuf> buf) {
+  if (!buf) return;
+  auto const size = buf->computeChainDataLength();
+  if (!admit(size)) return;
+  // On the IO thread, go straight into the queue so that this keeps its
+  // place ahead of any response sent inline after it.
+  if (evb_->isInEventBaseThread()) {
+    push(std::move(buf), size);
+    return;
+  }
+  evb_->runInEventBaseThread([self = shared_from_this(), buf = std::move(buf), size]() mutable {
+    self->push(std::move(buf), size);
+  });
+}
+
+void Connection::send(Message const& msg) {
+  if (!ctx_ || std::holds_alternative<None>(msg)) return;
+  size_t const size = std::visit([](auto const& m) -> size_t { return m.size(); }, msg);
+  if (!admit(size)) return;
+  if (size > kMaxPack) {
+    push(Codec::encode(msg), size);
+    return;
+  }
+  if (pack_.empty()) {
+    pack_.preallocate(size, kBatchSize);
+  }
+  Codec::encode(msg, pack_);
+  packed_.size += size;
+  ++packed_.messages;
+  if (options_.overflow == Overflow::DropOldest && !trim()) return;
+  schedule();
+}
+
+void Connection::runLoopCallback() noexcept {
+  auto const self = std::move(self_);
+  flush();
+}
+
+void Connection::complete(Message msg) {
+  evb_->runInEventBaseThread([self = shared_from_this(), msg = std::move(msg)]() mutable {
+    self->send(msg);
+    --self->pending_;
+  });
+}
+
+void Connection::pause() {
+  evb_->runInEventBaseThread([self = shared_from_this()]() {
+    if (self->paused_++ == 0) self->setReading(false);
+  });
+}
+
+void Connection::resume() {
+  evb_->runInEventBaseThread([self = shared_from_this()]() {
+    if (--self->paused_ == 0) self->setReading(true);
+  });
+}
+
+void Connection::evict(Reason reason) {
+  evb_->runInEventBaseThread([self = shared_from_this(), reason]() {
+    if (!self->ctx_) return;
+    if (self->level() == Level::V5) {
+      self->ctx_->fireWrite(Codec::encode(Disconnect::Builder{}.withReason(reason).build()));
+    }
+    self->disconnect();
+  });
+}
+
+bool Connection::attach(std::shared_ptr<Session> session) {
+  std::lock_guard lock(mutex_);
+  if (closed_) return false;
+  if (session_ && session_ != session) {
+    sessions_->close(session_, this);
+  }
+  session_ = std::move(session);
+  session_->attach(shared_from_this());
+  return true;
+}
+
+std::shared_ptr<Session> Connection::session() const {
+  std::lock_guard lock(mutex_);
+  return session_;
+}
+
+void Connection::shrink() {
+  if (queue_.empty() && !writing_) {
+    queue_.clear();
+  }
+  std::lock_guard lock(publishersMutex_);
+  if (publishers_.empty()) {
+    folly::F14FastMap<Connection const*, std::weak_ptr<Connection>>().swap(publishers_);
+  }
+}
+
+void Connection::close() {
+  {
+    std::lock_guard lock(mutex_);
+    closed_ = true;
+    if (session_) {
+      registry_->remove(session_->client(), this);
+      sessions_->close(session_, this);
+      session_.reset();
+    }
+  }
+  ctx_ = nullptr;
+  cancelLoopCallback();
+  queue_.clear();
+  pack_.reset();
+  packed_ = {};
+  self_.reset();
+  resumePublishers();
+}
+
+bool Connection::admit(size_t size) {
+  bytes_.fetch_add(size, std::memory_order_relaxed);
+  messages_.fetch_add(1, std::memory_order_relaxed);
+  if (!over()) return true;
+  switch (options_.overflow) {
+    case Overflow::Pause:
+      // Publishers that keep going while paused, or responses to this
+      // client itself, are only let in up to a point.
+      if (bytes() <= options_.bytes * kHeadroom && messages() <= options_.messages * kHeadroom) {
+        throttle();
+        return true;
+      }
+      [[fallthrough]];
+    case Overflow::Disconnect:
+      release(size, 1);
+      dropped_.fetch_add(1, std::memory_order_relaxed);
+      evb_->runInEventBaseThread([self = shared_from_this()]() { self->disconnect(); });
+      return false;
+    default:
+      return true;
+  }
+}
+
+void Connection::push(std::unique_ptr<folly::IOBuf> buf, size_t size) {
+  if (!ctx_) {
+    release(size, 1);
+    return;
+  }
+  seal();
+  bool const drop = droppable(*buf);
+  queue_.push(Entry{std::move(buf), size, drop});
+  if (options_.overflow == Overflow::DropOldest && !trim()) return;
+  schedule();
+}
+
+void Connection::seal() {
+  if (pack_.empty()) return;
+  queue_.push(Entry{pack_.move(), packed_.size, false, packed_.messages});
+  packed_ = {};
+}
+
+void Connection::schedule() {
+  if (isLoopCallbackScheduled()) return;
+  // Keeps the connection alive until the flush has run.
+  self_ = shared_from_this();
+  evb_->runInLoop(this);
+}
+
+// QoS 0 publishes may be dropped, except those that set up a topic alias,
+// which once aliases are on are the ones that carry a topic name.
+bool Connection::droppable(folly::IOBuf const& buf) const {
+  uint8_t const first = buf.length() ? buf.data()[0] : 0;
+  if ((first >> 4) != static_cast<uint8_t>(Type::Publish) || (first & 0x06) != 0) return false;
+  if (aliases() == 0) return true;
+  folly::io::Cursor cur(&buf);
+  size_t size = 0;
+  if (!readFixedHeader(cur, size)) return false;
+  return cur.canAdvance(2) && cur.readBE<uint16_t>() == 0;
+}
+
+// Drops the oldest queued QoS 0 publishes until the limits hold again. If
+// only messages that must not be dropped are left, the client goes, and
+// false comes back. The disconnect is posted: this may run under the lock
+// of a session delivering to the connection, which closing takes again.
+bool Connection::trim() {
+  while (over()) {
+    while (scan_ < queue_.size() && !(queue_[scan_].buf && queue_[scan_].droppable)) {
+      ++scan_;
+    }
+    if (scan_ == queue_.size()) {
+      evb_->runInEventBaseThread([self = shared_from_this()]() { self->disconnect(); });
+      return false;
+    }
+    auto& entry = queue_[scan_];
+    release(entry.size, 1);
+    entry.buf.reset();
+    dropped_.fetch_add(1, std::memory_order_relaxed);
+  }
+  return true;
+}
+
+void Connection::flush() {
+  if (!ctx_ || writing_) return;
+  seal();
+  if (queue_.empty()) return;
+  folly::IOBufQueue out{folly::IOBufQueue::cacheChainLength()};
+  size_t bytes = 0;
+  size_t messages = 0;
+  while (!queue_.empty()) {
+    auto entry = queue_.pop();
+    if (!entry.buf) continue;
+    // Small packets written from elsewhere are copied into a batch buffer;
+    // pack buffers are already one. The preallocation makes sure the tail
+    // is never a shared buffer.
+    bool const pack = entry.messages == 1 && !entry.buf->isChained() && entry.size <= kMaxPack;
+    if (pack) {
+      out.preallocate(entry.size, kBatchSize);
+    }
+    out.append(std::move(entry.buf), pack);
+    bytes += entry.size;
+    messages += entry.messages;
+  }
+  scan_ = 0;
+  if (out.empty()) return;
+  writing_ = true;
+  ctx_->fireWrite(out.move())
+      .thenTry([self = shared_from_this(), bytes, messages](folly::Try<folly::Unit>&&) {
+        self->drained(bytes, messages);
+      });
+}
+
+void Connection::drained(size_t bytes, size_t messages) {
+  writing_ = false;
+  release(bytes, messages);
+  if (auto session = this->session()) {
+    session->setBacklog(this->bytes());
+  }
+  if (options_.overflow == Overflow::Pause && bytes_ <= options_.bytes / 2 &&
+      messages_ <= options_.messages / 2) {
+    resumePublishers();
+  }
+  flush();
+}
+
+void Connection::disconnect() {
+  if (ctx_) {
+    ctx_->fireClose();
+  }
+}
+
+void Connection::setReading(bool on) {
+  if (!ctx_) return;
+  if (auto* socket = ctx_->getPipeline()->getHandler<wangle::AsyncSocketHandler>()) {
+    on ? socket->attachReadCallback() : socket->detachReadCallback();
+  } else if (auto* websocket = ctx_->getPipeline()->getHandler<WebSocketTransport>()) {
+    websocket->setReading(on);
+  }
+}
+
+// Deliveries run in the publisher's request context, so the connection that
+// filled this queue is the one to pause.
+void Connection::throttle() {
+  auto publisher = getConnection();
+  if (!publisher || publisher.get() == this) return;
+  std::lock_guard lock(publishersMutex_);
+  if (publishers_.emplace(publisher.get(), publisher).second) {
+    publisher->pause();
+  }
+}
+
+void Connection::resumePublishers() {
+  folly::F14FastMap<Connection const*, std::weak_ptr<Connection>> publishers;
+  {
+    std::lock_guard lock(publishersMutex_);
+    publishers.swap(publishers_);
+  }
+  for (auto const& [_, publisher] : publishers) {
+    if (auto p = publisher.lock()) {
+      p->resume();
+    }
+  }
+}
+
+std::shared_ptr<Connection> getConnection() noexcept {
+  if (auto* rc = folly::RequestContext::try_get()) {
+    if (auto* d = rc->getContextData(DataTraits::kConnection)) {
+      if (auto* p = static_cast<folly::ImmutableRequestData<std::shared_ptr<Connection>>*>(d)) {
+        return p->value();
+      }
+    }
+  }
+  return nullptr;
+}
+
+void setConnection(folly::RequestContext& context, std::shared_ptr<Connection> connection) {
+  context.overwriteContextData(
+      DataTraits::kConnection,
+      std::make_unique<folly::ImmutableRequestData<std::shared_ptr<Connection>>>(
+          std::move(connection)
+      )
+  );
+}
+}  // namespace warp::mqtt
@@ -0,0 +1,39 @@
+#include "warp/mqtt/keepalive.h"
+
+#include <folly/io/async/EventBaseLocal.h>
+
+namespace warp::mqtt {
+KeepAlive::KeepAlive(folly::EventBase& evb, folly::Function<void()> expired)
+    : timer_(timer(evb)), expired_(std::move(expired)) {}
+
+void KeepAlive::schedule(std::chrono::milliseconds timeout) {
+  timeout_ = timeout;
+  if (timeout_ <= std::chrono::milliseconds::zero()) {
+    cancelTimeout();
+    return;
+  }
+  touch();
+  timer_.scheduleTimeout(this, timeout_);
+}
+
+void KeepAlive::cancel() {
+  timeout_ = std::chrono::milliseconds::zero();
+  cancelTimeout();
+}
+
+folly::HHWheelTimer& KeepAlive::timer(folly::EventBase& evb) {
+  static folly::EventBaseLocal<folly::HHWheelTimer::UniquePtr> timers;
+  return *timers.try_emplace_with(evb, [&evb] {
+    return folly::HHWheelTimer::newTimer(&evb, kTick);
+  });
+}
+
+void KeepAlive::timeoutExpired() noexcept {
+  auto const idle = std::chrono::duration_cast<std::chrono::milliseconds>(Clock::now() - last_);
+  if (idle < timeout_) {
+    timer_.scheduleTimeout(this, timeout_ - idle);
+    return;
+  }
+  expired_();
+}
+}  // namespace warp::mqtt
@@ -0,0 +1,97 @@
+#include "warp/mqtt/limit.h"
+
+#include <folly/hash/Hash.h>
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <functional>
+#include <tuple>
+#include <utility>
+#include <vector>
+
+namespace warp::mqtt {
+Limiter::Limiter(double rate, double burst) {
+  if (rate > 0) {
+    burst_ = std::max(rate * burst, 1.0);
+    bucket_.emplace(rate, burst_);
+  }
+}
+
+std::chrono::milliseconds Limiter::take(double n) {
+  return enabled() ? take(n, folly::TokenBucket::defaultClockNow())
+                   : std::chrono::milliseconds::zero();
+}
+
+std::chrono::milliseconds Limiter::take(double n, double now) {
+  if (!enabled() || n <= 0) return std::chrono::milliseconds::zero();
+  // The bucket only lends up to its burst at a time, so a large read is
+  // taken in pieces; the last wait covers all of them.
+  double wait = 0;
+  while (n > 0) {
+    double const chunk = std::min(n, burst_);
+    wait = bucket_->consumeWithBorrowNonBlocking(chunk, now).value_or(0);
+    n -= chunk;
+  }
+  return std::chrono::milliseconds(std::llround(wait * 1000));
+}
+
+bool Quota::update(std::shared_ptr<Holder> const& holder, size_t bytes) {
+  auto const key = reinterpret_cast<uintptr_t>(holder.get());
+  auto& shard = shards_[folly::hash::twang_mix64(key) % kShards];
+  size_t used = 0;
+  {
+    std::lock_guard lock(shard.mutex);
+    auto it = shard.shares.find(holder.get());
+    size_t const before = it == shard.shares.end() ? 0 : it->second.bytes;
+    if (bytes == before) return true;
+    if (bytes == 0) {
+      shard.shares.erase(it);
+    } else if (it == shard.shares.end()) {
+      shard.shares.emplace(holder.get(), Share{holder, bytes});
+    } else {
+      it->second.bytes = bytes;
+    }
+    used = used_.fetch_add(bytes - before, std::memory_order_relaxed) + bytes - before;
+  }
+  return limit_ == 0 || used <= limit_ || evict(holder.get());
+}
+
+bool Quota::evict(Holder const* self) {
+  std::vector<std::shared_ptr<Holder>> evicted;
+  bool kept = true;
+  {
+    std::array<std::unique_lock<std::mutex>, kShards> locks;
+    for (size_t i = 0; i < kShards; ++i) {
+      locks[i] = std::unique_lock(shards_[i].mutex);
+    }
+    // Others may have let go since.
+    size_t used = used_.load(std::memory_order_relaxed);
+    if (used <= limit_) return true;
+    std::vector<std::tuple<size_t, Holder const*, Shard*>> largest;
+    for (auto& shard : shards_) {
+      for (auto const& [key, share] : shard.shares) {
+        largest.emplace_back(share.bytes, key, &shard);
+      }
+    }
+    std::sort(largest.begin(), largest.end(), std::greater<>());
+    for (auto const& [size, key, shard] : largest) {
+      if (used <= limit_) break;
+      used -= size;
+      auto share = shard->shares.find(key);
+      if (key == self) {
+        kept = false;
+      } else if (auto h = share->second.holder.lock()) {
+        evicted.push_back(std::move(h));
+      }
+      shard->shares.erase(share);
+    }
+    used_.store(used, std::memory_order_relaxed);
+  }
+  // Outside the locks, since reclaiming may come straight back here.
+  for (auto const& h : evicted) {
+    h->reclaim();
+  }
+  return kept;
+}
+}  // namespace warp::mqtt
@@ -1,15 +1,66 @@
 #include "warp/mqtt/message.h"
 
 namespace warp::mqtt {
-void Connect::encode(folly::io::QueueAppender& a) const {
+namespace {
+uint32_t propertiesSize(Level level, Properties const& properties) {
+  return level == Level::V5 ? properties.size() : 0u;
+}
+
+bool readProperties(
+    FixedHeader const& head, folly::io::Cursor& cur, uint32_t& left, Properties& out
+) {
+  return head.level != Level::V5 || Properties::decode(cur, left, out);
+}
+
+// MQTT 5 acks leave out the reason code if it is success and there are no
+// properties, which is also exactly what an MQTT 3 ack looks like.
+uint32_t ackLength(uint8_t reason, Properties const& properties) {
+  if (!properties.empty()) return 3u + properties.size();
+  return reason ? 3u : 2u;
+}
+
+template <typename T>
+void encodeAck(folly::io::QueueAppender& a, T const& msg, Type type, Flags flags) {
+  auto const length = msg.length();
+  writeFixedHeader(a, type, flags, length);
+  a.writeBE<uint16_t>(msg.head.packetId);
+  if (length > 2) a.write<uint8_t>(msg.head.reason);
+  if (length > 3) msg.head.properties.encode(a);
+}
+
+template <typename T>
+std::optional<T> decodeAck(FixedHeader const& head, folly::io::Cursor& cur) {
+  if (head.size < 2 || (head.size != 2 && head.level != Level::V5)) return std::nullopt;
+  uint32_t left = head.size;
+  T msg;
+  msg.head.packetId = cur.readBE<uint16_t>();
+  left -= 2;
+  if (left > 0) {
+    msg.head.reason = cur.read<uint8_t>();
+    left -= 1;
+  }
+  if (left > 0 && !Properties::decode(cur, left, msg.head.properties)) return std::nullopt;
+  if (left != 0) return std::nullopt;
+  return msg;
+}
+}  // namespace
+
+uint32_t Connect::length() const {
   const auto name = protocolNameForLevel(head.level);
-  const uint32_t size = 2u + static_cast<uint32_t>(name.size()) + 1u + 1u + 2u + 2u +
-                        static_cast<uint32_t>(data.client.size());
-  writeFixedHeader(a, Type::Connect, Flags(0), size);
-  writeUTF8(a, name);
+  return 2u + static_cast<uint32_t>(name.size()) + 1u + 1u + 2u +
+         propertiesSize(head.level, head.properties) + 2u +
+         static_cast<uint32_t>(data.client.size());
+}
+
+void Connect::encode(folly::io::QueueAppender& a) const {
+  writeFixedHeader(a, Type::Connect, Flags(0), length());
+  writeUTF8(a, protocolNameForLevel(head.level));
   a.write<uint8_t>(static_cast<uint8_t>(head.level));
   a.write<uint8_t>(head.flags);
   a.writeBE<uint16_t>(head.timeout);
+  if (head.level == Level::V5) {
+    head.properties.encode(a);
+  }
   writeUTF8(a, data.client);
 }
 
@@ -34,10 +85,15 @@ std::optional<Connect> Connect::decode(FixedHeader const& head, folly::io::Curso
   uint16_t timeout = cur.readBE<uint16_t>();
   left -= 2;
 
+  Connect msg;
+  if (level == Level::V5 &&
+      (!Properties::decode(cur, left, msg.head.properties) || !msg.head.properties.valid())) {
+    return std::nullopt;
+  }
+
   std::string client;
   if (!readUTF8(cur, left, client)) return std::nullopt;
 
-  Connect msg;
   msg.head.head = head;
   msg.head.level = level;
   msg.head.flags = flags;
@@ -46,34 +102,50 @@ std::optional<Connect> Connect::decode(FixedHeader const& head, folly::io::Curso
   return msg;
 }
 
+uint32_t ConnAck::length() const { return 2u + propertiesSize(head.level, head.properties); }
+
 void ConnAck::encode(folly::io::QueueAppender& a) const {
-  writeFixedHeader(a, Type::ConnAck, Flags(0), 2u);
+  writeFixedHeader(a, Type::ConnAck, Flags(0), length());
   a.write<uint8_t>(head.session ? 1 : 0);
   a.write<uint8_t>(head.reason);
+  if (head.level == Level::V5) {
+    head.properties.encode(a);
+  }
 }
 
 std::optional<ConnAck> ConnAck::decode(FixedHeader const& head, folly::io::Cursor& cur) {
   if (((head.data >> 4) & 0x0F) != static_cast<uint8_t>(Type::ConnAck)) return std::nullopt;
-  if (head.size != 2) return std::nullopt;
+  if (head.size < 2 || (head.size != 2 && head.level != Level::V5)) return std::nullopt;
+  uint32_t left = head.size;
   ConnAck msg;
   msg.head.session = cur.read<uint8_t>();
   msg.head.reason = cur.read<uint8_t>();
+  msg.head.level = head.level;
+  left -= 2;
+  if (!readProperties(head, cur, left, msg.head.properties)) return std::nullopt;
   return msg;
 }
 
+uint32_t Publish::length() const {
+  return 2u + static_cast<uint32_t>(head.topic.size()) + (head.qos ? 2u : 0u) +
+         propertiesSize(head.level, head.properties) +
+         static_cast<uint32_t>(data.data.computeChainDataLength());
+}
+
 void Publish::encode(folly::io::QueueAppender& a) const {
-  uint32_t size = 2u + static_cast<uint32_t>(head.topic.size()) + (head.qos ? 2u : 0u) +
-                  static_cast<uint32_t>(data.data.size());
   const uint8_t flags = static_cast<uint8_t>(
       (head.dup ? 0x08 : 0x00) | ((head.qos & 0x03) << 1) | (head.retain ? 0x01 : 0x00)
   );
-  writeFixedHeader(a, Type::Publish, Flags(flags), size);
+  writeFixedHeader(a, Type::Publish, Flags(flags), length());
   writeUTF8(a, head.topic);
   if (head.qos) {
     a.writeBE<uint16_t>(head.packetId);
   }
+  if (head.level == Level::V5) {
+    head.properties.encode(a);
+  }
   if (!data.data.empty()) {
-    a.push(reinterpret_cast<const uint8_t*>(data.data.data()), data.data.size());
+    writePayload(a, data.data);
   }
 }
 
@@ -99,87 +171,89 @@ std::optional<Publish> Publish::decode(FixedHeader const& head, folly::io::Curso
     left -= 2;
   }
 
-  std::string payload;
+  Publish msg;
+  // Checked once here so that the broker and every subscriber can trust them.
+  if (!readProperties(head, cur, left, msg.head.properties) || !msg.head.properties.valid()) {
+    return std::nullopt;
+  }
   if (left > 0) {
-    payload = cur.readFixedString(left);
+    cur.clone(msg.data.data, left);
   }
-
-  Publish msg;
   msg.head.head = head;
   msg.head.topic = std::move(topic);
   msg.head.packetId = packetId;
   msg.head.qos = qos;
   msg.head.dup = dup;
   msg.head.retain = retain;
-  msg.data.data = std::move(payload);
+  msg.head.level = head.level;
   return msg;
 }
 
+uint32_t PubAck::length() const { return ackLength(head.reason, head.properties); }
+
 void PubAck::encode(folly::io::QueueAppender& a) const {
-  writeFixedHeader(a, Type::PubAck, Flags(0), 2u);
-  a.writeBE<uint16_t>(head.packetId);
+  encodeAck(a, *this, Type::PubAck, Flags(0));
 }
 
 std::optional<PubAck> PubAck::decode(FixedHeader const& head, folly::io::Cursor& cur) {
   if (((head.data >> 4) & 0x0F) != static_cast<uint8_t>(Type::PubAck)) return std::nullopt;
-  if (head.size != 2) return std::nullopt;
-  PubAck msg;
-  msg.head.packetId = cur.readBE<uint16_t>();
-  return msg;
+  return decodeAck<PubAck>(head, cur);
 }
 
+uint32_t PubRec::length() const { return ackLength(head.reason, head.properties); }
+
 void PubRec::encode(folly::io::QueueAppender& a) const {
-  writeFixedHeader(a, Type::PubRec, Flags(0), 2u);
-  a.writeBE<uint16_t>(head.packetId);
+  encodeAck(a, *this, Type::PubRec, Flags(0));
 }
 
 std::optional<PubRec> PubRec::decode(FixedHeader const& head, folly::io::Cursor& cur) {
   if (((head.data >> 4) & 0x0F) != static_cast<uint8_t>(Type::PubRec)) return std::nullopt;
   if ((head.data & 0x0F) != 0x00) return std::nullopt;
-  if (head.size != 2) return std::nullopt;
-  PubRec m;
-  m.head.packetId = cur.readBE<uint16_t>();
-  return m;
+  return decodeAck<PubRec>(head, cur);
 }
 
+uint32_t PubRel::length() const { return ackLength(head.reason, head.properties); }
+
 void PubRel::encode(folly::io::QueueAppender& a) const {
-  writeFixedHeader(a, Type::PubRel, Flags(2), 2u);
-  a.writeBE<uint16_t>(head.packetId);
+  encodeAck(a, *this, Type::PubRel, Flags(2));
 }
 
 std::optional<PubRel> PubRel::decode(FixedHeader const& head, folly::io::Cursor& cur) {
   if (((head.data >> 4) & 0x0F) != static_cast<uint8_t>(Type::PubRel)) return std::nullopt;
   if ((head.data & 0x0F) != 0x02) return std::nullopt;
-  if (head.size != 2) return std::nullopt;
-  PubRel msg;
-  msg.head.packetId = cur.readBE<uint16_t>();
-  return msg;
+  return decodeAck<PubRel>(head, cur);
 }
 
+uint32_t PubComp::length() const { return ackLength(head.reason, head.properties); }
+
 void PubComp::encode(folly::io::QueueAppender& a) const {
-  writeFixedHeader(a, Type::PubComp, Flags(0), 2u);
-  a.writeBE<uint16_t>(head.packetId);
+  encodeAck(a, *this, Type::PubComp, Flags(0));
 }
 
 std::optional<PubComp> PubComp::decode(FixedHeader const& head, folly::io::Cursor& cur) {
   if (((head.data >> 4) & 0x0F) != static_cast<uint8_t>(Type::PubComp)) return std::nullopt;
   if ((head.data & 0x0F) != 0x00) return std::nullopt;
-  if (head.size != 2) return std::nullopt;
-  PubComp msg;
-  msg.head.packetId = cur.readBE<uint16_t>();
-  return msg;
+  return decodeAck<PubComp>(head, cur);
 }
 
-void Subscribe::encode(folly::io::QueueAppender& a) const {
-  uint32_t size = 2;
+uint32_t Subscribe::length() const {
+  uint32_t size = 2u + propertiesSize(head.level, head.properties);
   for (auto const& t : data.topics) {
     size += 2u + static_cast<uint32_t>(t.filter.size()) + 1u;
   }
-  writeFixedHeader(a, Type::Subscribe, Flags(2), size);
+  return size;
+}
+
+void Subscribe::encode(folly::io::QueueAppender& a) const {
+  writeFixedHeader(a, Type::Subscribe, Flags(2), length());
   a.writeBE<uint16_t>(head.packetId);
+  bool const v5 = head.level == Level::V5;
+  if (v5) {
+    head.properties.encode(a);
+  }
   for (auto const& topic : data.topics) {
     writeUTF8(a, topic.filter);
-    a.write<uint8_t>(topic.qos & 0x03);
+    a.write<uint8_t>(static_cast<uint8_t>((topic.qos & 0x03) | (v5 ? topic.options & 0x3C : 0)));
   }
 }
 
@@ -190,21 +264,35 @@ std::optional<Subscribe> Subscribe::decode(FixedHeader const& head, folly::io::C
   uint32_t left = head.size;
   Subscribe msg;
   msg.head.packetId = cur.readBE<uint16_t>();
+  msg.head.level = head.level;
   left -= 2;
+  if (!readProperties(head, cur, left, msg.head.properties)) return std::nullopt;
+  uint8_t const mask = head.level == Level::V5 ? 0x3C : 0x00;
   while (left > 0) {
     std::string filter;
     if (!readUTF8(cur, left, filter)) return std::nullopt;
     if (left < 1) return std::nullopt;
-    const uint8_t qos = cur.read<uint8_t>();
+    const uint8_t options = cur.read<uint8_t>();
     left -= 1;
-    msg.data.topics.push_back(Topic{std::move(filter), static_cast<uint8_t>(qos & 0x03)});
+    msg.data.topics.push_back(Topic{
+        std::move(filter), static_cast<uint8_t>(options & 0x03),
+        static_cast<uint8_t>(options & mask)
+    });
   }
   return msg;
 }
 
+uint32_t SubAck::length() const {
+  return static_cast<uint32_t>(data.codes.size()) + 2u +
+         propertiesSize(head.level, head.properties);
+}
+
 void SubAck::encode(folly::io::QueueAppender& a) const {
-  writeFixedHeader(a, Type::SubAck, Flags(0), data.codes.size() + 2);
+  writeFixedHeader(a, Type::SubAck, Flags(0), length());
   a.writeBE<uint16_t>(head.packetId);
+  if (head.level == Level::V5) {
+    head.properties.encode(a);
+  }
   for (auto code : data.codes) a.write<uint8_t>(code);
 }
 
@@ -215,7 +303,9 @@ std::optional<SubAck> SubAck::decode(FixedHeader const& head, folly::io::Cursor&
   uint32_t left = head.size;
   SubAck msg;
   msg.head.packetId = cur.readBE<uint16_t>();
+  msg.head.level = head.level;
   left -= 2;
+  if (!readProperties(head, cur, left, msg.head.properties)) return std::nullopt;
   msg.data.codes.clear();
   msg.data.codes.reserve(left);
   while (left > 0) {
@@ -225,13 +315,20 @@ std::optional<SubAck> SubAck::decode(FixedHeader const& head, folly::io::Cursor&
   return msg;
 }
 
-void Unsubscribe::encode(folly::io::QueueAppender& a) const {
-  uint32_t size = 2u;
+uint32_t Unsubscribe::length() const {
+  uint32_t size = 2u + propertiesSize(head.level, head.properties);
   for (auto const& topic : data.topics) {
     size += 2u + static_cast<uint32_t>(topic.size());
   }
-  writeFixedHeader(a, Type::Unsubscribe, Flags(2), size);
+  return size;
+}
+
+void Unsubscribe::encode(folly::io::QueueAppender& a) const {
+  writeFixedHeader(a, Type::Unsubscribe, Flags(2), length());
   a.writeBE<uint16_t>(head.packetId);
+  if (head.level == Level::V5) {
+    head.properties.encode(a);
+  }
   for (auto const& topic : data.topics) {
     writeUTF8(a, topic);
   }
@@ -245,7 +342,9 @@ std::optional<Unsubscribe> Unsubscribe::decode(FixedHeader const& head, folly::i
   uint32_t left = head.size;
   Unsubscribe msg;
   msg.head.packetId = cur.readBE<uint16_t>();
+  msg.head.level = head.level;
   left -= 2;
+  if (!readProperties(head, cur, left, msg.head.properties)) return std::nullopt;
 
   while (left > 0) {
     std::string filter;
@@ -257,17 +356,35 @@ std::optional<Unsubscribe> Unsubscribe::decode(FixedHeader const& head, folly::i
   return msg;
 }
 
+uint32_t UnsubAck::length() const {
+  if (head.level != Level::V5) return 2u;
+  return 2u + head.properties.size() + static_cast<uint32_t>(data.codes.size());
+}
+
 void UnsubAck::encode(folly::io::QueueAppender& a) const {
-  writeFixedHeader(a, Type::UnsubAck, Flags(0), 2u);
+  writeFixedHeader(a, Type::UnsubAck, Flags(0), length());
   a.writeBE<uint16_t>(head.packetId);
+  if (head.level == Level::V5) {
+    head.properties.encode(a);
+    for (auto code : data.codes) a.write<uint8_t>(code);
+  }
 }
 
 std::optional<UnsubAck> UnsubAck::decode(FixedHeader const& head, folly::io::Cursor& cur) {
   if (((head.data >> 4) & 0x0F) != static_cast<uint8_t>(Type::UnsubAck)) return std::nullopt;
   if ((head.data & 0x0F) != 0x00) return std::nullopt;
-  if (head.size != 2) return std::nullopt;
+  if (head.size < 2 || (head.size != 2 && head.level != Level::V5)) return std::nullopt;
+  uint32_t left = head.size;
   UnsubAck msg;
   msg.head.packetId = cur.readBE<uint16_t>();
+  msg.head.level = head.level;
+  left -= 2;
+  if (!readProperties(head, cur, left, msg.head.properties)) return std::nullopt;
+  msg.data.codes.reserve(left);
+  while (left > 0) {
+    msg.data.codes.push_back(cur.read<uint8_t>());
+    left -= 1;
+  }
   return msg;
 }
 
@@ -293,14 +410,30 @@ std::optional<PingResp> PingResp::decode(FixedHeader const& head, folly::io::Cur
   return PingResp{};
 }
 
+uint32_t Disconnect::length() const {
+  if (!head.properties.empty()) return 1u + head.properties.size();
+  return head.reason ? 1u : 0u;
+}
+
 void Disconnect::encode(folly::io::QueueAppender& a) const {
-  writeFixedHeader(a, Type::Disconnect, Flags(0), 0u);
+  auto const size = length();
+  writeFixedHeader(a, Type::Disconnect, Flags(0), size);
+  if (size > 0) a.write<uint8_t>(head.reason);
+  if (size > 1) head.properties.encode(a);
 }
 
-std::optional<Disconnect> Disconnect::decode(FixedHeader const& head, folly::io::Cursor&) {
+std::optional<Disconnect> Disconnect::decode(FixedHeader const& head, folly::io::Cursor& cur) {
   if (((head.data >> 4) & 0x0F) != static_cast<uint8_t>(Type::Disconnect)) return std::nullopt;
   if ((head.data & 0x0F) != 0x00) return std::nullopt;
-  if (head.size != 0) return std::nullopt;
-  return Disconnect{};
+  if (head.size != 0 && head.level != Level::V5) return std::nullopt;
+  uint32_t left = head.size;
+  Disconnect msg;
+  if (left > 0) {
+    msg.head.reason = cur.read<uint8_t>();
+    left -= 1;
+  }
+  if (left > 0 && !Properties::decode(cur, left, msg.head.properties)) return std::nullopt;
+  if (left != 0) return std::nullopt;
+  return msg;
 }
 }  // namespace warp::mqtt
@@ -0,0 +1,299 @@
+#include "warp/mqtt/properties.h"
+
+#include <folly/io/IOBufQueue.h>
+
+#include <algorithm>
+#include <stdexcept>
+
+namespace warp::mqtt {
+namespace {
+enum class Kind : uint8_t { Byte, Two, Four, Varint, String, Pair, Unknown };
+
+Kind kindOf(uint32_t id) {
+  switch (static_cast<Properties::Id>(id)) {
+    case Properties::Id::PayloadFormat:
+    case Properties::Id::RequestProblem:
+    case Properties::Id::RequestResponse:
+    case Properties::Id::MaximumQos:
+    case Properties::Id::RetainAvailable:
+    case Properties::Id::WildcardAvailable:
+    case Properties::Id::SubscriptionIdAvailable:
+    case Properties::Id::SharedAvailable:
+      return Kind::Byte;
+    case Properties::Id::ServerKeepAlive:
+    case Properties::Id::ReceiveMaximum:
+    case Properties::Id::TopicAliasMaximum:
+    case Properties::Id::TopicAlias:
+      return Kind::Two;
+    case Properties::Id::MessageExpiry:
+    case Properties::Id::SessionExpiry:
+    case Properties::Id::WillDelay:
+    case Properties::Id::MaximumPacketSize:
+      return Kind::Four;
+    case Properties::Id::SubscriptionId:
+      return Kind::Varint;
+    case Properties::Id::ContentType:
+    case Properties::Id::ResponseTopic:
+    case Properties::Id::CorrelationData:
+    case Properties::Id::AssignedClient:
+    case Properties::Id::AuthMethod:
+    case Properties::Id::AuthData:
+    case Properties::Id::ResponseInfo:
+    case Properties::Id::ServerReference:
+    case Properties::Id::ReasonString:
+      return Kind::String;
+    case Properties::Id::UserProperty:
+      return Kind::Pair;
+    default:
+      return Kind::Unknown;
+  }
+}
+
+bool isInteger(Kind kind) {
+  return kind == Kind::Byte || kind == Kind::Two || kind == Kind::Four || kind == Kind::Varint;
+}
+
+bool skipString(folly::io::Cursor& cur, uint32_t& left) {
+  if (left < 2) return false;
+  uint16_t const n = cur.readBE<uint16_t>();
+  left -= 2;
+  if (left < n) return false;
+  cur.skip(n);
+  left -= n;
+  return true;
+}
+
+bool skip(Kind kind, folly::io::Cursor& cur, uint32_t& left) {
+  uint32_t n = 0;
+  switch (kind) {
+    case Kind::Byte:
+      n = 1;
+      break;
+    case Kind::Two:
+      n = 2;
+      break;
+    case Kind::Four:
+      n = 4;
+      break;
+    case Kind::Varint:
+      return readVarint(cur, left, n);
+    case Kind::String:
+      return skipString(cur, left);
+    case Kind::Pair:
+      return skipString(cur, left) && skipString(cur, left);
+    default:
+      return false;
+  }
+  if (left < n) return false;
+  cur.skip(n);
+  left -= n;
+  return true;
+}
+
+uint32_t readInteger(Kind kind, folly::io::Cursor& cur) {
+  switch (kind) {
+    case Kind::Byte:
+      return cur.read<uint8_t>();
+    case Kind::Two:
+      return cur.readBE<uint16_t>();
+    case Kind::Four:
+      return cur.readBE<uint32_t>();
+    default: {
+      uint32_t left = 4;
+      uint32_t value = 0;
+      readVarint(cur, left, value);
+      return value;
+    }
+  }
+}
+
+std::string readString(folly::io::Cursor& cur) {
+  uint16_t const n = cur.readBE<uint16_t>();
+  return n ? cur.readFixedString(n) : std::string{};
+}
+
+void writeVarint(folly::io::QueueAppender& a, uint32_t value) {
+  uint8_t tmp[5];
+  size_t const n = folly::encodeVarint(static_cast<uint64_t>(value), tmp);
+  a.push(tmp, n);
+}
+
+void writeString(folly::io::QueueAppender& a, std::string_view str) {
+  if (str.size() > 0xFFFF) throw std::invalid_argument("property too long");
+  a.writeBE<uint16_t>(static_cast<uint16_t>(str.size()));
+  if (!str.empty()) a.push(reinterpret_cast<uint8_t const*>(str.data()), str.size());
+}
+
+// Calls f(id, cursor) with the cursor at each value until f returns true.
+// Returns false if the list turns out to be malformed first.
+template <typename F>
+bool scan(folly::IOBuf const& data, F&& f) {
+  folly::io::Cursor cur(&data);
+  auto left = static_cast<uint32_t>(data.computeChainDataLength());
+  while (left > 0) {
+    uint32_t id = 0;
+    if (!readVarint(cur, left, id)) return false;
+    auto value = cur;
+    if (!skip(kindOf(id), cur, left)) return false;
+    if (f(static_cast<Properties::Id>(id), value)) return true;
+  }
+  return true;
+}
+
+// Rebuilds the list into a fresh buffer, keeping properties for which keep
+// returns true, then lets write append to it.
+template <typename K, typename W>
+folly::IOBuf rebuild(folly::IOBuf const& data, K&& keep, W&& write) {
+  folly::IOBufQueue q(folly::IOBufQueue::cacheChainLength());
+  folly::io::QueueAppender a(&q, data.computeChainDataLength() + 64);
+  folly::io::Cursor cur(&data);
+  auto left = static_cast<uint32_t>(data.computeChainDataLength());
+  while (left > 0) {
+    auto start = cur;
+    uint32_t const before = left;
+    uint32_t id = 0;
+    if (!readVarint(cur, left, id) || !skip(kindOf(id), cur, left)) break;
+    if (!keep(static_cast<Properties::Id>(id))) continue;
+    for (uint32_t n = before - left; n > 0;) {
+      auto const bytes = start.peekBytes();
+      auto const size = std::min<size_t>(n, bytes.size());
+      a.push(bytes.data(), size);
+      start.skip(size);
+      n -= static_cast<uint32_t>(size);
+    }
+  }
+  write(a);
+  auto buf = q.move();
+  return buf ? std::move(*buf) : folly::IOBuf{};
+}
+}  // namespace
+
+uint32_t Properties::size() const {
+  auto const n = static_cast<uint32_t>(data_.computeChainDataLength());
+  return static_cast<uint32_t>(folly::encodeVarintSize(n)) + n;
+}
+
+bool Properties::contains(Id id) const {
+  bool found = false;
+  scan(data_, [&](Id i, folly::io::Cursor&) { return found = (i == id); });
+  return found;
+}
+
+std::optional<uint32_t> Properties::integer(Id id) const {
+  auto const kind = kindOf(static_cast<uint32_t>(id));
+  if (empty() || !isInteger(kind)) return std::nullopt;
+  std::optional<uint32_t> out;
+  scan(data_, [&](Id i, folly::io::Cursor& cur) {
+    if (i != id) return false;
+    out = readInteger(kind, cur);
+    return true;
+  });
+  return out;
+}
+
+std::optional<std::string> Properties::string(Id id) const {
+  if (empty() || kindOf(static_cast<uint32_t>(id)) != Kind::String) return std::nullopt;
+  std::optional<std::string> out;
+  scan(data_, [&](Id i, folly::io::Cursor& cur) {
+    if (i != id) return false;
+    out = readString(cur);
+    return true;
+  });
+  return out;
+}
+
+std::vector<std::pair<std::string, std::string>> Properties::users() const {
+  std::vector<std::pair<std::string, std::string>> out;
+  scan(data_, [&](Id i, folly::io::Cursor& cur) {
+    if (i == Id::UserProperty) {
+      auto key = readString(cur);
+      out.emplace_back(std::move(key), readString(cur));
+    }
+    return false;
+  });
+  return out;
+}
+
+Properties& Properties::add(Id id, uint32_t value) {
+  auto const kind = kindOf(static_cast<uint32_t>(id));
+  if (!isInteger(kind)) return *this;
+  data_ = rebuild(
+      data_, [](Id) { return true; },
+      [&](folly::io::QueueAppender& a) {
+        a.write<uint8_t>(static_cast<uint8_t>(id));
+        switch (kind) {
+          case Kind::Byte:
+            a.write<uint8_t>(static_cast<uint8_t>(value));
+            break;
+          case Kind::Two:
+            a.writeBE<uint16_t>(static_cast<uint16_t>(value));
+            break;
+          case Kind::Four:
+            a.writeBE<uint32_t>(value);
+            break;
+          default:
+            writeVarint(a, value);
+            break;
+        }
+      }
+  );
+  return *this;
+}
+
+Properties& Properties::add(Id id, std::string_view value) {
+  if (kindOf(static_cast<uint32_t>(id)) != Kind::String) return *this;
+  data_ = rebuild(
+      data_, [](Id) { return true; },
+      [&](folly::io::QueueAppender& a) {
+        a.write<uint8_t>(static_cast<uint8_t>(id));
+        writeString(a, value);
+      }
+  );
+  return *this;
+}
+
+Properties& Properties::addUser(std::string_view key, std::string_view value) {
+  data_ = rebuild(
+      data_, [](Id) { return true; },
+      [&](folly::io::QueueAppender& a) {
+        a.write<uint8_t>(static_cast<uint8_t>(Id::UserProperty));
+        writeString(a, key);
+        writeString(a, value);
+      }
+  );
+  return *this;
+}
+
+Properties Properties::without(Id id) const {
+  if (!contains(id)) return *this;
+  return Properties(rebuild(data_, [id](Id i) { return i != id; }, [](auto&) {}));
+}
+
+Properties Properties::with(Id id, uint32_t value) const {
+  auto out = without(id);
+  out.add(id, value);
+  return out;
+}
+
+bool Properties::valid() const {
+  return scan(data_, [](Id, folly::io::Cursor&) { return false; });
+}
+
+void Properties::encode(folly::io::QueueAppender& a) const {
+  writeVarint(a, static_cast<uint32_t>(data_.computeChainDataLength()));
+  for (auto const range : data_) {
+    a.push(range.data(), range.size());
+  }
+}
+
+bool Properties::decode(folly::io::Cursor& cur, uint32_t& left, Properties& out) {
+  uint32_t n = 0;
+  if (!readVarint(cur, left, n) || left < n) return false;
+  out.data_ = folly::IOBuf{};
+  if (n > 0) {
+    cur.clone(out.data_, n);
+  }
+  left -= n;
+  return true;
+}
+}  // namespace warp::mqtt
@@ -0,0 +1,30 @@
+#include "warp/mqtt/registry.h"
+
+namespace warp::mqtt {
+std::shared_ptr<Channel> Registry::add(
+    std::string const& client, std::shared_ptr<Channel> channel
+) {
+  for (;;) {
+    auto [it, inserted] = channels_.insert(client, channel);
+    if (inserted) return nullptr;
+    auto previous = it->second;
+    if (previous == channel) return nullptr;
+    // Lost a race with another takeover or a removal; try again.
+    if (channels_.assign_if_equal(client, previous, channel)) return previous;
+  }
+}
+
+bool Registry::remove(std::string const& client, Channel const* channel) {
+  auto it = channels_.find(client);
+  if (it == channels_.cend() || it->second.get() != channel) return false;
+  auto const current = it->second;
+  return channels_.erase_if_equal(client, current) > 0;
+}
+
+std::shared_ptr<Channel> Registry::find(std::string const& client) const {
+  auto it = channels_.find(client);
+  return it == channels_.cend() ? nullptr : it->second;
+}
+
+size_t Registry::size() const { return channels_.size(); }
+}  // namespace warp::mqtt
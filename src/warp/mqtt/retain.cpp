@@ -0,0 +1,179 @@
+#include "warp/mqtt/retain.h"
+
+#include <folly/container/F14Map.h>
+
+#include <mutex>
+#include <shared_mutex>
+#include <span>
+
+#include "warp/mqtt/trie.h"
+
+namespace warp::mqtt {
+namespace {
+folly::IOBuf compact(folly::IOBuf const& data) {
+  auto const size = data.computeChainDataLength();
+  if (data.computeChainCapacity() <= 2 * size) return data;
+  folly::IOBuf out(folly::IOBuf::CREATE, size);
+  folly::io::Cursor(&data).pull(out.writableData(), size);
+  out.append(size);
+  return out;
+}
+
+// Retained payloads and properties may be slices of a much larger read
+// buffer; copy those so the store does not pin the whole buffer for the
+// lifetime of the message.
+Publish compact(Publish const& msg) {
+  Publish out;
+  out.head = msg.head;
+  if (!msg.head.properties.empty()) {
+    out.head.properties = Properties(compact(msg.head.properties.data()));
+  }
+  out.data.data = compact(msg.data.data);
+  return out;
+}
+}  // namespace
+
+struct RetainStore::Node {
+  folly::F14FastMap<std::string, std::unique_ptr<Node>> children;
+  std::shared_ptr<SharedPublish const> msg;
+  size_t bytes{0};
+
+  bool empty() const { return children.empty() && !msg; }
+
+  Node const* find(std::span<std::string_view const> levels) const {
+    auto const* node = this;
+    for (auto const level : levels) {
+      auto it = node->children.find(level);
+      if (it == node->children.end()) return nullptr;
+      node = it->second.get();
+    }
+    return node;
+  }
+
+  bool erase(std::span<std::string_view const> levels, size_t& freed) {
+    if (levels.empty()) {
+      if (!msg) return false;
+      freed = bytes;
+      msg.reset();
+      bytes = 0;
+      return true;
+    }
+    auto it = children.find(levels.front());
+    if (it == children.end() || !it->second->erase(levels.subspan(1), freed)) return false;
+    if (it->second->empty()) children.erase(it);
+    return true;
+  }
+
+  void collect(
+      std::span<std::string_view const> levels, bool root,
+      std::vector<std::shared_ptr<SharedPublish const>>& out
+  ) const {
+    if (levels.empty()) {
+      if (msg) out.push_back(msg);
+      return;
+    }
+    auto const level = levels.front();
+    if (level == "#") {
+      collectAll(root, out);
+      return;
+    }
+    auto const rest = levels.subspan(1);
+    if (level == "+") {
+      for (auto const& [name, child] : children) {
+        if (root && name.starts_with('$')) continue;
+        child->collect(rest, false, out);
+      }
+      return;
+    }
+    if (auto it = children.find(level); it != children.end()) {
+      it->second->collect(rest, false, out);
+    }
+  }
+
+  void collectAll(bool root, std::vector<std::shared_ptr<SharedPublish const>>& out) const {
+    if (msg) out.push_back(msg);
+    for (auto const& [name, child] : children) {
+      if (root && name.starts_with('$')) continue;
+      child->collectAll(false, out);
+    }
+  }
+};
+
+RetainStore::RetainStore(size_t limit) : root_(std::make_unique<Node>()), limit_(limit) {}
+
+RetainStore::~RetainStore() = default;
+
+bool RetainStore::retain(Publish const& msg) {
+  if (!isValidTopicName(msg.head.topic)) return false;
+  return retain(msg, splitTopic(msg.head.topic));
+}
+
+bool RetainStore::retain(Publish const& msg, Topic const& topic) {
+  if (!isValidTopicName(topic.name())) return false;
+  return retain(msg, topic.levels());
+}
+
+bool RetainStore::retain(Publish const& msg, TopicLevels const& levels) {
+  std::span<std::string_view const> const path{levels.data(), levels.size()};
+
+  if (msg.data.data.empty()) {
+    std::unique_lock lock(mutex_);
+    size_t freed = 0;
+    if (root_->erase(path, freed)) {
+      --size_;
+      bytes_ -= freed;
+    }
+    return true;
+  }
+
+  auto entry = std::make_shared<SharedPublish const>(compact(msg), true);
+  size_t const bytes = msg.head.topic.size() + entry->size();
+
+  std::unique_lock lock(mutex_);
+  auto const* prev = root_->find(path);
+  size_t const old = prev ? prev->bytes : 0;
+  if (bytes_ - old + bytes > limit_) {
+    // The message it would have replaced is out of date; better none at all.
+    size_t freed = 0;
+    if (root_->erase(path, freed)) {
+      --size_;
+      bytes_ -= freed;
+    }
+    return false;
+  }
+
+  auto* node = root_.get();
+  for (auto const level : levels) {
+    auto it = node->children.find(level);
+    if (it == node->children.end()) {
+      it = node->children.emplace(std::string(level), std::make_unique<Node>()).first;
+    }
+    node = it->second.get();
+  }
+  if (!node->msg) ++size_;
+  node->msg = std::move(entry);
+  node->bytes = bytes;
+  bytes_ = bytes_ - old + bytes;
+  return true;
+}
+
+void RetainStore::match(
+    std::string_view filter, std::vector<std::shared_ptr<SharedPublish const>>& out
+) const {
+  if (!isValidTopicFilter(filter)) return;
+  auto const levels = splitTopic(filter);
+
+  std::shared_lock lock(mutex_);
+  root_->collect({levels.data(), levels.size()}, true, out);
+}
+
+size_t RetainStore::size() const {
+  std::shared_lock lock(mutex_);
+  return size_;
+}
+
+size_t RetainStore::bytes() const {
+  std::shared_lock lock(mutex_);
+  return bytes_;
+}
+}  // namespace warp::mqtt
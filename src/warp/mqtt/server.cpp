@@ -1,29 +1,55 @@
 #include "warp/mqtt/server.h"
 
+#include <folly/Random.h>
 #include <folly/executors/CPUThreadPoolExecutor.h>
+#include <folly/executors/SerialExecutor.h>
 #include <folly/io/async/AsyncTimeout.h>
-#include <folly/io/async/TimeoutManager.h>
+#include <folly/io/async/EventBaseManager.h>
 #include <folly/system/HardwareConcurrency.h>
 #include <wangle/bootstrap/ServerBootstrap.h>
 #include <wangle/channel/AsyncSocketHandler.h>
 #include <wangle/channel/EventBaseHandler.h>
+#include <wangle/channel/Handler.h>
 #include <wangle/channel/Pipeline.h>
-#include <wangle/service/ExecutorFilter.h>
 #include <wangle/service/ServerDispatcher.h>
+#include <wangle/service/Service.h>
+
+#include <fmt/format.h>
+
+#include <algorithm>
+#include <atomic>
+#include <vector>
 
 #include "warp/mqtt/codec.h"
+#include "warp/mqtt/connection.h"
+#include "warp/mqtt/keepalive.h"
+#include "warp/mqtt/registry.h"
+#include "warp/mqtt/retain.h"
+#include "warp/mqtt/session.h"
+#include "warp/mqtt/topic.h"
+#include "warp/mqtt/trie.h"
+#include "warp/utils/buffer.h"
 #include "warp/websocket/handler.h"
 
 namespace warp::mqtt {
-namespace {
-struct DataTraits {
-  static inline const folly::RequestToken kToken{"warp.mqtt.handler"};
-};
-}  // namespace
-
 class HandlerOptions {
 public:
   std::chrono::seconds timeout{90};
+  ConnectionOptions connection{};
+  LimitOptions limits{};
+  ReadOptions read{};
+};
+
+// Runs fn once the current loop iteration is done; owned by whoever it calls
+// back into, so it is cancelled when they go.
+class Deferred final : public folly::EventBase::LoopCallback {
+public:
+  explicit Deferred(folly::Function<void()> fn) : fn_(std::move(fn)) {}
+
+  void runLoopCallback() noexcept override { fn_(); }
+
+private:
+  folly::Function<void()> fn_;
 };
 
 class Handler final
@@ -32,101 +58,345 @@ public:
   using Context = typename wangle::Handler<
       folly::IOBufQueue&, Message, Message, std::unique_ptr<folly::IOBuf>>::Context;
 
-  Handler()
-      : context_(std::make_shared<folly::RequestContext>()),
-        options_(std::make_unique<HandlerOptions>()) {}
+  Handler(
+      std::shared_ptr<SessionStore> sessions, std::shared_ptr<Registry> registry,
+      std::shared_ptr<folly::Executor> executor, std::shared_ptr<Limiter> accepts,
+      std::shared_ptr<Quota> partial, HandlerOptions const& options
+  )
+      : sessions_(std::move(sessions)),
+        registry_(std::move(registry)),
+        executor_(std::move(executor)),
+        accepts_(std::move(accepts)),
+        partial_(std::move(partial)),
+        context_(std::make_shared<folly::RequestContext>()),
+        options_(std::make_unique<HandlerOptions>(options)),
+        packets_(options.limits.packets, options.limits.burst),
+        bytes_(options.limits.bytes, options.limits.burst),
+        aliases_(options.connection.aliases) {}
 
+  // Over its rates a client is not decoded any further: reads stop until it
+  // is back under them and what is left in the queue waits until then. Past
+  // its read budget it yields to the other connections of the loop and picks
+  // up where it left off once they have been served. A frame over the
+  // packet size is refused as soon as its fixed header is in, and one still
+  // arriving counts against the partial cap until it is whole. Only bytes
+  // from the client count as activity, not picking up what was left.
   void read(Context* ctx, folly::IOBufQueue& q) override {
     folly::RequestContextScopeGuard guard(context_);
+    queue_ = &q;
+    if (q.chainLength() > seen_) {
+      touch();
+    }
+    if (throttled_) {
+      pending_ = &q;
+      seen_ = q.chainLength();
+      return;
+    }
+    auto wait = bytes_.take(static_cast<double>(q.chainLength() - left_));
+    auto const start = q.chainLength();
+    size_t messages = 0;
     for (;;) {
-      auto msg = Codec::decode(q);
+      if (wait.count() > 0) {
+        throttle(q, wait);
+        break;
+      }
+      auto const& budget = options_->read;
+      if (messages > 0 &&
+          (messages >= budget.messages || start - q.chainLength() >= budget.bytes)) {
+        defer(ctx, q);
+        break;
+      }
+      auto const frame = Codec::frameSize(q);
+      if (!frame && frame.error() == Codec::Error::Malformed) {
+        reject(ctx, Reason::MalformedPacket);
+        return;
+      }
+      if (frame.value_or(0) > options_->connection.packet) {
+        reject(ctx, Reason::PacketTooLarge);
+        return;
+      }
+      auto const before = q.chainLength();
+      auto msg = Codec::decode(q, level_);
       if (!msg) {
+        // A whole frame that fails to decode has been taken off the queue.
+        if (q.chainLength() != before) {
+          reject(ctx, Reason::MalformedPacket);
+          return;
+        }
         break;
       }
+      ++messages;
+      wait = packets_.take(1);
+      if (auto const* connect = std::get_if<Connect>(&*msg)) {
+        level_ = connect->head.level;
+        if (connection_) {
+          connection_->setLevel(level_);
+          if (level_ == Level::V5) {
+            auto const accepted =
+                connect->head.properties.integer(Properties::Id::TopicAliasMaximum);
+            connection_->setAliases(
+                std::min<uint16_t>(accepted.value_or(0), options_->connection.aliases)
+            );
+          }
+        }
+        if (0 < connect->head.timeout) {
+          setTimeout(connect->head.timeout + connect->head.timeout / 2);
+        }
+      } else if (auto* publish = std::get_if<Publish>(&*msg)) {
+        if (level_ == Level::V5 && !aliases_.resolve(*publish)) {
+          reject(ctx, Reason::TopicAliasInvalid);
+          return;
+        }
+        // Refused before the service sees it, so it is never acknowledged.
+        if (!isValidTopicName(publish->head.topic)) {
+          reject(ctx, Reason::TopicNameInvalid);
+          return;
+        }
+      }
       ctx->fireRead(std::move(*msg));
     }
-    if (timeout_) {
-      timeout_->scheduleTimeout(options_->timeout);
-    }
+    left_ = q.chainLength();
+    seen_ = left_;
+    // Whole frames left behind by a throttle or the read budget are not
+    // partial; they are decoded as soon as this connection gets a turn.
+    auto const size = Codec::frameSize(q);
+    incomplete_ = !size || *size > q.chainLength() ? q.chainLength() : 0;
+    hold(ctx);
   }
 
   folly::Future<folly::Unit> write(Context* ctx, Message msg) override {
-    auto out = Codec::encode(msg);
-    return ctx->fireWrite(std::move(out));
+    if (std::holds_alternative<None>(msg) || !evb_) return folly::makeFuture();
+    // Everything goes through the connection's queue, so that it is ordered
+    // and counted with the rest. connection_ is only touched on the IO
+    // thread, and once it is gone the client is too.
+    if (evb_->isInEventBaseThread()) {
+      if (connection_) {
+        connection_->send(msg);
+      }
+      return folly::makeFuture();
+    }
+    evb_->runInEventBaseThread([this, pipeline = ctx->getPipelineShared(), msg = std::move(msg)]() {
+      if (connection_) {
+        connection_->send(msg);
+      }
+    });
+    return folly::makeFuture();
   }
 
   void transportActive(Context* ctx) override {
-    context_->setContextDataIfAbsent(
-        DataTraits::kToken, std::make_unique<folly::ImmutableRequestData<Handler*>>(this)
+    evb_ = eventBase(ctx);
+    connection_ = std::make_shared<Connection>(
+        sessions_, registry_, evb_, ctx,
+        folly::SerialExecutor::create(folly::getKeepAliveToken(executor_.get())),
+        options_->connection
+    );
+    setConnection(*context_, connection_);
+    if (!keepAlive_) {
+      keepAlive_ = std::make_unique<KeepAlive>(*evb_, [ctx]() { ctx->fireClose(); });
+    }
+    keepAlive_->schedule(options_->timeout);
+    // Tracked on the same wheel as the keep-alive, and just as cheap to touch.
+    if (!idle_) {
+      idle_ = std::make_unique<KeepAlive>(*evb_, [this]() { trim(); });
+    }
+    idle_->schedule(options_->connection.idle);
+    resume_ = folly::AsyncTimeout::make(
+        *evb_,
+        [this, ctx]() noexcept {
+          throttled_ = false;
+          if (connection_) {
+            connection_->resume();
+          }
+          if (auto* q = std::exchange(pending_, nullptr)) {
+            read(ctx, *q);
+          }
+        }
     );
-    if (!timeout_) {
-      timeout_ = folly::AsyncTimeout::make(
-          static_cast<folly::TimeoutManager&>(*ctx->getTransport()->getEventBase()),
-          [ctx]() noexcept { ctx->fireClose(); }
-      );
+    if (auto const wait = accepts_->take(1); wait.count() > 0) {
+      throttle(wait);
     }
+    deferred_ = std::make_unique<Deferred>([this, ctx]() {
+      if (auto* q = std::exchange(pending_, nullptr)) {
+        read(ctx, *q);
+      }
+    });
     ctx->fireTransportActive();
   }
 
   void transportInactive(Context* ctx) override {
-    timeout_.reset();
+    if (keepAlive_) {
+      keepAlive_->cancel();
+    }
+    if (idle_) {
+      idle_->cancel();
+    }
+    if (resume_) {
+      resume_->cancelTimeout();
+    }
+    if (deferred_) {
+      deferred_->cancelLoopCallback();
+    }
+    release();
     ctx->fireTransportInactive();
   }
 
+  void detachPipeline(Context*) override { release(); }
+
+  // Bytes the transport in front holds of a frame still arriving, counted
+  // against partial_ with the read queue's own.
+  void setBuffered(size_t bytes) {
+    buffered_ = bytes;
+    hold(getContext());
+  }
+
+private:
+  // The EventBase the pipeline runs on, whichever transport is at its front.
+  static folly::EventBase* eventBase(Context* ctx) {
+    if (auto const transport = ctx->getTransport()) {
+      return transport->getEventBase();
+    }
+    auto* websocket = ctx->getPipeline()->getHandler<WebSocketTransport>();
+    return websocket ? websocket->eventBase() : nullptr;
+  }
+
+  // Tells an MQTT 5 client why it is disconnected before closing.
+  void reject(Context* ctx, Reason reason) {
+    if (level_ == Level::V5) {
+      ctx->fireWrite(Codec::encode(Disconnect::Builder{}.withReason(reason).build()));
+    }
+    ctx->fireClose();
+  }
+
+  void touch() {
+    if (keepAlive_) {
+      keepAlive_->touch();
+    }
+    if (idle_ && idle_->scheduled()) {
+      idle_->touch();
+    } else if (idle_) {
+      idle_->schedule(options_->connection.idle);
+    }
+  }
+
+  void throttle(folly::IOBufQueue& q, std::chrono::milliseconds wait) {
+    pending_ = &q;
+    throttle(wait);
+  }
+
+  // A connection that only pings now and then holds no buffers in between.
+  // Its next read allocates again, from the allocator's per-thread caches.
+  void trim() {
+    if (queue_) {
+      utils::trim(*queue_);
+    }
+    if (connection_) {
+      connection_->shrink();
+    }
+  }
+
+  // Loop callbacks run once the ready sockets of this iteration have been
+  // read, so everyone else gets a turn first.
+  void defer(Context* ctx, folly::IOBufQueue& q) {
+    pending_ = &q;
+    if (!deferred_->isLoopCallbackScheduled()) {
+      evb_->runInLoop(deferred_.get());
+    }
+  }
+
+  void throttle(std::chrono::milliseconds wait) {
+    throttled_ = true;
+    if (connection_) {
+      connection_->pause();
+    }
+    resume_->scheduleTimeout(wait);
+  }
+
   void setTimeout(uint32_t timeout) {
-    if (timeout_) {
-      auto* evb = const_cast<folly::EventBase*>(
-          dynamic_cast<folly::EventBase const*>(timeout_->getTimeoutManager())
-      );
-      evb->runInEventBaseThread([this, timeout]() noexcept {
-        options_->timeout =
-            timeout > 0 ? std::chrono::seconds(timeout) : std::chrono::seconds::zero();
-        if (timeout_) {
-          if (options_->timeout > std::chrono::seconds::zero()) {
-            timeout_->scheduleTimeout(options_->timeout);
-          } else {
-            timeout_->cancelTimeout();
-          }
-        }
-      });
+    options_->timeout = std::chrono::seconds(timeout);
+    if (keepAlive_) {
+      keepAlive_->schedule(options_->timeout);
     }
   }
 
-private:
-  std::shared_ptr<folly::RequestContext> context_;
-  std::unique_ptr<HandlerOptions> options_;
-  std::unique_ptr<folly::AsyncTimeout> timeout_;
-};
+  // Counts what the connection holds of frames not yet decoded against
+  // partial_. Past the cap the largest holders are let go; when this is one
+  // of them it goes at once.
+  void hold(Context* ctx) {
+    if (incomplete_ + buffered_ == held_ || !connection_) return;
+    held_ = incomplete_ + buffered_;
+    if (!partial_->update(connection_, held_)) {
+      reject(ctx, Reason::QuotaExceeded);
+    }
+  }
 
-namespace {
-Handler* getHandler() noexcept {
-  if (auto* rc = folly::RequestContext::try_get()) {
-    if (auto* d = rc->getContextData(DataTraits::kToken)) {
-      if (auto* p = static_cast<folly::ImmutableRequestData<Handler*>*>(d)) {
-        return p->value();
-      }
+  void release() {
+    held_ = 0;
+    if (connection_) {
+      partial_->update(connection_, 0);
+      connection_->close();
+      connection_.reset();
     }
   }
-  return nullptr;
-}
-}  // namespace
+
+  std::shared_ptr<SessionStore> sessions_;
+  std::shared_ptr<Registry> registry_;
+  std::shared_ptr<folly::Executor> executor_;
+  std::shared_ptr<Limiter> accepts_;
+  std::shared_ptr<Quota> partial_;
+  folly::EventBase* evb_{nullptr};
+  std::shared_ptr<Connection> connection_;
+  std::shared_ptr<folly::RequestContext> context_;
+  std::unique_ptr<HandlerOptions> options_;
+  std::unique_ptr<KeepAlive> keepAlive_;
+  std::unique_ptr<KeepAlive> idle_;
+  std::unique_ptr<folly::AsyncTimeout> resume_;
+  std::unique_ptr<Deferred> deferred_;
+  Limiter packets_;
+  Limiter bytes_;
+  // Bytes left in the read queue by the last read, already taken from bytes_.
+  size_t left_{0};
+  // Bytes in the read queue when the last read returned, whether or not it
+  // got to decode them.
+  size_t seen_{0};
+  // Bytes of the frame at the front of the read queue while it is incomplete,
+  // and what is counted against partial_.
+  size_t incomplete_{0};
+  size_t buffered_{0};
+  size_t held_{0};
+  bool throttled_{false};
+  folly::IOBufQueue* pending_{nullptr};
+  // The socket handler's read queue, once something has been read.
+  folly::IOBufQueue* queue_{nullptr};
+  Level level_{Level::V311};
+  InboundAliases aliases_;
+};
 
 class Service final : public wangle::Service<Message, Message> {
 public:
+  Service(
+      std::shared_ptr<Trie> trie, std::shared_ptr<RetainStore> retain,
+      std::shared_ptr<SessionStore> sessions, std::shared_ptr<Registry> registry,
+      std::shared_ptr<TopicTable> topics
+  )
+      : trie_(std::move(trie)),
+        retain_(std::move(retain)),
+        sessions_(std::move(sessions)),
+        registry_(std::move(registry)),
+        topics_(std::move(topics)) {}
+
   folly::Future<Message> operator()(Message msg) override {
     return std::visit(
-        [](auto&& m) -> folly::Future<Message> {
+        [this](auto&& m) -> folly::Future<Message> {
           using T = std::decay_t<decltype(m)>;
           if constexpr (std::is_same_v<T, Connect>) {
-            if (auto* handler = getHandler()) {
-              if (0 < m.head.timeout) {
-                handler->setTimeout(m.head.timeout + m.head.timeout / 2);
-              }
-            }
-            return folly::makeFuture<Message>(
-                ConnAck::Builder{}.withSession(0).withReason(0).build()
-            );
+            return folly::makeFuture<Message>(connect(m));
           } else if constexpr (std::is_same_v<T, Publish>) {
+            // A QoS 2 message is routed once; a resend before the PubRel
+            // only gets its PubRec again.
+            auto session = m.head.qos == 2 ? getSession() : nullptr;
+            if (!session || session->accept(m.head.packetId)) {
+              publish(m);
+            }
             if (m.head.qos == 1) {
               return folly::makeFuture<Message>(
                   PubAck::Builder{}.withPacketId(m.head.packetId).build()
@@ -137,18 +407,30 @@ public:
               );
             }
             return folly::makeFuture<Message>(None{});
+          } else if constexpr (std::is_same_v<T, PubAck> || std::is_same_v<T, PubComp>) {
+            // A subscriber is done with a delivery.
+            if (auto session = getSession()) {
+              session->acknowledge(m.head.packetId);
+            }
+            return folly::makeFuture<Message>(None{});
+          } else if constexpr (std::is_same_v<T, PubRec>) {
+            if (auto session = getSession()) {
+              session->received(m.head.packetId);
+            }
+            return folly::makeFuture<Message>(
+                PubRel::Builder{}.withPacketId(m.head.packetId).build()
+            );
           } else if constexpr (std::is_same_v<T, PubRel>) {
+            if (auto session = getSession()) {
+              session->complete(m.head.packetId);
+            }
             return folly::makeFuture<Message>(
                 PubComp::Builder{}.withPacketId(m.head.packetId).build()
             );
           } else if constexpr (std::is_same_v<T, Subscribe>) {
-            return folly::makeFuture<Message>(
-                SubAck::Builder{}.withPacketId(m.head.packetId).withCodesFrom(m).build()
-            );
+            return folly::makeFuture<Message>(subscribe(m));
           } else if constexpr (std::is_same_v<T, Unsubscribe>) {
-            return folly::makeFuture<Message>(
-                UnsubAck::Builder{}.withPacketId(m.head.packetId).build()
-            );
+            return folly::makeFuture<Message>(unsubscribe(m));
           } else if constexpr (std::is_same_v<T, PingReq>) {
             return folly::makeFuture<Message>(PingResp::Builder{}.build());
           } else {
@@ -158,6 +440,136 @@ public:
         std::move(msg)
     );
   }
+
+private:
+  Message connect(Connect const& msg) const {
+    auto builder = ConnAck::Builder{}.withSession(0).withLevel(msg.head.level);
+    auto connection = getConnection();
+    if (!connection) {
+      return builder.withReason(0).build();
+    }
+    bool const clean = (msg.head.flags & 0x02) != 0;
+    auto client = msg.data.client;
+    auto expiry = clean ? std::chrono::seconds(0) : Session::kNever;
+    if (msg.head.level == Level::V5) {
+      auto const interval = msg.head.properties.sessionExpiry().value_or(0);
+      expiry = interval == 0xFFFFFFFF ? Session::kNever : std::chrono::seconds(interval);
+      Properties properties;
+      // MQTT 5 clients may leave the identifier to the server.
+      if (client.empty()) {
+        client = fmt::format("warp-{:016x}", folly::Random::rand64());
+        properties.add(Properties::Id::AssignedClient, client);
+      }
+      if (auto const aliases = connection->options().aliases) {
+        properties.add(Properties::Id::TopicAliasMaximum, aliases);
+      }
+      properties.add(Properties::Id::MaximumPacketSize, connection->options().packet);
+      builder.withProperties(std::move(properties));
+    } else if (client.empty() && !clean) {
+      return builder.withReason(0x02).build();
+    }
+    // A client id connects once. The earlier connection is closed only after
+    // the session has moved here, so its teardown leaves the session alone.
+    auto previous = client.empty() ? nullptr : registry_->add(client, connection);
+    auto [session, present] = sessions_->open(client, clean, expiry);
+    // Messages queued while offline must follow the ConnAck.
+    connection->write(Codec::encode(builder.withSession(present ? 1 : 0).withReason(0).build()));
+    if (!connection->attach(std::move(session))) {
+      registry_->remove(client, connection.get());
+    }
+    if (previous) {
+      previous->evict(Reason::SessionTakenOver);
+    }
+    return None{};
+  }
+
+  static std::shared_ptr<Session> getSession() {
+    auto connection = getConnection();
+    return connection ? connection->session() : nullptr;
+  }
+
+  void publish(Publish const& msg) const {
+    auto const topic = topics_->intern(msg.head.topic);
+    if (msg.head.retain) {
+      // Past the cap the store keeps nothing for the topic rather than a
+      // stale value; the message itself is still routed.
+      retain_->retain(msg, *topic);
+    }
+    std::vector<Trie::Match> matches;
+    trie_->match(*topic, matches);
+    if (matches.size() > 1) {
+      std::sort(matches.begin(), matches.end(), [](auto const& a, auto const& b) {
+        return a.subscriber.get() < b.subscriber.get();
+      });
+      auto out = matches.begin();
+      for (auto it = std::next(out); it != matches.end(); ++it) {
+        if (it->subscriber == out->subscriber) {
+          out->qos = std::max(out->qos, it->qos);
+        } else if (++out != it) {
+          *out = std::move(*it);
+        }
+      }
+      matches.erase(std::next(out), matches.end());
+    }
+    if (matches.empty()) return;
+    // Shared so that sessions can keep it while their client is offline.
+    auto const shared = std::make_shared<SharedPublish const>(msg);
+    for (auto const& match : matches) {
+      match.subscriber->publish(*shared, std::min(match.qos, msg.head.qos));
+    }
+  }
+
+  Message subscribe(Subscribe const& msg) const {
+    auto builder = SubAck::Builder{}.withPacketId(msg.head.packetId).withLevel(msg.head.level);
+    auto connection = getConnection();
+    if (!connection) {
+      return builder.withCodesFrom(msg).build();
+    }
+    auto session = connection->session();
+    std::vector<std::shared_ptr<SharedPublish const>> retained;
+    std::vector<uint8_t> granted;
+    for (auto const& topic : msg.data.topics) {
+      bool existed = false;
+      bool const ok =
+          session && topic.qos <= 2 && session->subscribe(topic.filter, topic.qos, existed);
+      builder.addCode(ok ? topic.qos : 0x80);
+      // Shared subscriptions get no retained messages, nor do MQTT 5
+      // subscriptions that opted out with retain handling 2, or that asked
+      // for them only when new with retain handling 1.
+      auto const handling = topic.options & 0x30;
+      bool const skip = topic.filter.starts_with("$share/") || handling == 0x20 ||
+                        (handling == 0x10 && existed);
+      if (ok && !skip) {
+        retain_->match(topic.filter, retained);
+        granted.resize(retained.size(), topic.qos);
+      }
+    }
+    if (retained.empty()) {
+      return builder.build();
+    }
+    // Retained messages must follow the SubAck, so both go out on the connection.
+    connection->write(Codec::encode(builder.build()));
+    for (size_t i = 0; i < retained.size(); ++i) {
+      session->publish(*retained[i], std::min(granted[i], retained[i]->qos()));
+    }
+    return None{};
+  }
+
+  static Message unsubscribe(Unsubscribe const& msg) {
+    auto builder = UnsubAck::Builder{}.withPacketId(msg.head.packetId).withLevel(msg.head.level);
+    auto session = getSession();
+    for (auto const& filter : msg.data.topics) {
+      bool const ok = session && session->unsubscribe(filter);
+      builder.addCode(ok ? Reason::Success : Reason::NoSubscriptionExisted);
+    }
+    return builder.build();
+  }
+
+  std::shared_ptr<Trie> trie_;
+  std::shared_ptr<RetainStore> retain_;
+  std::shared_ptr<SessionStore> sessions_;
+  std::shared_ptr<Registry> registry_;
+  std::shared_ptr<TopicTable> topics_;
 };
 
 using Pipeline = wangle::Pipeline<folly::IOBufQueue&, Message>;
@@ -167,49 +579,228 @@ std::shared_ptr<Service> service;
 std::shared_ptr<wangle::ServerBootstrap<Pipeline>> server;
 }  // namespace
 
+// Runs packets that are cheap to answer on the connection's EventBase and
+// hands the rest to the connection's serial executor. A packet only runs
+// inline once everything offloaded before it has been answered.
+class DispatchFilter final : public wangle::ServiceFilter<Message, Message> {
+public:
+  DispatchFilter(
+      std::shared_ptr<folly::Executor> executor,
+      std::shared_ptr<wangle::Service<Message, Message>> service, Dispatch dispatch
+  )
+      : wangle::ServiceFilter<Message, Message>(std::move(service)),
+        executor_(std::move(executor)),
+        dispatch_(dispatch) {}
+
+  folly::Future<Message> operator()(Message msg) override {
+    auto connection = getConnection();
+    if (!connection) {
+      return folly::via(executor_.get(), [service = service_, msg = std::move(msg)]() mutable {
+        return (*service)(std::move(msg));
+      });
+    }
+    if (connection->idle() && runInline(msg)) {
+      return (*service_)(std::move(msg));
+    }
+    // The response is written by the connection so that it is ordered with
+    // anything answered inline later.
+    connection->enqueue();
+    auto* executor = connection->executor();
+    return folly::via(
+        executor,
+        [service = service_, connection = std::move(connection), msg = std::move(msg)]() mutable {
+          return (*service)(std::move(msg)).thenValue([connection](Message out) {
+            connection->complete(std::move(out));
+            return Message{None{}};
+          });
+        }
+    );
+  }
+
+private:
+  bool runInline(Message const& msg) const {
+    switch (dispatch_) {
+      case Dispatch::Inline:
+        return true;
+      case Dispatch::Control:
+        return !std::holds_alternative<Publish>(msg) && !std::holds_alternative<Subscribe>(msg);
+      default:
+        return false;
+    }
+  }
+
+  std::shared_ptr<folly::Executor> executor_;
+  Dispatch dispatch_;
+};
+
 class PipelineFactory final : public wangle::PipelineFactory<Pipeline> {
 public:
-  explicit PipelineFactory(size_t threads)
-      : service_(std::make_shared<folly::CPUThreadPoolExecutor>(threads), service) {}
+  PipelineFactory(
+      ServerOptions const& options, std::shared_ptr<SessionStore> sessions,
+      std::shared_ptr<Registry> registry
+  )
+      : sessions_(std::move(sessions)),
+        registry_(std::move(registry)),
+        accepts_(std::make_shared<Limiter>(options.limits.connections, options.limits.burst)),
+        partial_(std::make_shared<Quota>(options.partial)),
+        executor_(std::make_shared<folly::CPUThreadPoolExecutor>(options.threads)),
+        service_(executor_, service, options.dispatch) {
+    options_.connection = options.connection;
+    options_.limits = options.limits;
+    options_.read = options.read;
+  }
 
   Pipeline::Ptr newPipeline(std::shared_ptr<folly::AsyncTransport> sock) override {
     auto pipeline = Pipeline::create();
     pipeline->addBack(wangle::AsyncSocketHandler(sock));
     pipeline->addBack(wangle::EventBaseHandler());
-    pipeline->addBack(Handler());
+    pipeline->addBack(Handler(sessions_, registry_, executor_, accepts_, partial_, options_));
+    pipeline->addBack(wangle::MultiplexServerDispatcher<Message, Message>(&service_));
+    pipeline->finalize();
+    return pipeline;
+  }
+
+  // The same pipeline for a client on the WebSocket endpoint, with the
+  // WebSocket handler in place of the socket.
+  Pipeline::Ptr newPipeline(folly::EventBase* evb, WebSocketTransport::Socket* socket) {
+    auto pipeline = Pipeline::create();
+    pipeline->addBack(WebSocketTransport(evb, socket));
+    pipeline->addBack(Handler(sessions_, registry_, executor_, accepts_, partial_, options_));
     pipeline->addBack(wangle::MultiplexServerDispatcher<Message, Message>(&service_));
     pipeline->finalize();
     return pipeline;
   }
 
 private:
-  wangle::ExecutorFilter<Message, Message> service_;
+  HandlerOptions options_;
+  std::shared_ptr<SessionStore> sessions_;
+  std::shared_ptr<Registry> registry_;
+  // New connections on this listener.
+  std::shared_ptr<Limiter> accepts_;
+  std::shared_ptr<Quota> partial_;
+  std::shared_ptr<folly::CPUThreadPoolExecutor> executor_;
+  DispatchFilter service_;
 };
 
-class WebSocketHandler final : public warp::websocket::Handler {
+// A client on the WebSocket endpoint is a broker session like any other: it
+// gets a pipeline of its own, run on the EventBase of the proxygen worker
+// that owns its stream, so packets are handled in order and cheap ones never
+// leave that thread.
+class WebSocketHandler final : public warp::websocket::Handler,
+                               public WebSocketTransport::Socket {
 public:
-  void onDataFrame(std::unique_ptr<folly::IOBuf> data, bool fin) override {
-    queue_.append(std::move(data));
-    for (;;) {
-      auto msg = Codec::decode(queue_);
-      if (!msg) {
-        break;
-      }
-      (*service)(std::move(*msg)).thenValue([this](Message out) {
-        auto buf = Codec::encode(out);
-        if (buf) {
-          sendData(std::move(buf));
-        }
-      });
+  WebSocketHandler(
+      warp::websocket::DeflateOptions const& deflate, uint32_t packet,
+      std::shared_ptr<PipelineFactory> pipelines
+  )
+      : warp::websocket::Handler(deflate, packet), pipelines_(std::move(pipelines)) {}
+
+  void onUpgrade(proxygen::UpgradeProtocol protocol) noexcept override {
+    warp::websocket::Handler::onUpgrade(protocol);
+    if (!pipelines_) {
+      // The broker has not started yet.
+      sendClose(1013);
+      return;
+    }
+    pipeline_ = pipelines_->newPipeline(folly::EventBaseManager::get()->getEventBase(), this);
+    pipeline_->transportActive();
+  }
+
+  void requestComplete() noexcept override {
+    detach();
+    warp::websocket::Handler::requestComplete();
+  }
+
+  void onError(proxygen::ProxygenError error) noexcept override {
+    detach();
+    warp::websocket::Handler::onError(error);
+  }
+
+  void onEgressPaused() noexcept override { paused_ = true; }
+
+  void onEgressResumed() noexcept override {
+    paused_ = false;
+    for (auto& drained : std::exchange(drained_, {})) {
+      drained.setValue();
     }
   }
 
+  folly::Future<folly::Unit> write(std::unique_ptr<folly::IOBuf> buf) override {
+    sendData(std::move(buf));
+    if (!paused_) return folly::makeFuture();
+    // The connection holds further writes in its own bounded queue meanwhile.
+    drained_.emplace_back();
+    return drained_.back().getFuture();
+  }
+
+  // As on the TCP path, the Connection and session go at once. The close
+  // frame and the end of the response follow; a client that does not finish
+  // the exchange in time has it aborted.
+  void close() override {
+    if (eom_) return;
+    sendClose(1000);
+    detach();
+    auto* evb = folly::EventBaseManager::get()->getEventBase();
+    linger_ = folly::AsyncTimeout::make(*evb, [this]() noexcept { downstream_->sendAbort(); });
+    linger_->scheduleTimeout(kLinger);
+    // This may run from inside onBody, and proxygen may complete the request,
+    // and delete this, on the end of the response. So that goes out once the
+    // frames being handled are done with.
+    eom_ = std::make_unique<Deferred>([this]() { downstream_->sendEOM(); });
+    evb->runInLoop(eom_.get());
+  }
+
+  void setReading(bool on) override {
+    on ? downstream_->resumeIngress() : downstream_->pauseIngress();
+  }
+
+protected:
+  void onPending(size_t bytes) override {
+    if (auto* handler = pipeline_ ? pipeline_->getHandler<mqtt::Handler>() : nullptr) {
+      handler->setBuffered(bytes);
+    }
+  }
+
+  void onDataFrame(std::unique_ptr<folly::IOBuf> data, bool) override {
+    if (!pipeline_) return;
+    queue_.append(std::move(data));
+    pipeline_->read(queue_);
+  }
+
 private:
+  static constexpr std::chrono::seconds kLinger{5};
+
+  void detach() {
+    for (auto& drained : std::exchange(drained_, {})) {
+      drained.setValue();
+    }
+    if (!pipeline_) return;
+    auto pipeline = std::move(pipeline_);
+    if (auto* transport = pipeline->getHandler<WebSocketTransport>()) {
+      transport->detach();
+    }
+    pipeline->transportInactive();
+    // This may run from inside the pipeline, so it is freed once that returns.
+    folly::EventBaseManager::get()->getEventBase()->runInLoop(
+        [pipeline = std::move(pipeline)]() {}
+    );
+  }
+
+  std::shared_ptr<PipelineFactory> pipelines_;
+  Pipeline::Ptr pipeline_;
   folly::IOBufQueue queue_{folly::IOBufQueue::cacheChainLength()};
+  bool paused_{false};
+  std::vector<folly::Promise<folly::Unit>> drained_;
+  std::unique_ptr<folly::AsyncTimeout> linger_;
+  std::unique_ptr<Deferred> eom_;
 };
 
 class WebSocketHandlerFactory final : public proxygen::RequestHandlerFactory {
 public:
+  // No frame may be larger than the largest packet a client may send.
+  WebSocketHandlerFactory(warp::websocket::DeflateOptions const& deflate, uint32_t packet)
+      : deflate_(deflate), packet_(packet) {}
+
   void onServerStart(folly::EventBase*) noexcept override {}
 
   void onServerStop() noexcept override {}
@@ -217,15 +808,26 @@ public:
   proxygen::RequestHandler* onRequest(
       proxygen::RequestHandler*, proxygen::HTTPMessage*
   ) noexcept override {
-    return new WebSocketHandler();
+    return new WebSocketHandler(deflate_, packet_, pipelines_.load(std::memory_order_acquire));
+  }
+
+  // Set while the broker runs.
+  void attach(std::shared_ptr<PipelineFactory> pipelines) {
+    pipelines_.store(std::move(pipelines), std::memory_order_release);
   }
+
+private:
+  warp::websocket::DeflateOptions deflate_;
+  uint32_t packet_;
+  std::atomic<std::shared_ptr<PipelineFactory>> pipelines_;
 };
 
 namespace {
 std::shared_ptr<WebSocketHandlerFactory> factory;
 }  // namespace
 
-Server::Server(ServerOptions const& options) : options_(std::make_shared<ServerOptions>(options)) {
+Server::Server(ServerOptions const& options)
+    : options_(std::make_shared<ServerOptions>(options)), registry_(std::make_shared<Registry>()) {
   if (0 == options_->threads) {
     options_->threads = std::max(4u, folly::available_concurrency());
   }
@@ -234,11 +836,20 @@ Server::Server(ServerOptions const& options) : options_(std::make_shared<ServerO
 Server::~Server() {}
 
 void Server::start() {
-  service = std::make_shared<Service>();
+  auto trie = std::make_shared<Trie>(options_->balance);
+  auto sessions = std::make_shared<SessionStore>(trie, options_->session);
+  service = std::make_shared<Service>(
+      trie, std::make_shared<RetainStore>(options_->retained), sessions, registry_,
+      std::make_shared<TopicTable>(options_->topics)
+  );
+  auto pipelines = std::make_shared<PipelineFactory>(*options_, sessions, registry_);
+  getHandlerFactory();
+  factory->attach(pipelines);
   server = std::make_shared<wangle::ServerBootstrap<Pipeline>>();
-  server->childPipeline(std::make_shared<PipelineFactory>(options_->threads));
+  server->childPipeline(pipelines);
   server->bind(options_->port);
   server->waitForStop();
+  factory->attach(nullptr);
   server.reset();
   service.reset();
 }
@@ -247,7 +858,9 @@ void Server::stop() { server->stop(); }
 
 std::shared_ptr<proxygen::RequestHandlerFactory> Server::getHandlerFactory() {
   if (!factory) {
-    factory = std::make_shared<WebSocketHandlerFactory>();
+    factory = std::make_shared<WebSocketHandlerFactory>(
+        options_->deflate, options_->connection.packet
+    );
   }
   return factory;
 }
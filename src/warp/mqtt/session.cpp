@@ -0,0 +1,327 @@
+#include "warp/mqtt/session.h"
+
+#include <algorithm>
+#include <vector>
+
+#include "warp/mqtt/codec.h"
+
+namespace warp::mqtt {
+namespace {
+void append(std::unique_ptr<folly::IOBuf>& chain, std::unique_ptr<folly::IOBuf> buf) {
+  if (chain) {
+    chain->prependChain(std::move(buf));
+  } else {
+    chain = std::move(buf);
+  }
+}
+}  // namespace
+
+Session::Session(
+    std::string client, std::chrono::seconds expiry, std::shared_ptr<Trie> trie,
+    std::shared_ptr<Budget> budget
+)
+    : client_(std::move(client)),
+      trie_(std::move(trie)),
+      budget_(std::move(budget)),
+      expiry_(expiry),
+      offline_(Clock::now()) {}
+
+Session::~Session() { release(bytes_); }
+
+bool Session::clean() const {
+  std::lock_guard lock(mutex_);
+  return expiry_.count() == 0;
+}
+
+void Session::setExpiry(std::chrono::seconds expiry) {
+  std::lock_guard lock(mutex_);
+  expiry_ = expiry;
+}
+
+bool Session::expired(Clock::time_point now) const {
+  std::lock_guard lock(mutex_);
+  if (channel_ || expiry_ == kNever) return false;
+  return now - offline_ >= expiry_;
+}
+
+void Session::publish(SharedPublish const& msg, uint8_t qos) {
+  if (msg.expired()) return;
+  std::lock_guard lock(mutex_);
+  // QoS 1 and 2 messages wait behind those already waiting, and while the
+  // client has the most it may leave unacknowledged.
+  if (channel_ && (qos == 0 || (queue_.empty() && !full()))) {
+    channel_->write(encode(msg, qos));
+    backlog_.store(channel_->queued(), std::memory_order_relaxed);
+    return;
+  }
+  // Only QoS 1 and 2 messages are kept, and for a disconnected client only
+  // if the session outlives the connection.
+  if (qos == 0 || (!channel_ && expiry_.count() == 0)) return;
+  auto const& options = budget_->options;
+  auto const size = msg.size();
+  if (queue_.size() >= options.messages || bytes_ + size > options.bytes) {
+    ++dropped_;
+    return;
+  }
+  if (budget_->bytes.fetch_add(size, std::memory_order_relaxed) + size > options.total) {
+    budget_->bytes.fetch_sub(size, std::memory_order_relaxed);
+    ++dropped_;
+    return;
+  }
+  bytes_ += size;
+  // Encoded on delivery, for the level and expiry that apply by then.
+  queue_.push(Entry{msg.shared_from_this(), qos});
+}
+
+size_t Session::load() const { return backlog_.load(std::memory_order_relaxed); }
+
+void Session::setBacklog(size_t bytes) {
+  auto current = backlog_.load(std::memory_order_relaxed);
+  // A report that races with detach must not bring the session back online.
+  while (current != kOffline &&
+         !backlog_.compare_exchange_weak(current, bytes, std::memory_order_relaxed)) {
+  }
+}
+
+bool Session::subscribe(std::string const& filter, uint8_t qos) {
+  bool existed = false;
+  return subscribe(filter, qos, existed);
+}
+
+bool Session::subscribe(std::string const& filter, uint8_t qos, bool& existed) {
+  std::lock_guard lock(mutex_);
+  if (!trie_->subscribe(filter, shared_from_this(), qos)) return false;
+  existed = !filters_.insert(filter).second;
+  return true;
+}
+
+bool Session::unsubscribe(std::string const& filter) {
+  std::lock_guard lock(mutex_);
+  filters_.erase(filter);
+  return trie_->unsubscribe(filter, this);
+}
+
+bool Session::acknowledge(uint16_t packetId) {
+  std::lock_guard lock(mutex_);
+  if (inflight_.erase(packetId) == 0) return false;
+  if (channel_ && !queue_.empty()) {
+    std::unique_ptr<folly::IOBuf> chain;
+    drain(chain);
+    if (chain) {
+      channel_->write(std::move(chain));
+      backlog_.store(channel_->queued(), std::memory_order_relaxed);
+    }
+  }
+  return true;
+}
+
+bool Session::received(uint16_t packetId) {
+  std::lock_guard lock(mutex_);
+  auto it = inflight_.find(packetId);
+  if (it == inflight_.end() || it->second.qos != 2) return false;
+  it->second.msg.reset();
+  return true;
+}
+
+bool Session::accept(uint16_t packetId) {
+  std::lock_guard lock(mutex_);
+  return incoming_.insert(packetId).second;
+}
+
+bool Session::complete(uint16_t packetId) {
+  std::lock_guard lock(mutex_);
+  return incoming_.erase(packetId) != 0;
+}
+
+void Session::attach(std::shared_ptr<Channel> channel) {
+  std::lock_guard lock(mutex_);
+  channel_ = std::move(channel);
+  level_ = channel_->level();
+  aliases_.reset();
+  if (level_ == Level::V5 && channel_->aliases() > 0) {
+    aliases_ = std::make_unique<OutboundAliases>(channel_->aliases());
+  }
+  backlog_.store(channel_->queued(), std::memory_order_relaxed);
+  if (inflight_.empty() && queue_.empty()) return;
+  // Deliveries the client never acknowledged go out again first, in the
+  // order they first went out in, then what was queued; all of it as one
+  // chain and a single write.
+  std::vector<std::pair<uint64_t, uint16_t>> order;
+  order.reserve(inflight_.size());
+  for (auto const& [packetId, flight] : inflight_) {
+    order.emplace_back(flight.sequence, packetId);
+  }
+  std::sort(order.begin(), order.end());
+  std::unique_ptr<folly::IOBuf> chain;
+  for (auto const& [_, packetId] : order) {
+    auto const& flight = inflight_.find(packetId)->second;
+    if (!flight.msg) {
+      append(chain, Codec::encode(PubRel::Builder{}.withPacketId(packetId).build()));
+      continue;
+    }
+    auto buf = clone(*flight.msg, flight.qos, packetId);
+    // The header of a QoS 1 or 2 delivery is a buffer of its own; set DUP.
+    buf->writableData()[0] |= 0x08;
+    append(chain, std::move(buf));
+  }
+  drain(chain);
+  if (chain) {
+    channel_->write(std::move(chain));
+  }
+}
+
+bool Session::detach(Channel const* channel) {
+  std::lock_guard lock(mutex_);
+  if (channel_.get() != channel) return false;
+  channel_.reset();
+  aliases_.reset();
+  backlog_.store(kOffline, std::memory_order_relaxed);
+  offline_ = Clock::now();
+  return true;
+}
+
+void Session::clear() {
+  std::lock_guard lock(mutex_);
+  for (auto const& filter : filters_) {
+    trie_->unsubscribe(filter, this);
+  }
+  filters_.clear();
+  queue_.clear();
+  inflight_.clear();
+  incoming_.clear();
+  release(bytes_);
+  bytes_ = 0;
+  channel_.reset();
+  aliases_.reset();
+  backlog_.store(kOffline, std::memory_order_relaxed);
+}
+
+size_t Session::queued() const {
+  std::lock_guard lock(mutex_);
+  return queue_.size();
+}
+
+size_t Session::inflight() const {
+  std::lock_guard lock(mutex_);
+  return inflight_.size();
+}
+
+size_t Session::bytes() const {
+  std::lock_guard lock(mutex_);
+  return bytes_;
+}
+
+size_t Session::dropped() const {
+  std::lock_guard lock(mutex_);
+  return dropped_;
+}
+
+std::unique_ptr<folly::IOBuf> Session::encode(SharedPublish const& msg, uint8_t qos) {
+  if (qos == 0) return clone(msg, 0, 0);
+  uint16_t const packetId = nextPacketId();
+  inflight_[packetId] = Flight{msg.shared_from_this(), qos, sequence_++};
+  return clone(msg, qos, packetId);
+}
+
+std::unique_ptr<folly::IOBuf> Session::clone(
+    SharedPublish const& msg, uint8_t qos, uint16_t packetId
+) {
+  if (!aliases_) return msg.clone(qos, packetId, level_);
+  return msg.clone(qos, packetId, aliases_->assign(msg.topic()));
+}
+
+void Session::drain(std::unique_ptr<folly::IOBuf>& chain) {
+  size_t bytes = 0;
+  while (!queue_.empty() && !full()) {
+    auto entry = queue_.pop();
+    bytes += entry.msg->size();
+    if (entry.msg->expired()) continue;
+    append(chain, encode(*entry.msg, entry.qos));
+  }
+  if (queue_.empty()) {
+    queue_.clear();
+  }
+  bytes_ -= bytes;
+  release(bytes);
+}
+
+// Skips the ids of deliveries still in flight; full() leaves some free.
+uint16_t Session::nextPacketId() {
+  uint16_t id = packetId_++;
+  while (id == 0 || inflight_.count(id) != 0) {
+    id = packetId_++;
+  }
+  return id;
+}
+
+void Session::release(size_t size) {
+  if (size) {
+    budget_->bytes.fetch_sub(size, std::memory_order_relaxed);
+  }
+}
+
+SessionStore::SessionStore(std::shared_ptr<Trie> trie, SessionOptions const& options)
+    : trie_(std::move(trie)), budget_(std::make_shared<Session::Budget>()) {
+  budget_->options = options;
+}
+
+SessionStore::~SessionStore() {
+  // Subscriptions hold sessions alive from the trie, so drop them explicitly.
+  for (auto const& [_, session] : sessions_) {
+    session->clear();
+  }
+}
+
+std::pair<std::shared_ptr<Session>, bool> SessionStore::open(
+    std::string const& client, bool clean
+) {
+  return open(client, clean, clean ? std::chrono::seconds(0) : Session::kNever);
+}
+
+std::pair<std::shared_ptr<Session>, bool> SessionStore::open(
+    std::string const& client, bool clean, std::chrono::seconds expiry
+) {
+  if (opens_.fetch_add(1, std::memory_order_relaxed) % kSweep == kSweep - 1) {
+    expire();
+  }
+  if (auto it = sessions_.find(client); it != sessions_.cend()) {
+    auto const session = it->second;
+    if (!clean && !session->expired(Session::Clock::now())) {
+      session->setExpiry(expiry);
+      return {session, true};
+    }
+    session->clear();
+    sessions_.erase_if_equal(client, session);
+  }
+  auto session = std::make_shared<Session>(client, expiry, trie_, budget_);
+  if (expiry.count() == 0) {
+    return {std::move(session), false};
+  }
+  auto [it, inserted] = sessions_.insert(client, session);
+  return {it->second, !inserted};
+}
+
+void SessionStore::close(std::shared_ptr<Session> const& session, Channel const* channel) {
+  // A connection that was taken over leaves the session to its successor.
+  if (session->detach(channel) && session->clean()) {
+    session->clear();
+    sessions_.erase_if_equal(session->client(), session);
+  }
+}
+
+size_t SessionStore::expire() {
+  auto const now = Session::Clock::now();
+  size_t n = 0;
+  for (auto const& [client, session] : sessions_) {
+    if (session->expired(now)) {
+      session->clear();
+      n += sessions_.erase_if_equal(client, session);
+    }
+  }
+  return n;
+}
+
+size_t SessionStore::size() const { return sessions_.size(); }
+
+size_t SessionStore::bytes() const { return budget_->bytes.load(std::memory_order_relaxed); }
+}  // namespace warp::mqtt
@@ -0,0 +1,67 @@
+#include "warp/mqtt/topic.h"
+
+#include <folly/hash/Hash.h>
+
+#include <algorithm>
+#include <mutex>
+#include <shared_mutex>
+
+namespace warp::mqtt {
+TopicLevels splitTopic(std::string_view topic) {
+  TopicLevels levels;
+  for (;;) {
+    auto const pos = topic.find('/');
+    levels.push_back(topic.substr(0, pos));
+    if (pos == std::string_view::npos) break;
+    topic.remove_prefix(pos + 1);
+  }
+  return levels;
+}
+
+Topic::Topic(std::string name, bool interned)
+    : interned_(interned), name_(std::move(name)), levels_(splitTopic(name_)) {}
+
+bool Topic::routed() const {
+  auto const route = route_.load(std::memory_order_acquire);
+  return route && std::any_of(route->matches.begin(), route->matches.end(), [](auto const& m) {
+           return !m.first.expired();
+         });
+}
+
+TopicTable::TopicTable(size_t limit) : limit_(limit) {}
+
+std::shared_ptr<Topic const> TopicTable::intern(std::string_view name) {
+  auto const index = folly::hasher<std::string_view>{}(name) % kShards;
+  auto& shard = shards_[index];
+  {
+    std::shared_lock lock(shard.mutex);
+    if (auto it = shard.topics.find(name); it != shard.topics.end()) return it->second;
+  }
+  if (size_.load(std::memory_order_relaxed) >= limit_ &&
+      (misses_.fetch_add(1, std::memory_order_relaxed) % kSweep != 0 || evict() == 0)) {
+    return std::make_shared<Topic const>(std::string(name), false);
+  }
+
+  std::unique_lock lock(shard.mutex);
+  if (auto it = shard.topics.find(name); it != shard.topics.end()) return it->second;
+  auto topic = std::make_shared<Topic const>(std::string(name), true);
+  shard.topics.emplace(topic->name(), topic);
+  size_.fetch_add(1, std::memory_order_relaxed);
+  return topic;
+}
+
+size_t TopicTable::evict() {
+  size_t evicted = 0;
+  for (auto& shard : shards_) {
+    std::unique_lock lock(shard.mutex);
+    auto const before = shard.topics.size();
+    // The table holds the only reference to a topic no publish is using.
+    folly::erase_if(shard.topics, [](auto const& entry) {
+      return entry.second.use_count() == 1 && !entry.second->routed();
+    });
+    evicted += before - shard.topics.size();
+  }
+  size_.fetch_sub(evicted, std::memory_order_relaxed);
+  return evicted;
+}
+}  // namespace warp::mqtt
@@ -0,0 +1,308 @@
+#include "warp/mqtt/trie.h"
+
+#include <folly/hash/Hash.h>
+
+#include <algorithm>
+#include <atomic>
+#include <mutex>
+#include <shared_mutex>
+#include <span>
+
+namespace warp::mqtt {
+namespace {
+constexpr std::string_view kSharePrefix{"$share/"};
+}  // namespace
+
+// Members are an immutable snapshot replaced on every change, so picking one
+// on the publish path takes neither the trie's lock nor a member session's
+// mutex; load() reads an atomic. The snapshot itself is loaded through
+// std::atomic<std::shared_ptr>, which libstdc++ guards with a short spin lock.
+class Trie::Group final : public Subscriber {
+public:
+  using Members = std::vector<Match>;
+
+  explicit Group(Balance balance) : balance_(balance), members_(std::make_shared<Members>()) {}
+
+  void publish(SharedPublish const& msg, uint8_t qos) override {
+    auto const members = members_.load(std::memory_order_acquire);
+    if (members->empty()) return;
+    auto const& member = select(*members);
+    member.subscriber->publish(msg, std::min(member.qos, qos));
+  }
+
+  // The trie's lock serialises writers.
+  bool add(std::shared_ptr<Subscriber> subscriber, uint8_t qos) {
+    auto members = std::make_shared<Members>(*members_.load(std::memory_order_acquire));
+    auto it = std::find_if(members->begin(), members->end(), [&](auto const& m) {
+      return m.subscriber == subscriber;
+    });
+    bool const added = it == members->end();
+    if (added) {
+      members->push_back(Match{std::move(subscriber), qos});
+    } else {
+      it->qos = qos;
+    }
+    members_.store(std::move(members), std::memory_order_release);
+    return added;
+  }
+
+  bool remove(Subscriber const* subscriber) {
+    auto members = std::make_shared<Members>(*members_.load(std::memory_order_acquire));
+    auto it = std::find_if(members->begin(), members->end(), [&](auto const& m) {
+      return m.subscriber.get() == subscriber;
+    });
+    if (it == members->end()) return false;
+    members->erase(it);
+    members_.store(std::move(members), std::memory_order_release);
+    return true;
+  }
+
+  bool empty() const { return members_.load(std::memory_order_acquire)->empty(); }
+
+private:
+  Match const& select(Members const& members) {
+    size_t const n = members.size();
+    size_t const start = next_.fetch_add(1, std::memory_order_relaxed);
+    if (balance_ == Balance::RoundRobin) {
+      // Skip members that are offline, unless all of them are.
+      for (size_t i = 0; i < n; ++i) {
+        auto const& member = members[(start + i) % n];
+        if (member.subscriber->load() != kOffline) return member;
+      }
+      return members[start % n];
+    }
+    size_t best = start % n;
+    size_t least = members[best].subscriber->load();
+    for (size_t i = 1; i < n && least > 0; ++i) {
+      size_t const index = (start + i) % n;
+      size_t const load = members[index].subscriber->load();
+      if (load < least) {
+        best = index;
+        least = load;
+      }
+    }
+    return members[best];
+  }
+
+  Balance const balance_;
+  std::atomic<std::shared_ptr<Members const>> members_;
+  std::atomic<size_t> next_{0};
+};
+
+struct Trie::Node {
+  folly::F14FastMap<std::string, std::unique_ptr<Node>> children;
+  std::unique_ptr<Node> plus;
+  folly::F14FastMap<Subscriber const*, Match> exact;
+  folly::F14FastMap<Subscriber const*, Match> multi;
+
+  bool empty() const { return children.empty() && !plus && exact.empty() && multi.empty(); }
+
+  bool remove(std::span<std::string_view const> levels, Subscriber const* subscriber) {
+    if (levels.empty()) return exact.erase(subscriber) > 0;
+    auto const level = levels.front();
+    if (level == "#") return multi.erase(subscriber) > 0;
+    auto const rest = levels.subspan(1);
+    if (level == "+") {
+      if (!plus || !plus->remove(rest, subscriber)) return false;
+      if (plus->empty()) plus.reset();
+      return true;
+    }
+    auto it = children.find(level);
+    if (it == children.end() || !it->second->remove(rest, subscriber)) return false;
+    if (it->second->empty()) children.erase(it);
+    return true;
+  }
+
+  void collect(std::span<std::string_view const> levels, bool wild, std::vector<Match>& out)
+      const {
+    if (wild) {
+      for (auto const& [_, m] : multi) out.push_back(m);
+    }
+    if (levels.empty()) {
+      for (auto const& [_, m] : exact) out.push_back(m);
+      return;
+    }
+    auto const rest = levels.subspan(1);
+    if (auto it = children.find(levels.front()); it != children.end()) {
+      it->second->collect(rest, true, out);
+    }
+    if (plus && wild) {
+      plus->collect(rest, true, out);
+    }
+  }
+};
+
+Trie::Trie(Balance balance) : balance_(balance), root_(std::make_unique<Node>()) {}
+
+Trie::~Trie() = default;
+
+bool Trie::subscribe(
+    std::string_view filter, std::shared_ptr<Subscriber> subscriber, uint8_t qos
+) {
+  if (!subscriber) return false;
+  if (!filter.starts_with(kSharePrefix)) {
+    if (!isValidTopicFilter(filter)) return false;
+    std::unique_lock lock(mutex_);
+    if (insert(filter, Match{std::move(subscriber), qos})) ++size_;
+    return true;
+  }
+  auto const shared = splitSharedFilter(filter);
+  if (!shared) return false;
+
+  std::unique_lock lock(mutex_);
+  auto it = groups_.find(filter);
+  if (it == groups_.end()) {
+    it = groups_.emplace(std::string(filter), std::make_shared<Group>(balance_)).first;
+    insert(shared->second, Match{it->second, 2});
+  }
+  if (it->second->add(std::move(subscriber), qos)) ++size_;
+  return true;
+}
+
+bool Trie::unsubscribe(std::string_view filter, Subscriber const* subscriber) {
+  if (!filter.starts_with(kSharePrefix)) {
+    if (!isValidTopicFilter(filter)) return false;
+    std::unique_lock lock(mutex_);
+    if (!remove(filter, subscriber)) return false;
+    --size_;
+    return true;
+  }
+  auto const shared = splitSharedFilter(filter);
+  if (!shared) return false;
+
+  std::unique_lock lock(mutex_);
+  auto it = groups_.find(filter);
+  if (it == groups_.end() || !it->second->remove(subscriber)) return false;
+  --size_;
+  if (it->second->empty()) {
+    remove(shared->second, it->second.get());
+    groups_.erase(it);
+  }
+  return true;
+}
+
+bool Trie::insert(std::string_view filter, Match match) {
+  auto const levels = splitTopic(filter);
+  bump(levels);
+  auto* node = root_.get();
+  bool multi = false;
+  for (auto const level : levels) {
+    if (level == "#") {
+      multi = true;
+      break;
+    }
+    if (level == "+") {
+      if (!node->plus) node->plus = std::make_unique<Node>();
+      node = node->plus.get();
+      continue;
+    }
+    auto it = node->children.find(level);
+    if (it == node->children.end()) {
+      it = node->children.emplace(std::string(level), std::make_unique<Node>()).first;
+    }
+    node = it->second.get();
+  }
+
+  auto& subs = multi ? node->multi : node->exact;
+  auto const* key = match.subscriber.get();
+  return subs.insert_or_assign(key, std::move(match)).second;
+}
+
+bool Trie::remove(std::string_view filter, Subscriber const* subscriber) {
+  auto const levels = splitTopic(filter);
+  if (!root_->remove({levels.data(), levels.size()}, subscriber)) return false;
+  bump(levels);
+  return true;
+}
+
+void Trie::bump(TopicLevels const& levels) {
+  auto const first = levels.front();
+  if (first == "+" || first == "#") {
+    wildcard_.fetch_add(1, std::memory_order_release);
+  } else {
+    generations_[slot(first)].fetch_add(1, std::memory_order_release);
+  }
+}
+
+size_t Trie::slot(std::string_view level) {
+  return folly::hasher<std::string_view>{}(level) % kSlots;
+}
+
+void Trie::match(std::string_view topic, std::vector<Match>& out) const {
+  auto const levels = splitTopic(topic);
+
+  std::shared_lock lock(mutex_);
+  root_->collect({levels.data(), levels.size()}, !topic.starts_with('$'), out);
+}
+
+void Trie::match(Topic const& topic, std::vector<Match>& out) const {
+  auto const route = topic.route_.load(std::memory_order_acquire);
+  if (route && route->generation == generations_[route->slot].load(std::memory_order_acquire) &&
+      route->wildcard == wildcard_.load(std::memory_order_acquire)) {
+    for (auto const& [subscriber, qos] : route->matches) {
+      // It may have gone since the generations were read.
+      if (auto locked = subscriber.lock()) {
+        out.push_back(Match{std::move(locked), qos});
+      }
+    }
+    return;
+  }
+  auto const first = out.size();
+  auto fresh = std::make_shared<Topic::Route>();
+  auto const& levels = topic.levels();
+  fresh->slot = slot(levels.front());
+  {
+    std::shared_lock lock(mutex_);
+    fresh->generation = generations_[fresh->slot].load(std::memory_order_relaxed);
+    fresh->wildcard = wildcard_.load(std::memory_order_relaxed);
+    root_->collect({levels.data(), levels.size()}, !topic.name().starts_with('$'), out);
+  }
+  // A topic the table turned away is not published to again; caching its
+  // route would only cost an allocation.
+  if (!topic.interned()) return;
+  fresh->matches.reserve(out.size() - first);
+  for (auto it = out.begin() + first; it != out.end(); ++it) {
+    fresh->matches.emplace_back(it->subscriber, it->qos);
+  }
+  topic.route_.store(std::move(fresh), std::memory_order_release);
+}
+
+size_t Trie::size() const {
+  std::shared_lock lock(mutex_);
+  return size_;
+}
+
+bool isValidTopicName(std::string_view topic) {
+  if (topic.empty() || topic.size() > 0xFFFF) return false;
+  return topic.find_first_of(std::string_view("+#\0", 3)) == std::string_view::npos;
+}
+
+std::optional<std::pair<std::string_view, std::string_view>> splitSharedFilter(
+    std::string_view filter
+) {
+  if (!filter.starts_with(kSharePrefix)) return std::nullopt;
+  filter.remove_prefix(kSharePrefix.size());
+  auto const pos = filter.find('/');
+  if (pos == 0 || pos == std::string_view::npos) return std::nullopt;
+  auto const group = filter.substr(0, pos);
+  if (group.find_first_of("+#") != std::string_view::npos) return std::nullopt;
+  auto const rest = filter.substr(pos + 1);
+  if (!isValidTopicFilter(rest)) return std::nullopt;
+  return std::make_pair(group, rest);
+}
+
+bool isValidTopicFilter(std::string_view filter) {
+  if (filter.empty() || filter.size() > 0xFFFF) return false;
+  if (filter.find('\0') != std::string_view::npos) return false;
+  auto const levels = splitTopic(filter);
+  for (size_t i = 0; i < levels.size(); ++i) {
+    auto const level = levels[i];
+    if (level.find('#') != std::string_view::npos) {
+      if (level != "#" || i + 1 != levels.size()) return false;
+    } else if (level.find('+') != std::string_view::npos) {
+      if (level != "+") return false;
+    }
+  }
+  return true;
+}
+}  // namespace warp::mqtt
@@ -0,0 +1,201 @@
+#include "warp/websocket/deflate.h"
+
+#include <folly/io/IOBufQueue.h>
+#include <zlib.h>
+
+#include <algorithm>
+#include <charconv>
+
+namespace warp::websocket {
+namespace {
+constexpr std::string_view kName{"permessage-deflate"};
+constexpr size_t kChunk = 16 * 1024;
+// Every message is flushed with Z_SYNC_FLUSH, which ends it with an empty
+// stored block; the sender drops those bytes and the receiver puts them back.
+constexpr uint8_t kTail[4] = {0x00, 0x00, 0xFF, 0xFF};
+
+std::string_view trim(std::string_view s) {
+  auto const first = s.find_first_not_of(" \t");
+  if (first == std::string_view::npos) return {};
+  auto const last = s.find_last_not_of(" \t");
+  return s.substr(first, last - first + 1);
+}
+
+// Splits off the text up to the next separator, consuming it.
+std::string_view next(std::string_view& s, char separator) {
+  auto const pos = s.find(separator);
+  auto const out = s.substr(0, pos);
+  s = pos == std::string_view::npos ? std::string_view{} : s.substr(pos + 1);
+  return trim(out);
+}
+
+std::optional<uint8_t> windowBits(std::string_view value) {
+  if (value.size() >= 2 && value.front() == '"' && value.back() == '"') {
+    value = value.substr(1, value.size() - 2);
+  }
+  unsigned bits = 0;
+  auto const [end, ec] = std::from_chars(value.data(), value.data() + value.size(), bits);
+  if (ec != std::errc{} || end != value.data() + value.size() || bits < 8 || bits > 15) {
+    return std::nullopt;
+  }
+  return static_cast<uint8_t>(bits);
+}
+
+// One permessage-deflate offer, without its name. Fails on anything unknown
+// or repeated, as the RFC asks.
+std::optional<DeflateOptions> agree(DeflateOptions agreed, std::string_view params) {
+  // zlib cannot write a raw stream with a 256 byte window.
+  agreed.serverWindowBits = std::clamp<uint8_t>(agreed.serverWindowBits, 9, 15);
+  agreed.clientWindowBits = std::clamp<uint8_t>(agreed.clientWindowBits, 8, 15);
+  bool clientBits = false;
+  unsigned seen = 0;
+  while (!params.empty()) {
+    auto value = next(params, ';');
+    auto const key = next(value, '=');
+    unsigned bit = 0;
+    if (key == "server_no_context_takeover" && value.empty()) {
+      bit = 1;
+      agreed.serverNoContextTakeover = true;
+    } else if (key == "client_no_context_takeover" && value.empty()) {
+      bit = 2;
+      agreed.clientNoContextTakeover = true;
+    } else if (key == "server_max_window_bits") {
+      bit = 4;
+      auto const bits = windowBits(value);
+      if (!bits || *bits < 9) return std::nullopt;
+      agreed.serverWindowBits = std::min(agreed.serverWindowBits, *bits);
+    } else if (key == "client_max_window_bits") {
+      bit = 8;
+      clientBits = true;
+      if (!value.empty()) {
+        auto const bits = windowBits(value);
+        if (!bits) return std::nullopt;
+        agreed.clientWindowBits = std::min(agreed.clientWindowBits, *bits);
+      }
+    } else {
+      return std::nullopt;
+    }
+    if (seen & bit) return std::nullopt;
+    seen |= bit;
+  }
+  // A client that did not offer to limit its window may use all of it.
+  if (!clientBits) agreed.clientWindowBits = 15;
+  return agreed;
+}
+}  // namespace
+
+std::optional<DeflateOptions> negotiate(DeflateOptions const& options, std::string_view offers) {
+  if (!options.enabled) return std::nullopt;
+  while (!offers.empty()) {
+    auto params = next(offers, ',');
+    if (next(params, ';') != kName) continue;
+    if (auto agreed = agree(options, params)) return agreed;
+  }
+  return std::nullopt;
+}
+
+std::string accept(DeflateOptions const& agreed) {
+  std::string out{kName};
+  if (agreed.serverNoContextTakeover) out += "; server_no_context_takeover";
+  if (agreed.clientNoContextTakeover) out += "; client_no_context_takeover";
+  if (agreed.serverWindowBits < 15) {
+    out += "; server_max_window_bits=" + std::to_string(agreed.serverWindowBits);
+  }
+  if (agreed.clientWindowBits < 15) {
+    out += "; client_max_window_bits=" + std::to_string(agreed.clientWindowBits);
+  }
+  return out;
+}
+
+Deflate::Deflate(DeflateOptions const& agreed) : options_(agreed) {}
+
+Deflate::~Deflate() {
+  if (deflate_) deflateEnd(deflate_.get());
+  if (inflate_) inflateEnd(inflate_.get());
+}
+
+std::unique_ptr<folly::IOBuf> Deflate::compress(folly::IOBuf const& data) {
+  if (!deflate_) {
+    auto z = std::make_unique<z_stream_s>();
+    int const bits = -static_cast<int>(options_.serverWindowBits);
+    if (deflateInit2(z.get(), options_.level, Z_DEFLATED, bits, 8, Z_DEFAULT_STRATEGY) != Z_OK) {
+      return nullptr;
+    }
+    deflate_ = std::move(z);
+  }
+  auto* z = deflate_.get();
+  folly::IOBufQueue out(folly::IOBufQueue::cacheChainLength());
+  auto run = [&](uint8_t const* in, size_t size, int flush) {
+    z->next_in = const_cast<Bytef*>(in);
+    z->avail_in = static_cast<uInt>(size);
+    do {
+      auto const space = out.preallocate(std::min(kChunk, size + 64), kChunk);
+      z->next_out = static_cast<Bytef*>(space.first);
+      z->avail_out = static_cast<uInt>(space.second);
+      int const rc = ::deflate(z, flush);
+      out.postallocate(space.second - z->avail_out);
+      if (rc == Z_STREAM_ERROR) return false;
+    } while (z->avail_in > 0 || z->avail_out == 0);
+    return true;
+  };
+  bool ok = true;
+  for (auto const range : data) {
+    ok = ok && run(range.data(), range.size(), Z_NO_FLUSH);
+  }
+  ok = ok && run(nullptr, 0, Z_SYNC_FLUSH) && out.chainLength() >= sizeof(kTail);
+  // Anything the peer has not seen must not be referenced later on.
+  if (!ok || options_.serverNoContextTakeover) deflateReset(z);
+  if (!ok) return nullptr;
+  out.trimEnd(sizeof(kTail));
+  auto buf = out.move();
+  return buf ? std::move(buf) : folly::IOBuf::create(0);
+}
+
+folly::Expected<std::unique_ptr<folly::IOBuf>, Deflate::Error> Deflate::decompress(
+    folly::IOBuf const& data, bool last, size_t limit
+) {
+  if (!inflate_) {
+    auto z = std::make_unique<z_stream_s>();
+    if (inflateInit2(z.get(), -static_cast<int>(options_.clientWindowBits)) != Z_OK) {
+      return folly::makeUnexpected(Error::Corrupt);
+    }
+    inflate_ = std::move(z);
+  }
+  auto* z = inflate_.get();
+  folly::IOBufQueue out(folly::IOBufQueue::cacheChainLength());
+  auto run = [&](uint8_t const* in, size_t size) -> std::optional<Error> {
+    z->next_in = const_cast<Bytef*>(in);
+    z->avail_in = static_cast<uInt>(size);
+    do {
+      auto const space = out.preallocate(kChunk, kChunk);
+      z->next_out = static_cast<Bytef*>(space.first);
+      z->avail_out = static_cast<uInt>(space.second);
+      int const rc = ::inflate(z, Z_SYNC_FLUSH);
+      size_t const produced = space.second - z->avail_out;
+      out.postallocate(produced);
+      inflated_ += produced;
+      if (inflated_ > limit) return Error::TooLarge;
+      if (rc == Z_STREAM_END) {
+        // The peer closed the stream with a final block; the next message
+        // starts a new one.
+        inflateReset(z);
+        return std::nullopt;
+      }
+      if (rc != Z_OK && rc != Z_BUF_ERROR) return Error::Corrupt;
+    } while (z->avail_in > 0 || z->avail_out == 0);
+    return std::nullopt;
+  };
+  std::optional<Error> error;
+  for (auto const range : data) {
+    if (!error) error = run(range.data(), range.size());
+  }
+  if (!error && last) error = run(kTail, sizeof(kTail));
+  if (error || last) {
+    inflated_ = 0;
+    if (error || options_.clientNoContextTakeover) inflateReset(z);
+  }
+  if (error) return folly::makeUnexpected(*error);
+  auto buf = out.move();
+  return buf ? std::move(buf) : folly::IOBuf::create(0);
+}
+}  // namespace warp::websocket
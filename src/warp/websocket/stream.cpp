@@ -0,0 +1,261 @@
+#include "warp/websocket/stream.h"
+
+#include <folly/CpuId.h>
+#include <folly/io/Cursor.h>
+
+#include <algorithm>
+#include <cstring>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
+
+namespace warp::websocket {
+namespace {
+// The key holds the mask bytes in memory order, rotated to the first byte, so
+// XOR-ing it with a word loaded from memory lines every byte up with its own.
+using Kernel = void (*)(uint8_t*, uint8_t const*, size_t, uint32_t);
+
+void unmaskBytes(uint8_t* dst, uint8_t const* src, size_t n, uint32_t key) {
+  uint8_t mask[4];
+  std::memcpy(mask, &key, 4);
+  for (size_t i = 0; i < n; ++i) {
+    dst[i] = src[i] ^ mask[i & 3];
+  }
+}
+
+void unmaskWords(uint8_t* dst, uint8_t const* src, size_t n, uint32_t key) {
+  uint64_t const wide = (static_cast<uint64_t>(key) << 32) | key;
+  size_t i = 0;
+  for (; i + 8 <= n; i += 8) {
+    uint64_t word;
+    std::memcpy(&word, src + i, 8);
+    word ^= wide;
+    std::memcpy(dst + i, &word, 8);
+  }
+  unmaskBytes(dst + i, src + i, n - i, key);
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+__attribute__((target("sse2"))) void unmaskSse2(
+    uint8_t* dst, uint8_t const* src, size_t n, uint32_t key
+) {
+  __m128i const wide = _mm_set1_epi32(static_cast<int>(key));
+  size_t i = 0;
+  for (; i + 16 <= n; i += 16) {
+    auto const v = _mm_loadu_si128(reinterpret_cast<__m128i const*>(src + i));
+    _mm_storeu_si128(reinterpret_cast<__m128i*>(dst + i), _mm_xor_si128(v, wide));
+  }
+  unmaskWords(dst + i, src + i, n - i, key);
+}
+
+__attribute__((target("avx2"))) void unmaskAvx2(
+    uint8_t* dst, uint8_t const* src, size_t n, uint32_t key
+) {
+  __m256i const wide = _mm256_set1_epi32(static_cast<int>(key));
+  size_t i = 0;
+  for (; i + 32 <= n; i += 32) {
+    auto const v = _mm256_loadu_si256(reinterpret_cast<__m256i const*>(src + i));
+    _mm256_storeu_si256(reinterpret_cast<__m256i*>(dst + i), _mm256_xor_si256(v, wide));
+  }
+  unmaskSse2(dst + i, src + i, n - i, key);
+}
+#endif
+
+Kernel select() {
+#if defined(__x86_64__) || defined(__i386__)
+  folly::CpuId const cpu;
+  if (cpu.avx2()) return unmaskAvx2;
+  if (cpu.sse2()) return unmaskSse2;
+#endif
+  return unmaskWords;
+}
+
+bool shared(folly::IOBuf const& chain, size_t size) {
+  auto const* buf = &chain;
+  for (size_t seen = 0; seen < size; seen += buf->length(), buf = buf->next()) {
+    if (buf->isSharedOne()) return true;
+  }
+  return false;
+}
+
+// Unmasks the payload at the front of the queue and splits it off. Its bytes
+// are only written where they are if no one else holds the buffers.
+std::unique_ptr<folly::IOBuf> splitUnmasked(
+    folly::IOBufQueue& queue, size_t size, uint8_t const mask[4]
+) {
+  auto chain = queue.move();
+  bool const copy = shared(*chain, size);
+  if (!copy) {
+    auto* buf = chain.get();
+    for (size_t done = 0; done < size; buf = buf->next()) {
+      size_t const n = std::min(buf->length(), size - done);
+      unmask(buf->writableData(), buf->data(), n, mask, done);
+      done += n;
+    }
+  }
+  queue.append(std::move(chain));
+  auto payload = queue.split(size);
+  if (!copy) return payload;
+  auto out = folly::IOBuf::create(size);
+  size_t done = 0;
+  for (auto const range : *payload) {
+    unmask(out->writableData() + done, range.data(), range.size(), mask, done);
+    done += range.size();
+  }
+  out->append(size);
+  return out;
+}
+}  // namespace
+
+void unmask(uint8_t* dst, uint8_t const* src, size_t size, uint8_t const mask[4], size_t offset) {
+  static Kernel const kernel = select();
+  uint8_t rotated[4];
+  for (size_t i = 0; i < 4; ++i) {
+    rotated[i] = mask[(offset + i) & 3];
+  }
+  uint32_t key;
+  std::memcpy(&key, rotated, 4);
+  kernel(dst, src, size, key);
+}
+
+folly::Expected<std::vector<Frame>, Stream::Error> Stream::parse(
+    std::unique_ptr<folly::IOBuf> chain
+) {
+  if (!failed_) {
+    queue_.append(std::move(chain));
+    auto frames = next();
+    if (frames) return frames;
+    failed_ = frames.error();
+    queue_.reset();
+  }
+  return folly::makeUnexpected(*failed_);
+}
+
+folly::Expected<std::vector<Frame>, Stream::Error> Stream::next() {
+  std::vector<Frame> out;
+  while (queue_.chainLength() >= 2) {
+    folly::io::Cursor cur(queue_.front());
+    uint8_t const b0 = cur.read<uint8_t>();
+    uint8_t const b1 = cur.read<uint8_t>();
+    auto const opcode = static_cast<OpCode>(b0 & 0x0F);
+    bool const fin = (b0 & 0x80) != 0;
+    bool const compressed = (b0 & 0x40) != 0;
+    bool const control = (b0 & 0x08) != 0;
+    // RSV1 marks the first frame of a compressed message; the other bits
+    // belong to extensions that were never agreed.
+    if ((b0 & 0x30) != 0 ||
+        (compressed && (!deflate_ || control || opcode == OpCode::Continuation))) {
+      return folly::makeUnexpected(Error::Protocol);
+    }
+    switch (opcode) {
+      case OpCode::Continuation:
+      case OpCode::Text:
+      case OpCode::Binary:
+      case OpCode::Close:
+      case OpCode::Ping:
+      case OpCode::Pong:
+        break;
+      default:
+        return folly::makeUnexpected(Error::Protocol);
+    }
+    // A continuation needs a message to continue, and a new message has to
+    // wait for the one in progress to finish; control frames may come between.
+    if (!control && (opcode == OpCode::Continuation) != message_) {
+      return folly::makeUnexpected(Error::Protocol);
+    }
+    bool const masked = (b1 & 0x80) != 0;
+    if (masked != (role_ == Role::Server)) {
+      return folly::makeUnexpected(Error::Protocol);
+    }
+    uint64_t plen = (b1 & 0x7F);
+    // Control frames are never fragmented and always fit the first length byte.
+    if (control && (!fin || plen > kMaxControl)) {
+      return folly::makeUnexpected(Error::Protocol);
+    }
+    size_t off = 2;
+
+    if (plen == 126) {
+      if (!cur.canAdvance(2)) break;
+      plen = cur.readBE<uint16_t>();
+      off += 2;
+    } else if (plen == 127) {
+      if (!cur.canAdvance(8)) break;
+      plen = cur.readBE<uint64_t>();
+      off += 8;
+    }
+    if (plen > limit_) {
+      return folly::makeUnexpected(Error::TooLarge);
+    }
+
+    uint8_t mask[4] = {0, 0, 0, 0};
+    if (masked) {
+      if (!cur.canAdvance(4)) break;
+      cur.pull(mask, 4);
+      off += 4;
+    }
+
+    if (queue_.chainLength() < off + plen) break;
+
+    queue_.trimStart(off);
+    std::unique_ptr<folly::IOBuf> payload;
+    if (plen > 0) {
+      payload = masked ? splitUnmasked(queue_, plen, mask) : queue_.split(plen);
+    }
+    if (!control) {
+      message_ = !fin;
+    }
+    if (!control && opcode != OpCode::Continuation) {
+      inflating_ = compressed;
+    }
+    if (!control && inflating_) {
+      auto inflated = deflate_->decompress(payload ? *payload : folly::IOBuf{}, fin, limit_);
+      if (!inflated) {
+        return folly::makeUnexpected(
+            inflated.error() == Deflate::Error::TooLarge ? Error::TooLarge : Error::BadData
+        );
+      }
+      payload = std::move(*inflated);
+      inflating_ = !fin;
+    }
+    out.push_back(Frame{opcode, fin, std::move(payload)});
+  }
+  return out;
+}
+
+std::unique_ptr<folly::IOBuf> Stream::frame(
+    std::unique_ptr<folly::IOBuf> data, uint8_t opcode, bool fin
+) {
+  size_t len = data ? data->computeChainDataLength() : 0;
+  bool compressed = false;
+  if (deflate_ && fin && len > 0 && len >= deflate_->options().threshold &&
+      (opcode == static_cast<uint8_t>(OpCode::Text) ||
+       opcode == static_cast<uint8_t>(OpCode::Binary))) {
+    if (auto packed = deflate_->compress(*data)) {
+      data = std::move(packed);
+      len = data->computeChainDataLength();
+      compressed = true;
+    }
+  }
+  uint8_t hdr[14];
+  size_t off = 0;
+  hdr[off++] = (fin ? 0x80 : 0x00) | (compressed ? 0x40 : 0x00) | (opcode & 0x0F);
+  if (len < 126) {
+    hdr[off++] = static_cast<uint8_t>(len);
+  } else if (len <= 0xFFFF) {
+    hdr[off++] = 126;
+    hdr[off++] = static_cast<uint8_t>((len >> 8) & 0xFF);
+    hdr[off++] = static_cast<uint8_t>(len & 0xFF);
+  } else {
+    hdr[off++] = 127;
+    for (int i = 7; i >= 0; --i) {
+      hdr[off++] = static_cast<uint8_t>((len >> (8 * i)) & 0xFF);
+    }
+  }
+  auto head = folly::IOBuf::copyBuffer(hdr, off);
+  if (data) {
+    head->appendChain(std::move(data));
+  }
+  return head;
+}
+}  // namespace warp::websocket
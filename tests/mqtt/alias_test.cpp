@@ -0,0 +1,84 @@
+#include "warp/mqtt/alias.h"
+
+#include <gtest/gtest.h>
+
+#include "warp/mqtt/codec.h"
+
+namespace {
+warp::mqtt::Publish publish(std::string const& topic, uint16_t alias) {
+  warp::mqtt::Properties properties;
+  if (alias) {
+    properties.add(warp::mqtt::Properties::Id::TopicAlias, alias);
+  }
+  return warp::mqtt::Publish::Builder{}
+      .withLevel(warp::mqtt::Level::V5)
+      .withTopic(topic)
+      .withProperties(properties)
+      .build();
+}
+}  // namespace
+
+class AliasTest : public ::testing::Test {
+protected:
+  // empty
+};
+
+TEST_F(AliasTest, InboundTest) {
+  warp::mqtt::InboundAliases aliases(4);
+  auto msg = publish("", 1);
+  EXPECT_FALSE(aliases.resolve(msg));
+  msg = publish("test/foo", 1);
+  EXPECT_TRUE(aliases.resolve(msg));
+  msg = publish("", 1);
+  ASSERT_TRUE(aliases.resolve(msg));
+  EXPECT_EQ(msg.head.topic, "test/foo");
+  msg = publish("test/bar", 5);
+  EXPECT_FALSE(aliases.resolve(msg));
+  msg = publish("test/bar", 0);
+  EXPECT_TRUE(aliases.resolve(msg));
+}
+
+TEST_F(AliasTest, OutboundTest) {
+  warp::mqtt::OutboundAliases aliases(2);
+  auto a = aliases.assign("test/a");
+  EXPECT_EQ(a.id, 1);
+  EXPECT_FALSE(a.known);
+  EXPECT_TRUE(aliases.assign("test/a").known);
+  EXPECT_EQ(aliases.assign("test/b").id, 2);
+  aliases.assign("test/a");
+  // test/b is the least recently used, so its alias is remapped.
+  auto c = aliases.assign("test/c");
+  EXPECT_EQ(c.id, 2);
+  EXPECT_FALSE(c.known);
+  EXPECT_EQ(aliases.size(), 2u);
+  EXPECT_FALSE(aliases.assign("test/b").known);
+  EXPECT_EQ(warp::mqtt::OutboundAliases(0).assign("test/a").id, 0);
+}
+
+TEST_F(AliasTest, EncodeTest) {
+  auto const msg = warp::mqtt::Publish::Builder{}
+                       .withTopic("org/site/line/machine/sensor/metric")
+                       .withPayload("12345678")
+                       .build();
+  warp::mqtt::SharedPublish const shared(msg);
+  auto const first = shared.clone(0, 0, warp::mqtt::TopicAlias{3, false});
+  auto const next = shared.clone(0, 0, warp::mqtt::TopicAlias{3, true});
+  EXPECT_EQ(
+      first->computeChainDataLength() - next->computeChainDataLength(), msg.head.topic.size()
+  );
+
+  folly::IOBufQueue q(folly::IOBufQueue::cacheChainLength());
+  q.append(next->clone());
+  auto decoded = warp::mqtt::Codec::decode(q, warp::mqtt::Level::V5);
+  ASSERT_TRUE(decoded.has_value());
+  auto& out = std::get<warp::mqtt::Publish>(*decoded);
+  EXPECT_TRUE(out.head.topic.empty());
+  EXPECT_EQ(out.head.properties.topicAlias(), 3u);
+  EXPECT_EQ(out.data.data.to<std::string>(), "12345678");
+
+  warp::mqtt::InboundAliases aliases(8);
+  auto set = publish(msg.head.topic, 3);
+  ASSERT_TRUE(aliases.resolve(set));
+  ASSERT_TRUE(aliases.resolve(out));
+  EXPECT_EQ(out.head.topic, msg.head.topic);
+}
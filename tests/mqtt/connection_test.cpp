@@ -0,0 +1,269 @@
+#include "warp/mqtt/connection.h"
+
+#include <folly/executors/InlineExecutor.h>
+#include <gtest/gtest.h>
+#include <wangle/channel/Pipeline.h>
+
+#include <string>
+#include <vector>
+
+#include "warp/mqtt/codec.h"
+
+namespace {
+class TestSocket final : public warp::mqtt::WebSocketTransport::Socket {
+public:
+  // Each write stays in flight until drain().
+  folly::Future<folly::Unit> write(std::unique_ptr<folly::IOBuf> buf) override {
+    writes.push_back(std::move(buf));
+    promises.emplace_back();
+    return promises.back().getFuture();
+  }
+
+  void close() override { closed = true; }
+
+  void setReading(bool on) override {
+    reading = on;
+    pauses += on ? 0 : 1;
+  }
+
+  void drain() {
+    auto promises = std::move(this->promises);
+    for (auto& promise : promises) {
+      promise.setValue();
+    }
+  }
+
+  // Topics of the publishes in the n-th write.
+  std::vector<std::string> topics(size_t n) const {
+    folly::IOBufQueue q{folly::IOBufQueue::cacheChainLength()};
+    q.append(writes[n]->clone());
+    std::vector<std::string> topics;
+    while (auto msg = warp::mqtt::Codec::decode(q)) {
+      if (auto const* publish = std::get_if<warp::mqtt::Publish>(&*msg)) {
+        topics.push_back(publish->head.topic);
+      }
+    }
+    return topics;
+  }
+
+  std::vector<std::unique_ptr<folly::IOBuf>> writes;
+  std::vector<folly::Promise<folly::Unit>> promises;
+  bool closed{false};
+  bool reading{true};
+  size_t pauses{0};
+};
+
+class Probe final : public wangle::Handler<
+                        folly::IOBufQueue&, warp::mqtt::Message, warp::mqtt::Message,
+                        std::unique_ptr<folly::IOBuf>> {
+public:
+  void read(Context*, folly::IOBufQueue&) override {}
+};
+
+std::unique_ptr<folly::IOBuf> publish(std::string const& topic, uint8_t qos = 0) {
+  return warp::mqtt::Codec::encode(warp::mqtt::Publish::Builder{}
+                                       .withTopic(topic)
+                                       .withQos(qos)
+                                       .withPacketId(qos ? 1 : 0)
+                                       .withPayload(std::string(100, 'x'))
+                                       .build());
+}
+}  // namespace
+
+class ConnectionTest : public ::testing::Test {
+protected:
+  using Pipeline = wangle::Pipeline<folly::IOBufQueue&, warp::mqtt::Message>;
+
+  struct Peer {
+    TestSocket socket;
+    Pipeline::Ptr pipeline;
+    std::shared_ptr<warp::mqtt::Connection> connection;
+  };
+
+  Peer& connect(warp::mqtt::ConnectionOptions const& options = {}) {
+    auto& peer = *peers_.emplace_back(std::make_unique<Peer>());
+    peer.pipeline = Pipeline::create();
+    peer.pipeline->addBack(warp::mqtt::WebSocketTransport(&evb_, &peer.socket));
+    peer.pipeline->addBack(Probe());
+    peer.pipeline->finalize();
+    peer.connection = std::make_shared<warp::mqtt::Connection>(
+        sessions_, registry_, &evb_, peer.pipeline->getHandler<Probe>()->getContext(),
+        folly::SerialExecutor::create(folly::getKeepAliveToken(&folly::InlineExecutor::instance())),
+        options
+    );
+    return peer;
+  }
+
+  void TearDown() override {
+    for (auto& peer : peers_) {
+      peer->connection->close();
+    }
+    evb_.loop();
+  }
+
+  size_t const size_ = publish("t/0")->computeChainDataLength();
+  folly::EventBase evb_;
+  std::shared_ptr<warp::mqtt::SessionStore> sessions_ =
+      std::make_shared<warp::mqtt::SessionStore>(std::make_shared<warp::mqtt::Trie>());
+  std::shared_ptr<warp::mqtt::Registry> registry_ = std::make_shared<warp::mqtt::Registry>();
+  std::vector<std::unique_ptr<Peer>> peers_;
+};
+
+TEST_F(ConnectionTest, CountersTest) {
+  auto& peer = connect();
+  auto& c = *peer.connection;
+  c.write(publish("t/0"));
+  c.write(publish("t/1"));
+  EXPECT_EQ(c.bytes(), 2 * size_);
+  EXPECT_EQ(c.messages(), 2u);
+  evb_.loop();
+  ASSERT_EQ(peer.socket.writes.size(), 1u);
+  EXPECT_EQ(c.bytes(), 2 * size_);
+
+  // Acks sent while a write is in flight are packed into one buffer.
+  c.send(warp::mqtt::PubAck::Builder{}.withPacketId(1).build());
+  c.send(warp::mqtt::PubAck::Builder{}.withPacketId(2).build());
+  EXPECT_EQ(c.bytes(), 2 * size_ + 8);
+  EXPECT_EQ(c.messages(), 4u);
+
+  peer.socket.drain();
+  EXPECT_EQ(c.bytes(), 8u);
+  EXPECT_EQ(c.messages(), 2u);
+  ASSERT_EQ(peer.socket.writes.size(), 2u);
+  EXPECT_EQ(peer.socket.writes[1]->computeChainDataLength(), 8u);
+  EXPECT_FALSE(peer.socket.writes[1]->isChained());
+
+  peer.socket.drain();
+  EXPECT_EQ(c.bytes(), 0u);
+  EXPECT_EQ(c.messages(), 0u);
+  EXPECT_EQ(c.dropped(), 0u);
+}
+
+TEST_F(ConnectionTest, DropOldestTest) {
+  auto& peer = connect({.bytes = 4 * size_});
+  auto& c = *peer.connection;
+  c.write(publish("t/0"));
+  evb_.loop();
+  c.write(publish("t/1"));
+  c.write(publish("t/2", 1));
+  c.write(publish("t/3"));
+  c.write(publish("t/4"));
+  // The write in flight stays; the oldest queued QoS 0 publishes go, and
+  // the QoS 1 one between them is kept.
+  EXPECT_EQ(c.dropped(), 2u);
+  EXPECT_EQ(c.bytes(), 3 * size_ + 2);
+  EXPECT_EQ(c.messages(), 3u);
+
+  peer.socket.drain();
+  ASSERT_EQ(peer.socket.writes.size(), 2u);
+  EXPECT_EQ(peer.socket.topics(1), (std::vector<std::string>{"t/2", "t/4"}));
+  EXPECT_FALSE(peer.socket.closed);
+
+  // Nothing left to drop but QoS 1.
+  c.write(publish("t/5", 1));
+  c.write(publish("t/6", 1));
+  EXPECT_FALSE(peer.socket.closed);
+  evb_.loop();
+  EXPECT_TRUE(peer.socket.closed);
+}
+
+TEST_F(ConnectionTest, DisconnectTest) {
+  auto& peer = connect({.bytes = 2 * size_, .overflow = warp::mqtt::Overflow::Disconnect});
+  auto& c = *peer.connection;
+  c.write(publish("t/0"));
+  evb_.loop();
+  c.write(publish("t/1"));
+  EXPECT_EQ(c.dropped(), 0u);
+  c.write(publish("t/2"));
+  EXPECT_EQ(c.dropped(), 1u);
+  EXPECT_EQ(c.bytes(), 2 * size_);
+  // Posted, so that a session delivering under its lock never closes inline.
+  EXPECT_FALSE(peer.socket.closed);
+  evb_.loop();
+  EXPECT_TRUE(peer.socket.closed);
+}
+
+TEST_F(ConnectionTest, SendOverflowTest) {
+  // Responses are held to the same limits as deliveries.
+  auto& peer = connect({.messages = 2, .overflow = warp::mqtt::Overflow::Disconnect});
+  auto& c = *peer.connection;
+  c.send(warp::mqtt::PubAck::Builder{}.withPacketId(1).build());
+  c.send(warp::mqtt::PubAck::Builder{}.withPacketId(2).build());
+  EXPECT_EQ(c.dropped(), 0u);
+  c.send(warp::mqtt::PubAck::Builder{}.withPacketId(3).build());
+  EXPECT_EQ(c.dropped(), 1u);
+  EXPECT_EQ(c.messages(), 2u);
+  EXPECT_EQ(c.bytes(), 8u);
+  EXPECT_FALSE(peer.socket.closed);
+  evb_.loop();
+  EXPECT_TRUE(peer.socket.closed);
+}
+
+TEST_F(ConnectionTest, PauseCountTest) {
+  // A throttled client and a slow subscriber may both pause the same reads;
+  // they resume once both have let go.
+  auto& peer = connect();
+  auto& c = *peer.connection;
+  c.pause();
+  c.pause();
+  evb_.loop();
+  EXPECT_FALSE(peer.socket.reading);
+  c.resume();
+  evb_.loop();
+  EXPECT_FALSE(peer.socket.reading);
+  c.resume();
+  evb_.loop();
+  EXPECT_TRUE(peer.socket.reading);
+  EXPECT_EQ(peer.socket.pauses, 1u);
+}
+
+TEST_F(ConnectionTest, PauseTest) {
+  auto& publisher = connect();
+  auto& peer = connect({.bytes = 2 * size_, .overflow = warp::mqtt::Overflow::Pause});
+  auto& c = *peer.connection;
+  {
+    folly::RequestContextScopeGuard guard;
+    warp::mqtt::setConnection(*folly::RequestContext::get(), publisher.connection);
+    c.write(publish("t/0"));
+    evb_.loop();
+    c.write(publish("t/1"));
+    c.write(publish("t/2"));
+    c.write(publish("t/3"));
+  }
+  EXPECT_EQ(c.dropped(), 0u);
+  evb_.loop();
+  EXPECT_FALSE(publisher.socket.reading);
+  EXPECT_EQ(publisher.socket.pauses, 1u);
+
+  // Still over half after the first write completes.
+  peer.socket.drain();
+  evb_.loop();
+  EXPECT_EQ(c.bytes(), 3 * size_);
+  EXPECT_FALSE(publisher.socket.reading);
+
+  peer.socket.drain();
+  evb_.loop();
+  EXPECT_EQ(c.bytes(), 0u);
+  EXPECT_TRUE(publisher.socket.reading);
+  EXPECT_EQ(peer.socket.writes.size(), 2u);
+}
+
+TEST_F(ConnectionTest, PauseLimitTest) {
+  // A publisher that keeps going while paused fills the queue to twice the
+  // limits at most; past that the subscriber goes.
+  auto& publisher = connect();
+  auto& peer = connect({.bytes = 2 * size_, .overflow = warp::mqtt::Overflow::Pause});
+  auto& c = *peer.connection;
+  folly::RequestContextScopeGuard guard;
+  warp::mqtt::setConnection(*folly::RequestContext::get(), publisher.connection);
+  for (int i = 0; i < 4; ++i) {
+    c.write(publish("t/" + std::to_string(i)));
+  }
+  EXPECT_EQ(c.dropped(), 0u);
+  EXPECT_EQ(c.bytes(), 4 * size_);
+  c.write(publish("t/4"));
+  EXPECT_EQ(c.dropped(), 1u);
+  EXPECT_EQ(c.bytes(), 4 * size_);
+  evb_.loop();
+  EXPECT_TRUE(peer.socket.closed);
+}
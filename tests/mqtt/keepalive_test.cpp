@@ -0,0 +1,30 @@
+#include "warp/mqtt/keepalive.h"
+
+#include <gtest/gtest.h>
+
+class KeepAliveTest : public ::testing::Test {
+protected:
+  // empty
+};
+
+TEST_F(KeepAliveTest, ExpireTest) {
+  folly::EventBase evb;
+  size_t expired = 0;
+  warp::mqtt::KeepAlive keepAlive(evb, [&]() { ++expired; });
+  keepAlive.schedule(std::chrono::milliseconds(100));
+  EXPECT_TRUE(keepAlive.scheduled());
+  evb.loop();
+  EXPECT_EQ(expired, 1u);
+  EXPECT_FALSE(keepAlive.scheduled());
+
+  keepAlive.schedule(std::chrono::milliseconds(100));
+  keepAlive.cancel();
+  evb.loop();
+  EXPECT_EQ(expired, 1u);
+}
+
+TEST_F(KeepAliveTest, TimerTest) {
+  folly::EventBase evb;
+  EXPECT_EQ(&warp::mqtt::KeepAlive::timer(evb), &warp::mqtt::KeepAlive::timer(evb));
+  EXPECT_EQ(warp::mqtt::KeepAlive::timer(evb).getTickInterval(), warp::mqtt::KeepAlive::kTick);
+}
@@ -0,0 +1,73 @@
+#include "warp/mqtt/limit.h"
+
+#include <gtest/gtest.h>
+
+using std::chrono::milliseconds;
+
+namespace {
+class TestHolder final : public warp::mqtt::Quota::Holder {
+public:
+  void reclaim() override { ++reclaimed; }
+
+  size_t reclaimed{0};
+};
+}  // namespace
+
+class LimitTest : public ::testing::Test {
+protected:
+  // empty
+};
+
+TEST_F(LimitTest, TakeTest) {
+  warp::mqtt::Limiter limiter(10, 1.0);
+  ASSERT_TRUE(limiter.enabled());
+  double const now = 1000;
+  for (int i = 0; i < 10; ++i) {
+    EXPECT_EQ(limiter.take(1, now), milliseconds(0));
+  }
+  // Past the burst the bucket lends and tells how long to stay away.
+  EXPECT_EQ(limiter.take(1, now), milliseconds(100));
+  EXPECT_EQ(limiter.take(1, now + 0.1), milliseconds(100));
+  EXPECT_EQ(limiter.take(1, now + 2), milliseconds(0));
+}
+
+TEST_F(LimitTest, LargeTest) {
+  warp::mqtt::Limiter limiter(1000, 1.0);
+  double const now = 1000;
+  EXPECT_EQ(limiter.take(3000, now), milliseconds(2000));
+  EXPECT_EQ(limiter.take(1, now + 2), milliseconds(1));
+}
+
+TEST_F(LimitTest, DisabledTest) {
+  warp::mqtt::Limiter limiter(0, 1.0);
+  EXPECT_FALSE(limiter.enabled());
+  EXPECT_EQ(limiter.take(1e9), milliseconds(0));
+}
+
+TEST_F(LimitTest, QuotaTest) {
+  warp::mqtt::Quota quota(100);
+  auto a = std::make_shared<TestHolder>();
+  auto b = std::make_shared<TestHolder>();
+  auto c = std::make_shared<TestHolder>();
+  EXPECT_TRUE(quota.update(a, 30));
+  EXPECT_TRUE(quota.update(b, 50));
+  EXPECT_EQ(quota.used(), 80u);
+
+  // The largest holder goes, not the one that went over.
+  EXPECT_TRUE(quota.update(c, 40));
+  EXPECT_EQ(b->reclaimed, 1u);
+  EXPECT_EQ(quota.used(), 70u);
+  // A dropped holder letting go later changes nothing.
+  EXPECT_TRUE(quota.update(b, 0));
+  EXPECT_EQ(quota.used(), 70u);
+
+  // Unless it is the largest itself; then it is not told.
+  EXPECT_FALSE(quota.update(c, 90));
+  EXPECT_EQ(c->reclaimed, 0u);
+  EXPECT_EQ(a->reclaimed, 0u);
+  EXPECT_EQ(quota.used(), 30u);
+
+  EXPECT_TRUE(quota.update(a, 0));
+  EXPECT_EQ(quota.used(), 0u);
+  EXPECT_TRUE(warp::mqtt::Quota(0).update(a, 1000));
+}
@@ -4,7 +4,7 @@
 
 namespace {
 template <typename T>
-std::optional<T> roundtrip(T const& msg) {
+std::optional<T> roundtrip(T const& msg, warp::mqtt::Level level = warp::mqtt::Level::V311) {
   folly::IOBufQueue q(folly::IOBufQueue::cacheChainLength());
   folly::io::QueueAppender a(&q, 128);
   msg.encode(a);
@@ -13,6 +13,7 @@ std::optional<T> roundtrip(T const& msg) {
   size_t size = 0;
   auto head = warp::mqtt::readFixedHeader(peek, size);
   if (!head) return std::nullopt;
+  head->level = level;
 
   auto frame = q.split(size + head->size);
   folly::io::Cursor cur(frame.get());
@@ -69,7 +70,7 @@ TEST_F(MessageTest, PublishTest) {
   ASSERT_TRUE(dec.has_value());
   EXPECT_EQ(dec->head.qos, msg.head.qos);
   EXPECT_EQ(dec->head.topic, msg.head.topic);
-  EXPECT_EQ(dec->data.data, msg.data.data);
+  EXPECT_EQ(dec->data.data.to<std::string>(), msg.data.data.to<std::string>());
 }
 
 TEST_F(MessageTest, PubAckTest) {
@@ -208,3 +209,94 @@ TEST_F(MessageTest, DisconnectTest) {
   }
   ASSERT_TRUE(dec.has_value());
 }
+
+TEST_F(MessageTest, SizeTest) {
+  auto encoded = [](auto const& msg) {
+    folly::IOBufQueue q(folly::IOBufQueue::cacheChainLength());
+    folly::io::QueueAppender a(&q, 128);
+    msg.encode(a);
+    return q.chainLength();
+  };
+  auto const connect = warp::mqtt::Connect::Builder{}.withClient("TestClient").build();
+  auto const publish = warp::mqtt::Publish::Builder{}
+                           .withTopic("test/foo")
+                           .withPayload(std::string(200, 'x'))
+                           .withQos(1)
+                           .withPacketId(3)
+                           .build();
+  auto const subscribe =
+      warp::mqtt::Subscribe::Builder{}.withPacketId(1).addTopic("a/#", 1).build();
+  auto const suback = warp::mqtt::SubAck::Builder{}.withPacketId(1).addCode(0).build();
+  auto const unsubscribe = warp::mqtt::Unsubscribe::Builder{}.withPacketId(1).addTopic("a").build();
+  EXPECT_EQ(connect.size(), encoded(connect));
+  EXPECT_EQ(publish.size(), encoded(publish));
+  EXPECT_EQ(subscribe.size(), encoded(subscribe));
+  EXPECT_EQ(suback.size(), encoded(suback));
+  EXPECT_EQ(unsubscribe.size(), encoded(unsubscribe));
+  EXPECT_EQ(warp::mqtt::PubAck::Builder{}.build().size(), 4u);
+  EXPECT_EQ(warp::mqtt::PingReq::Builder{}.build().size(), 2u);
+}
+
+TEST_F(MessageTest, ConnectV5Test) {
+  warp::mqtt::Properties properties;
+  properties.add(warp::mqtt::Properties::Id::SessionExpiry, 3600);
+  auto const msg = warp::mqtt::Connect::Builder{}
+                       .withLevel(warp::mqtt::Level::V5)
+                       .withClient("TestClient")
+                       .withProperties(properties)
+                       .build();
+  auto dec = roundtrip(msg);
+  ASSERT_TRUE(dec.has_value());
+  EXPECT_EQ(dec->head.level, warp::mqtt::Level::V5);
+  EXPECT_EQ(dec->head.properties.sessionExpiry(), 3600u);
+  EXPECT_EQ(dec->data.client, msg.data.client);
+}
+
+TEST_F(MessageTest, PublishV5Test) {
+  warp::mqtt::Properties properties;
+  properties.add(warp::mqtt::Properties::Id::MessageExpiry, 60).addUser("key", "value");
+  auto const msg = warp::mqtt::Publish::Builder{}
+                       .withLevel(warp::mqtt::Level::V5)
+                       .withTopic("test/foo")
+                       .withPayload("TEST")
+                       .withQos(1)
+                       .withPacketId(5)
+                       .withProperties(properties)
+                       .build();
+  auto dec = roundtrip(msg, warp::mqtt::Level::V5);
+  ASSERT_TRUE(dec.has_value());
+  EXPECT_EQ(dec->head.packetId, 5);
+  EXPECT_EQ(dec->head.properties.messageExpiry(), 60u);
+  auto const users = dec->head.properties.users();
+  ASSERT_EQ(users.size(), 1u);
+  EXPECT_EQ(users.front().second, "value");
+  EXPECT_EQ(dec->data.data.to<std::string>(), "TEST");
+}
+
+TEST_F(MessageTest, ReasonTest) {
+  auto const ack = warp::mqtt::PubAck::Builder{}
+                       .withPacketId(7)
+                       .withReason(warp::mqtt::Reason::NoMatchingSubscribers)
+                       .build();
+  EXPECT_EQ(ack.size(), 5u);
+  auto dec = roundtrip(ack, warp::mqtt::Level::V5);
+  ASSERT_TRUE(dec.has_value());
+  EXPECT_EQ(dec->head.reason, 0x10);
+  EXPECT_FALSE(roundtrip(ack).has_value());
+
+  auto const unsuback = warp::mqtt::UnsubAck::Builder{}
+                            .withLevel(warp::mqtt::Level::V5)
+                            .withPacketId(9)
+                            .addCode(warp::mqtt::Reason::NoSubscriptionExisted)
+                            .build();
+  auto codes = roundtrip(unsuback, warp::mqtt::Level::V5);
+  ASSERT_TRUE(codes.has_value());
+  ASSERT_EQ(codes->data.codes.size(), 1u);
+  EXPECT_EQ(codes->data.codes.front(), 0x11);
+
+  auto const disconnect =
+      warp::mqtt::Disconnect::Builder{}.withReason(warp::mqtt::Reason::SessionTakenOver).build();
+  auto down = roundtrip(disconnect, warp::mqtt::Level::V5);
+  ASSERT_TRUE(down.has_value());
+  EXPECT_EQ(down->head.reason, 0x8E);
+}
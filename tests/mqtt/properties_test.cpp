@@ -0,0 +1,61 @@
+#include "warp/mqtt/properties.h"
+
+#include <folly/io/IOBufQueue.h>
+#include <gtest/gtest.h>
+
+using Id = warp::mqtt::Properties::Id;
+
+class PropertiesTest : public ::testing::Test {
+protected:
+  // empty
+};
+
+TEST_F(PropertiesTest, AccessTest) {
+  warp::mqtt::Properties properties;
+  EXPECT_TRUE(properties.empty());
+  EXPECT_EQ(properties.size(), 1u);
+  properties.add(Id::MessageExpiry, 30)
+      .add(Id::TopicAlias, 7)
+      .add(Id::SubscriptionId, 300)
+      .add(Id::ReasonString, "because")
+      .addUser("a", "1")
+      .addUser("b", "2");
+  EXPECT_TRUE(properties.valid());
+  EXPECT_EQ(properties.messageExpiry(), 30u);
+  EXPECT_EQ(properties.topicAlias(), 7u);
+  EXPECT_EQ(properties.integer(Id::SubscriptionId), 300u);
+  EXPECT_EQ(properties.reasonString(), "because");
+  EXPECT_FALSE(properties.sessionExpiry().has_value());
+  ASSERT_EQ(properties.users().size(), 2u);
+  EXPECT_EQ(properties.users()[1].first, "b");
+
+  auto const stripped = properties.without(Id::TopicAlias);
+  EXPECT_FALSE(stripped.contains(Id::TopicAlias));
+  EXPECT_EQ(stripped.messageExpiry(), 30u);
+  EXPECT_EQ(stripped.users().size(), 2u);
+  EXPECT_EQ(properties.with(Id::MessageExpiry, 10).messageExpiry(), 10u);
+}
+
+TEST_F(PropertiesTest, DecodeTest) {
+  warp::mqtt::Properties properties;
+  properties.add(Id::SessionExpiry, 120).addUser("key", "value");
+  folly::IOBufQueue q(folly::IOBufQueue::cacheChainLength());
+  folly::io::QueueAppender a(&q, 64);
+  properties.encode(a);
+  a.write<uint8_t>(0xFF);
+  EXPECT_EQ(q.chainLength(), properties.size() + 1);
+
+  auto const buf = q.move();
+  folly::io::Cursor cur(buf.get());
+  auto left = static_cast<uint32_t>(buf->computeChainDataLength());
+  warp::mqtt::Properties out;
+  ASSERT_TRUE(warp::mqtt::Properties::decode(cur, left, out));
+  EXPECT_EQ(left, 1u);
+  EXPECT_EQ(out.sessionExpiry(), 120u);
+  EXPECT_EQ(out.users().front().first, "key");
+
+  uint8_t const bad[] = {0x26, 0x00, 0x05, 'k'};
+  warp::mqtt::Properties broken(folly::IOBuf(folly::IOBuf::COPY_BUFFER, bad, sizeof(bad)));
+  EXPECT_FALSE(broken.valid());
+  EXPECT_TRUE(broken.users().empty());
+}
@@ -0,0 +1,55 @@
+#include "warp/mqtt/registry.h"
+
+#include <gtest/gtest.h>
+
+#include <optional>
+
+namespace {
+class TestChannel final : public warp::mqtt::Channel {
+public:
+  void write(std::unique_ptr<folly::IOBuf>) override {}
+  void evict(warp::mqtt::Reason reason) override { evicted = reason; }
+
+  std::optional<warp::mqtt::Reason> evicted;
+};
+}  // namespace
+
+class RegistryTest : public ::testing::Test {
+protected:
+  // empty
+};
+
+TEST_F(RegistryTest, TakeoverTest) {
+  warp::mqtt::Registry registry;
+  auto a = std::make_shared<TestChannel>();
+  auto b = std::make_shared<TestChannel>();
+  EXPECT_EQ(registry.add("client", a), nullptr);
+  EXPECT_EQ(registry.add("client", a), nullptr);
+  EXPECT_EQ(registry.find("client"), a);
+  EXPECT_EQ(registry.add("client", b), a);
+  EXPECT_EQ(registry.find("client"), b);
+  EXPECT_EQ(registry.size(), 1u);
+
+  // The connection that was taken over cannot remove its successor.
+  EXPECT_FALSE(registry.remove("client", a.get()));
+  EXPECT_TRUE(registry.remove("client", b.get()));
+  EXPECT_EQ(registry.find("client"), nullptr);
+  EXPECT_EQ(registry.size(), 0u);
+}
+
+TEST_F(RegistryTest, SessionTest) {
+  auto trie = std::make_shared<warp::mqtt::Trie>();
+  warp::mqtt::SessionStore store(trie);
+  auto a = std::make_shared<TestChannel>();
+  auto b = std::make_shared<TestChannel>();
+  auto session = store.open("client", false, std::chrono::seconds(0)).first;
+  session->attach(a);
+  ASSERT_TRUE(session->subscribe("test/#", 1));
+
+  // The old connection closes after the new one took the session over.
+  session->attach(b);
+  store.close(session, a.get());
+  EXPECT_EQ(trie->size(), 1u);
+  store.close(session, b.get());
+  EXPECT_EQ(trie->size(), 0u);
+}
@@ -0,0 +1,78 @@
+#include "warp/mqtt/retain.h"
+
+#include <gtest/gtest.h>
+
+namespace {
+warp::mqtt::Publish makePublish(std::string const& topic, std::string const& payload) {
+  return warp::mqtt::Publish::Builder{}.withTopic(topic).withPayload(payload).withRetain().build();
+}
+
+size_t count(warp::mqtt::RetainStore const& store, std::string_view filter) {
+  std::vector<std::shared_ptr<warp::mqtt::SharedPublish const>> out;
+  store.match(filter, out);
+  return out.size();
+}
+}  // namespace
+
+class RetainTest : public ::testing::Test {
+protected:
+  warp::mqtt::RetainStore store_;
+};
+
+TEST_F(RetainTest, MatchTest) {
+  ASSERT_TRUE(store_.retain(makePublish("plant/a/sensors/temp", "1")));
+  ASSERT_TRUE(store_.retain(makePublish("plant/b/sensors/hum", "2")));
+  ASSERT_TRUE(store_.retain(makePublish("plant/a/status", "3")));
+  ASSERT_TRUE(store_.retain(makePublish("$SYS/uptime", "4")));
+  EXPECT_EQ(store_.size(), 4u);
+  EXPECT_EQ(count(store_, "plant/+/sensors/#"), 2u);
+  EXPECT_EQ(count(store_, "plant/a/#"), 2u);
+  EXPECT_EQ(count(store_, "plant/a/status"), 1u);
+  EXPECT_EQ(count(store_, "plant/c/#"), 0u);
+  EXPECT_EQ(count(store_, "#"), 3u);
+  EXPECT_EQ(count(store_, "+/uptime"), 0u);
+  EXPECT_EQ(count(store_, "$SYS/#"), 1u);
+}
+
+TEST_F(RetainTest, ClearTest) {
+  ASSERT_TRUE(store_.retain(makePublish("test/foo", "1")));
+  ASSERT_TRUE(store_.retain(makePublish("test/foo", "2")));
+  EXPECT_EQ(store_.size(), 1u);
+  EXPECT_GT(store_.bytes(), 0u);
+
+  std::vector<std::shared_ptr<warp::mqtt::SharedPublish const>> out;
+  store_.match("test/foo", out);
+  ASSERT_EQ(out.size(), 1u);
+  auto data = out.front()->clone(0, 0);
+  folly::IOBufQueue q(folly::IOBufQueue::cacheChainLength());
+  q.append(std::move(data));
+  auto decoded = warp::mqtt::Codec::decode(q);
+  ASSERT_TRUE(decoded.has_value());
+  auto const& msg = std::get<warp::mqtt::Publish>(*decoded);
+  EXPECT_EQ(msg.data.data.to<std::string>(), "2");
+  EXPECT_EQ(msg.head.retain, 1);
+
+  ASSERT_TRUE(store_.retain(makePublish("test/foo", "")));
+  EXPECT_EQ(store_.size(), 0u);
+  EXPECT_EQ(store_.bytes(), 0u);
+  EXPECT_EQ(count(store_, "#"), 0u);
+}
+
+TEST_F(RetainTest, LimitTest) {
+  warp::mqtt::RetainStore store(256);
+  EXPECT_FALSE(store.retain(makePublish("test/foo", std::string(512, 'x'))));
+  EXPECT_TRUE(store.retain(makePublish("test/foo", std::string(64, 'x'))));
+  EXPECT_EQ(store.size(), 1u);
+  EXPECT_LE(store.bytes(), 256u);
+}
+
+TEST_F(RetainTest, UpdateLimitTest) {
+  // An update that does not fit drops the message it would have replaced.
+  warp::mqtt::RetainStore store(256);
+  ASSERT_TRUE(store.retain(makePublish("test/foo", std::string(64, 'x'))));
+  ASSERT_TRUE(store.retain(makePublish("test/bar", std::string(64, 'x'))));
+  EXPECT_FALSE(store.retain(makePublish("test/foo", std::string(200, 'x'))));
+  EXPECT_EQ(store.size(), 1u);
+  EXPECT_EQ(count(store, "test/foo"), 0u);
+  EXPECT_EQ(count(store, "test/bar"), 1u);
+}
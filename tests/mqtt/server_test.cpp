@@ -1,12 +1,27 @@
 #include "warp/mqtt/server.h"
 
+#include <arpa/inet.h>
 #include <gtest/gtest.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <unistd.h>
+
+#include <chrono>
+#include <string>
+#include <thread>
+
+#include "warp/mqtt/codec.h"
 
 class ServerTest : public ::testing::Test {
 protected:
-  void SetUp() override {
+  static warp::mqtt::ServerOptions options() {
     warp::mqtt::ServerOptions options;
     options.port = port_;
+    options.dispatch = warp::mqtt::Dispatch::Control;
+    return options;
+  }
+
+  void start(warp::mqtt::ServerOptions const& options = ServerTest::options()) {
     server_ = std::make_unique<warp::mqtt::Server>(options);
     thread_ = std::thread([this]() { server_->start(); });
     std::this_thread::sleep_for(std::chrono::milliseconds(1000));
@@ -21,11 +36,286 @@ protected:
     }
   }
 
+  // A blocking client socket whose reads give up after five seconds, or -1.
+  static int dial() {
+    int const fd = ::socket(AF_INET, SOCK_STREAM, 0);
+    timeval timeout{5, 0};
+    ::setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    sockaddr_in addr{};
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port_);
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    if (fd >= 0 && ::connect(fd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) == 0) {
+      return fd;
+    }
+    if (fd >= 0) ::close(fd);
+    return -1;
+  }
+
+  static bool send(int fd, std::string const& data) {
+    return ::send(fd, data.data(), data.size(), 0) == static_cast<ssize_t>(data.size());
+  }
+
+  static std::string encode(warp::mqtt::Message const& msg) {
+    return warp::mqtt::Codec::encode(msg)->to<std::string>();
+  }
+
+  static std::string connect(std::string const& client, uint16_t timeout = 60) {
+    return encode(warp::mqtt::Connect::Builder{}
+                      .withLevel(warp::mqtt::Level::V311)
+                      .withCleanSession(true)
+                      .withKeepAlive(timeout)
+                      .withClient(client)
+                      .build());
+  }
+
+  static std::string pings(size_t n) {
+    std::string out;
+    for (size_t i = 0; i < n; ++i) {
+      out += encode(warp::mqtt::PingReq::Builder{}.build());
+    }
+    return out;
+  }
+
+  // Whether the server closed fd, waiting up to a second for it.
+  static bool closed(int fd) {
+    timeval timeout{1, 0};
+    ::setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    char c;
+    return ::recv(fd, &c, 1, 0) == 0;
+  }
+
+  static std::string read(int fd, size_t size) {
+    std::string out(size, '\0');
+    size_t done = 0;
+    while (done < size) {
+      auto const n = ::recv(fd, out.data() + done, size - done, 0);
+      if (n <= 0) break;
+      done += static_cast<size_t>(n);
+    }
+    out.resize(done);
+    return out;
+  }
+
   static constexpr uint16_t port_ = 11883;
   std::unique_ptr<warp::mqtt::Server> server_;
   std::thread thread_;
 };
 
 TEST_F(ServerTest, ConnectTest) {
+  start();
   // TODO
 }
+
+TEST_F(ServerTest, PipelinedConnectTest) {
+  start();
+  // Both packets are answered inline on the IO thread, the ConnAck first.
+  auto const connect = warp::mqtt::Connect::Builder{}
+                           .withLevel(warp::mqtt::Level::V311)
+                           .withCleanSession(true)
+                           .withKeepAlive(60)
+                           .withClient("PipelinedClient")
+                           .build();
+  auto data = warp::mqtt::Codec::encode(connect)->to<std::string>();
+  data += warp::mqtt::Codec::encode(warp::mqtt::PingReq::Builder{}.build())->to<std::string>();
+
+  int const fd = dial();
+  ASSERT_GE(fd, 0);
+  ASSERT_EQ(::send(fd, data.data(), data.size(), 0), static_cast<ssize_t>(data.size()));
+  auto const out = read(fd, 6);
+  ::close(fd);
+  ASSERT_EQ(out.size(), 6u);
+  EXPECT_EQ(static_cast<uint8_t>(out[0]), 0x20);
+  EXPECT_EQ(static_cast<uint8_t>(out[4]), 0xD0);
+}
+
+TEST_F(ServerTest, PartialQuotaTest) {
+  auto opts = options();
+  opts.partial = 1000;
+  start(opts);
+  auto const publish = encode(warp::mqtt::Publish::Builder{}
+                                  .withTopic("test/partial")
+                                  .withPayload(std::string(2000, 'x'))
+                                  .build());
+
+  int const large = dial();
+  ASSERT_GE(large, 0);
+  ASSERT_TRUE(send(large, connect("LargeClient") + publish.substr(0, 900)));
+  ASSERT_EQ(read(large, 4).size(), 4u);
+
+  // Going over the cap lets the largest holder go, not the one that read last.
+  int const small = dial();
+  ASSERT_GE(small, 0);
+  ASSERT_TRUE(send(small, connect("SmallClient") + publish.substr(0, 200)));
+  ASSERT_EQ(read(small, 4).size(), 4u);
+  EXPECT_TRUE(closed(large));
+
+  ASSERT_TRUE(send(small, publish.substr(200) + encode(warp::mqtt::PingReq::Builder{}.build())));
+  auto const out = read(small, 2);
+  ASSERT_EQ(out.size(), 2u);
+  EXPECT_EQ(static_cast<uint8_t>(out[0]), 0xD0);
+  ::close(large);
+  ::close(small);
+}
+
+TEST_F(ServerTest, DeferredQuotaTest) {
+  // Whole frames left over by the read budget are not partial ones.
+  auto opts = options();
+  opts.partial = 16;
+  opts.read.messages = 1;
+  start(opts);
+  auto const data = connect("DeferredClient") + pings(32);
+
+  int const fd = dial();
+  ASSERT_GE(fd, 0);
+  ASSERT_TRUE(send(fd, data));
+  auto const out = read(fd, 4 + 32 * 2);
+  ::close(fd);
+  ASSERT_EQ(out.size(), 4u + 32 * 2);
+  EXPECT_EQ(static_cast<uint8_t>(out[0]), 0x20);
+  EXPECT_EQ(static_cast<uint8_t>(out[out.size() - 2]), 0xD0);
+}
+
+TEST_F(ServerTest, ThrottleTest) {
+  // Over its packet rate a client is not read until it is back under it,
+  // and then picks up where it stopped; it is never disconnected for it.
+  auto opts = options();
+  opts.limits.packets = 10;
+  start(opts);
+  int const fd = dial();
+  ASSERT_GE(fd, 0);
+  auto const begin = std::chrono::steady_clock::now();
+  ASSERT_TRUE(send(fd, connect("ThrottledClient") + pings(20)));
+  auto const out = read(fd, 4 + 20 * 2);
+  auto const elapsed = std::chrono::steady_clock::now() - begin;
+  ASSERT_EQ(out.size(), 4u + 20 * 2);
+  EXPECT_GE(elapsed, std::chrono::milliseconds(800));
+
+  ASSERT_TRUE(send(fd, pings(1)));
+  EXPECT_EQ(read(fd, 2).size(), 2u);
+  ::close(fd);
+}
+
+TEST_F(ServerTest, ThrottleKeepAliveTest) {
+  // Working through what a throttled client sent earlier is not activity of
+  // its own; a client that then goes quiet still times out.
+  auto opts = options();
+  opts.limits.packets = 2;
+  start(opts);
+  int const fd = dial();
+  ASSERT_GE(fd, 0);
+  ASSERT_TRUE(send(fd, connect("QuietClient", 1) + pings(10)));
+  auto const out = read(fd, 4 + 10 * 2);
+  ::close(fd);
+  ASSERT_GE(out.size(), 4u);
+  EXPECT_LT(out.size(), 4u + 10 * 2);
+}
+
+TEST_F(ServerTest, AcceptLimitTest) {
+  // A connection over the accept rate is held back, not refused.
+  auto opts = options();
+  opts.limits.connections = 1;
+  start(opts);
+  int const first = dial();
+  ASSERT_GE(first, 0);
+  ASSERT_TRUE(send(first, connect("FirstClient")));
+  ASSERT_EQ(read(first, 4).size(), 4u);
+
+  int const second = dial();
+  ASSERT_GE(second, 0);
+  auto const begin = std::chrono::steady_clock::now();
+  ASSERT_TRUE(send(second, connect("SecondClient")));
+  auto const out = read(second, 4);
+  auto const elapsed = std::chrono::steady_clock::now() - begin;
+  ASSERT_EQ(out.size(), 4u);
+  EXPECT_EQ(static_cast<uint8_t>(out[0]), 0x20);
+  EXPECT_GE(elapsed, std::chrono::milliseconds(500));
+  ::close(first);
+  ::close(second);
+}
+
+TEST_F(ServerTest, DeferTest) {
+  // Past its read budget a client yields; the rest of what it sent, and
+  // whatever arrives meanwhile, is decoded on later passes of the loop.
+  auto opts = options();
+  opts.read.messages = 2;
+  start(opts);
+  int const fd = dial();
+  ASSERT_GE(fd, 0);
+  ASSERT_TRUE(send(fd, connect("DeferClient") + pings(16)));
+  ASSERT_TRUE(send(fd, pings(16)));
+  auto const out = read(fd, 4 + 32 * 2);
+  ::close(fd);
+  ASSERT_EQ(out.size(), 4u + 32 * 2);
+  EXPECT_EQ(static_cast<uint8_t>(out[0]), 0x20);
+}
+
+TEST_F(ServerTest, DeferredThrottleTest) {
+  // A throttle that hits while a read is deferred holds the leftover frames
+  // until it lifts; none of them are lost.
+  auto opts = options();
+  opts.read.messages = 2;
+  opts.limits.packets = 20;
+  start(opts);
+  int const fd = dial();
+  ASSERT_GE(fd, 0);
+  ASSERT_TRUE(send(fd, connect("DeferredThrottleClient") + pings(40)));
+  auto const out = read(fd, 4 + 40 * 2);
+  ASSERT_EQ(out.size(), 4u + 40 * 2);
+
+  ASSERT_TRUE(send(fd, pings(1)));
+  EXPECT_EQ(read(fd, 2).size(), 2u);
+  ::close(fd);
+}
+
+TEST_F(ServerTest, DuplicateTest) {
+  // A QoS 2 message resent before its PubRel is acknowledged again but
+  // routed only once.
+  start();
+  int const sub = dial();
+  ASSERT_GE(sub, 0);
+  ASSERT_TRUE(send(
+      sub, connect("DuplicateSubscriber") +
+               encode(warp::mqtt::Subscribe::Builder{}.withPacketId(1).addTopic("dup/#", 0).build())
+  ));
+  ASSERT_EQ(read(sub, 4 + 5).size(), 4u + 5);
+
+  int const pub = dial();
+  ASSERT_GE(pub, 0);
+  auto publish = warp::mqtt::Publish::Builder{}
+                     .withTopic("dup/a")
+                     .withQos(2)
+                     .withPacketId(5)
+                     .withPayload(std::string("x"));
+  auto const first = encode(publish.build());
+  auto const resent = encode(publish.withDup().build());
+  ASSERT_TRUE(send(pub, connect("DuplicatePublisher") + first + resent));
+  ASSERT_EQ(read(pub, 4 + 4 + 4).size(), 4u + 4 + 4);
+  ASSERT_TRUE(send(pub, encode(warp::mqtt::PubRel::Builder{}.withPacketId(5).build())));
+  ASSERT_EQ(read(pub, 4).size(), 4u);
+  auto const marker =
+      warp::mqtt::Publish::Builder{}.withTopic("dup/b").withPayload(std::string("y")).build();
+  ASSERT_TRUE(send(pub, encode(marker)));
+
+  // Two QoS 0 deliveries of ten bytes each: dup/a once, then dup/b.
+  auto const out = read(sub, 20);
+  ::close(pub);
+  ::close(sub);
+  ASSERT_EQ(out.size(), 20u);
+  EXPECT_EQ(out.substr(4, 5), "dup/a");
+  EXPECT_EQ(out.substr(14, 5), "dup/b");
+}
+
+TEST_F(ServerTest, TopicNameTest) {
+  // A publish to a wildcard is not a publish to anything; the client is
+  // closed instead of acknowledged.
+  start();
+  int const fd = dial();
+  ASSERT_GE(fd, 0);
+  auto const publish =
+      warp::mqtt::Publish::Builder{}.withTopic("test/+").withQos(1).withPacketId(1).build();
+  ASSERT_TRUE(send(fd, connect("TopicNameClient") + encode(publish)));
+  ASSERT_EQ(read(fd, 4).size(), 4u);
+  EXPECT_TRUE(closed(fd));
+  ::close(fd);
+}
@@ -0,0 +1,255 @@
+#include "warp/mqtt/session.h"
+
+#include <gtest/gtest.h>
+
+#include <algorithm>
+
+namespace {
+class TestChannel final : public warp::mqtt::Channel {
+public:
+  void write(std::unique_ptr<folly::IOBuf> buf) override {
+    ++writes;
+    queue.append(std::move(buf));
+  }
+
+  size_t queued() const override { return queue.chainLength(); }
+
+  size_t count() {
+    size_t n = 0;
+    while (warp::mqtt::Codec::decode(queue)) ++n;
+    return n;
+  }
+
+  size_t writes{0};
+  folly::IOBufQueue queue{folly::IOBufQueue::cacheChainLength()};
+};
+
+void deliver(warp::mqtt::Trie const& trie, std::string const& topic, uint8_t qos) {
+  auto const msg = warp::mqtt::Publish::Builder{}
+                       .withTopic(topic)
+                       .withQos(qos)
+                       .withPacketId(1)
+                       .withPayload(std::string(100, 'x'))
+                       .build();
+  std::vector<warp::mqtt::Trie::Match> matches;
+  trie.match(topic, matches);
+  auto const shared = std::make_shared<warp::mqtt::SharedPublish const>(msg);
+  for (auto const& match : matches) {
+    match.subscriber->publish(*shared, std::min(match.qos, qos));
+  }
+}
+}  // namespace
+
+class SessionTest : public ::testing::Test {
+protected:
+  std::shared_ptr<warp::mqtt::Trie> trie_ = std::make_shared<warp::mqtt::Trie>();
+  std::shared_ptr<TestChannel> channel_ = std::make_shared<TestChannel>();
+};
+
+TEST_F(SessionTest, ResumeTest) {
+  warp::mqtt::SessionStore store(trie_);
+  auto [session, present] = store.open("client", false);
+  EXPECT_FALSE(present);
+  session->attach(channel_);
+  ASSERT_TRUE(session->subscribe("test/#", 1));
+  store.close(session, channel_.get());
+
+  deliver(*trie_, "test/foo", 1);
+  deliver(*trie_, "test/bar", 0);
+  deliver(*trie_, "test/baz", 2);
+  EXPECT_EQ(session->queued(), 2u);
+  EXPECT_EQ(store.bytes(), session->bytes());
+  EXPECT_EQ(channel_->count(), 0u);
+
+  auto [resumed, found] = store.open("client", false);
+  EXPECT_TRUE(found);
+  EXPECT_EQ(resumed, session);
+  auto channel = std::make_shared<TestChannel>();
+  resumed->attach(channel);
+  EXPECT_EQ(channel->writes, 1u);
+  EXPECT_EQ(channel->count(), 2u);
+  EXPECT_EQ(resumed->queued(), 0u);
+  EXPECT_EQ(store.bytes(), 0u);
+}
+
+TEST_F(SessionTest, ResubscribeTest) {
+  warp::mqtt::SessionStore store(trie_);
+  auto session = store.open("client", false).first;
+  bool existed = true;
+  ASSERT_TRUE(session->subscribe("test/#", 1, existed));
+  EXPECT_FALSE(existed);
+  ASSERT_TRUE(session->subscribe("test/#", 2, existed));
+  EXPECT_TRUE(existed);
+  ASSERT_TRUE(session->unsubscribe("test/#"));
+  ASSERT_TRUE(session->subscribe("test/#", 1, existed));
+  EXPECT_FALSE(existed);
+  session->clear();
+}
+
+TEST_F(SessionTest, InflightTest) {
+  warp::mqtt::SessionStore store(trie_);
+  auto session = store.open("client", false).first;
+  session->attach(channel_);
+  ASSERT_TRUE(session->subscribe("test/#", 2));
+  deliver(*trie_, "test/a", 1);
+  deliver(*trie_, "test/b", 2);
+  deliver(*trie_, "test/c", 2);
+  deliver(*trie_, "test/d", 0);
+  EXPECT_EQ(channel_->count(), 4u);
+  EXPECT_EQ(session->inflight(), 3u);
+
+  // Packet ids are handed out in order, from 1.
+  EXPECT_TRUE(session->acknowledge(1));
+  EXPECT_FALSE(session->acknowledge(1));
+  EXPECT_TRUE(session->received(2));
+  store.close(session, channel_.get());
+
+  // What was not acknowledged goes out again: a PubRel for the message the
+  // client has, then the other one marked as a duplicate.
+  auto channel = std::make_shared<TestChannel>();
+  session->attach(channel);
+  EXPECT_EQ(channel->writes, 1u);
+  auto rel = warp::mqtt::Codec::decode(channel->queue);
+  ASSERT_TRUE(rel.has_value());
+  EXPECT_EQ(std::get<warp::mqtt::PubRel>(*rel).head.packetId, 2u);
+  auto dup = warp::mqtt::Codec::decode(channel->queue);
+  ASSERT_TRUE(dup.has_value());
+  auto const& publish = std::get<warp::mqtt::Publish>(*dup);
+  EXPECT_EQ(publish.head.topic, "test/c");
+  EXPECT_EQ(publish.head.packetId, 3u);
+  EXPECT_EQ(publish.head.dup, 1u);
+  EXPECT_TRUE(channel->queue.empty());
+
+  EXPECT_TRUE(session->acknowledge(2));
+  EXPECT_TRUE(session->acknowledge(3));
+  EXPECT_EQ(session->inflight(), 0u);
+  session->clear();
+}
+
+TEST_F(SessionTest, IncomingTest) {
+  // An inbound QoS 2 packet id is held from the Publish until the PubRel,
+  // across a reconnect, so a DUP resend is not routed a second time.
+  warp::mqtt::SessionStore store(trie_);
+  auto session = store.open("client", false).first;
+  session->attach(channel_);
+  EXPECT_TRUE(session->accept(7));
+  EXPECT_FALSE(session->accept(7));
+  EXPECT_TRUE(session->accept(8));
+  store.close(session, channel_.get());
+
+  auto channel = std::make_shared<TestChannel>();
+  session->attach(channel);
+  EXPECT_FALSE(session->accept(7));
+  EXPECT_TRUE(session->complete(7));
+  EXPECT_FALSE(session->complete(7));
+  EXPECT_TRUE(session->accept(7));
+
+  session->clear();
+  EXPECT_TRUE(session->accept(8));
+  session->clear();
+}
+
+TEST_F(SessionTest, WindowTest) {
+  // Past the most a client may leave unacknowledged, deliveries wait and go
+  // out as acknowledgements come in.
+  warp::mqtt::SessionOptions options;
+  options.inflight = 2;
+  warp::mqtt::SessionStore store(trie_, options);
+  auto session = store.open("client", true).first;
+  session->attach(channel_);
+  ASSERT_TRUE(session->subscribe("test/#", 1));
+  for (int i = 0; i < 4; ++i) {
+    deliver(*trie_, "test/foo", 1);
+  }
+  EXPECT_EQ(channel_->count(), 2u);
+  EXPECT_EQ(session->queued(), 2u);
+  EXPECT_TRUE(session->acknowledge(1));
+  EXPECT_EQ(channel_->count(), 1u);
+  EXPECT_EQ(session->queued(), 1u);
+  EXPECT_EQ(session->inflight(), 2u);
+  store.close(session, channel_.get());
+}
+
+TEST_F(SessionTest, CleanTest) {
+  warp::mqtt::SessionStore store(trie_);
+  auto persistent = store.open("client", false).first;
+  ASSERT_TRUE(persistent->subscribe("test/#", 1));
+  EXPECT_EQ(trie_->size(), 1u);
+
+  auto [session, present] = store.open("client", true);
+  EXPECT_FALSE(present);
+  EXPECT_EQ(trie_->size(), 0u);
+  EXPECT_EQ(store.size(), 0u);
+  session->attach(channel_);
+  ASSERT_TRUE(session->subscribe("test/#", 1));
+  deliver(*trie_, "test/foo", 1);
+  EXPECT_EQ(channel_->count(), 1u);
+  store.close(session, channel_.get());
+  EXPECT_EQ(trie_->size(), 0u);
+}
+
+TEST_F(SessionTest, LimitTest) {
+  warp::mqtt::SessionOptions options;
+  options.messages = 3;
+  warp::mqtt::SessionStore store(trie_, options);
+  auto session = store.open("client", false).first;
+  ASSERT_TRUE(session->subscribe("test/#", 1));
+  for (int i = 0; i < 5; ++i) {
+    deliver(*trie_, "test/foo", 1);
+  }
+  EXPECT_EQ(session->queued(), 3u);
+  EXPECT_EQ(session->dropped(), 2u);
+
+  options.messages = 1024;
+  options.total = session->bytes() / 2;
+  warp::mqtt::SessionStore small(trie_, options);
+  auto other = small.open("other", false).first;
+  ASSERT_TRUE(other->subscribe("test/#", 1));
+  for (int i = 0; i < 5; ++i) {
+    deliver(*trie_, "test/bar", 1);
+  }
+  EXPECT_EQ(other->queued(), 1u);
+  EXPECT_LE(small.bytes(), options.total);
+}
+
+TEST_F(SessionTest, ExpiryTest) {
+  using std::chrono::seconds;
+  warp::mqtt::SessionStore store(trie_);
+  auto session = store.open("client", false, seconds(60)).first;
+  session->attach(channel_);
+  ASSERT_TRUE(session->subscribe("test/#", 1));
+  store.close(session, channel_.get());
+  EXPECT_FALSE(session->expired(warp::mqtt::Session::Clock::now()));
+  EXPECT_TRUE(session->expired(warp::mqtt::Session::Clock::now() + seconds(61)));
+  EXPECT_EQ(store.expire(), 0u);
+
+  // A clean start with no expiry ends the session on disconnect.
+  auto [fresh, present] = store.open("client", true, seconds(0));
+  EXPECT_FALSE(present);
+  EXPECT_EQ(store.size(), 0u);
+  EXPECT_EQ(trie_->size(), 0u);
+  fresh->attach(channel_);
+  store.close(fresh, channel_.get());
+  EXPECT_EQ(store.open("client", false, seconds(60)).second, false);
+}
+
+TEST_F(SessionTest, LoadTest) {
+  warp::mqtt::SessionStore store(trie_);
+  auto [session, present] = store.open("client", false);
+  EXPECT_EQ(session->load(), warp::mqtt::Subscriber::kOffline);
+  session->attach(channel_);
+  EXPECT_EQ(session->load(), 0u);
+  ASSERT_TRUE(session->subscribe("test/#", 1));
+  deliver(*trie_, "test/foo", 1);
+  EXPECT_EQ(session->load(), channel_->queued());
+  EXPECT_GT(session->load(), 0u);
+
+  // What the channel reports as it drains.
+  session->setBacklog(10);
+  EXPECT_EQ(session->load(), 10u);
+
+  // A late report does not bring a detached session back.
+  store.close(session, channel_.get());
+  session->setBacklog(10);
+  EXPECT_EQ(session->load(), warp::mqtt::Subscriber::kOffline);
+}
@@ -0,0 +1,49 @@
+#include "warp/mqtt/topic.h"
+
+#include <gtest/gtest.h>
+
+class TopicTest : public ::testing::Test {
+protected:
+  // empty
+};
+
+TEST_F(TopicTest, InternTest) {
+  warp::mqtt::TopicTable table;
+  auto a = table.intern("plant/line/sensor");
+  auto b = table.intern("plant/line/sensor");
+  auto c = table.intern("plant/line/status");
+  EXPECT_EQ(a, b);
+  EXPECT_NE(a, c);
+  EXPECT_TRUE(a->interned());
+  EXPECT_EQ(table.size(), 2u);
+  ASSERT_EQ(a->levels().size(), 3u);
+  EXPECT_EQ(a->levels()[2], "sensor");
+}
+
+TEST_F(TopicTest, LimitTest) {
+  warp::mqtt::TopicTable table(1);
+  auto a = table.intern("test/foo");
+  auto b = table.intern("test/bar");
+  // Past the limit a name gets a topic of its own, shared with no one.
+  EXPECT_TRUE(a->interned());
+  EXPECT_FALSE(b->interned());
+  EXPECT_EQ(b->name(), "test/bar");
+  EXPECT_NE(table.intern("test/bar"), b);
+  EXPECT_EQ(table.size(), 1u);
+  EXPECT_EQ(table.intern("test/foo"), a);
+}
+
+TEST_F(TopicTest, EvictTest) {
+  warp::mqtt::TopicTable table(1);
+  std::weak_ptr<warp::mqtt::Topic const> const evicted = table.intern("test/foo");
+  // Nothing holds test/foo any more, so it makes room.
+  auto a = table.intern("test/bar");
+  EXPECT_EQ(table.intern("test/bar"), a);
+  EXPECT_TRUE(a->interned());
+  EXPECT_TRUE(evicted.expired());
+  EXPECT_EQ(table.size(), 1u);
+  // test/bar is held, and the next sweep is some misses away.
+  auto b = table.intern("test/baz");
+  EXPECT_NE(table.intern("test/baz"), b);
+  EXPECT_EQ(table.intern("test/bar"), a);
+}
@@ -0,0 +1,182 @@
+#include "warp/mqtt/trie.h"
+
+#include <gtest/gtest.h>
+
+#include <algorithm>
+
+namespace {
+class TestSubscriber final : public warp::mqtt::Subscriber {
+public:
+  void publish(warp::mqtt::SharedPublish const&, uint8_t) override { ++received; }
+  size_t load() const override { return backlog; }
+
+  size_t received{0};
+  size_t backlog{0};
+};
+
+size_t count(warp::mqtt::Trie const& trie, std::string_view topic) {
+  std::vector<warp::mqtt::Trie::Match> out;
+  trie.match(topic, out);
+  return out.size();
+}
+
+void deliver(warp::mqtt::Trie const& trie, std::string const& topic, size_t times) {
+  warp::mqtt::SharedPublish const shared(warp::mqtt::Publish::Builder{}.withTopic(topic).build());
+  for (size_t i = 0; i < times; ++i) {
+    std::vector<warp::mqtt::Trie::Match> out;
+    trie.match(topic, out);
+    for (auto const& match : out) {
+      match.subscriber->publish(shared, match.qos);
+    }
+  }
+}
+}  // namespace
+
+class TrieTest : public ::testing::Test {
+protected:
+  std::shared_ptr<TestSubscriber> a_ = std::make_shared<TestSubscriber>();
+  std::shared_ptr<TestSubscriber> b_ = std::make_shared<TestSubscriber>();
+  warp::mqtt::Trie trie_;
+};
+
+TEST_F(TrieTest, ExactTest) {
+  ASSERT_TRUE(trie_.subscribe("test/foo", a_, 1));
+  EXPECT_EQ(count(trie_, "test/foo"), 1u);
+  EXPECT_EQ(count(trie_, "test/bar"), 0u);
+  EXPECT_EQ(count(trie_, "test/foo/bar"), 0u);
+  EXPECT_EQ(count(trie_, "test"), 0u);
+}
+
+TEST_F(TrieTest, WildcardTest) {
+  ASSERT_TRUE(trie_.subscribe("test/+/bar", a_, 0));
+  ASSERT_TRUE(trie_.subscribe("test/#", b_, 1));
+  EXPECT_EQ(count(trie_, "test/foo/bar"), 2u);
+  EXPECT_EQ(count(trie_, "test/foo/baz"), 1u);
+  EXPECT_EQ(count(trie_, "test"), 1u);
+  EXPECT_EQ(count(trie_, "other/foo/bar"), 0u);
+
+  std::vector<warp::mqtt::Trie::Match> out;
+  trie_.match("test/foo/bar", out);
+  auto it = std::find_if(out.begin(), out.end(), [this](auto const& m) {
+    return m.subscriber == b_;
+  });
+  ASSERT_NE(it, out.end());
+  EXPECT_EQ(it->qos, 1);
+}
+
+TEST_F(TrieTest, SystemTopicTest) {
+  ASSERT_TRUE(trie_.subscribe("#", a_, 0));
+  ASSERT_TRUE(trie_.subscribe("+/info", a_, 0));
+  ASSERT_TRUE(trie_.subscribe("$SYS/#", b_, 0));
+  EXPECT_EQ(count(trie_, "$SYS/info"), 1u);
+  EXPECT_EQ(count(trie_, "test/info"), 2u);
+}
+
+TEST_F(TrieTest, UnsubscribeTest) {
+  ASSERT_TRUE(trie_.subscribe("test/foo", a_, 0));
+  ASSERT_TRUE(trie_.subscribe("test/foo", a_, 1));
+  ASSERT_TRUE(trie_.subscribe("test/+", b_, 0));
+  EXPECT_EQ(trie_.size(), 2u);
+  EXPECT_TRUE(trie_.unsubscribe("test/foo", a_.get()));
+  EXPECT_FALSE(trie_.unsubscribe("test/foo", a_.get()));
+  EXPECT_EQ(count(trie_, "test/foo"), 1u);
+  EXPECT_TRUE(trie_.unsubscribe("test/+", b_.get()));
+  EXPECT_EQ(count(trie_, "test/foo"), 0u);
+  EXPECT_EQ(trie_.size(), 0u);
+}
+
+TEST_F(TrieTest, ValidateTest) {
+  EXPECT_FALSE(trie_.subscribe("", a_, 0));
+  EXPECT_FALSE(trie_.subscribe("test/#/foo", a_, 0));
+  EXPECT_FALSE(trie_.subscribe("test/foo#", a_, 0));
+  EXPECT_FALSE(trie_.subscribe("test/f+", a_, 0));
+  EXPECT_TRUE(warp::mqtt::isValidTopicName("test/foo"));
+  EXPECT_FALSE(warp::mqtt::isValidTopicName("test/+"));
+  EXPECT_FALSE(warp::mqtt::isValidTopicName("test/#"));
+}
+
+TEST_F(TrieTest, SharedTest) {
+  auto c = std::make_shared<TestSubscriber>();
+  ASSERT_TRUE(trie_.subscribe("$share/workers/test/#", a_, 1));
+  ASSERT_TRUE(trie_.subscribe("$share/workers/test/#", b_, 1));
+  ASSERT_TRUE(trie_.subscribe("test/#", c, 1));
+  EXPECT_EQ(trie_.size(), 3u);
+  EXPECT_EQ(count(trie_, "test/foo"), 2u);
+  deliver(trie_, "test/foo", 10);
+  EXPECT_EQ(a_->received, 5u);
+  EXPECT_EQ(b_->received, 5u);
+  EXPECT_EQ(c->received, 10u);
+
+  EXPECT_TRUE(trie_.unsubscribe("$share/workers/test/#", a_.get()));
+  EXPECT_TRUE(trie_.unsubscribe("$share/workers/test/#", b_.get()));
+  EXPECT_EQ(trie_.size(), 1u);
+  EXPECT_EQ(count(trie_, "test/foo"), 1u);
+
+  EXPECT_FALSE(trie_.subscribe("$share/workers", a_, 0));
+  EXPECT_FALSE(trie_.subscribe("$share//test", a_, 0));
+  EXPECT_FALSE(trie_.subscribe("$share/work+/test", a_, 0));
+}
+
+TEST_F(TrieTest, BalanceTest) {
+  warp::mqtt::Trie trie(warp::mqtt::Balance::LeastLoaded);
+  a_->backlog = 1024;
+  ASSERT_TRUE(trie.subscribe("$share/workers/test", a_, 1));
+  ASSERT_TRUE(trie.subscribe("$share/workers/test", b_, 1));
+  deliver(trie, "test", 4);
+  EXPECT_EQ(a_->received, 0u);
+  EXPECT_EQ(b_->received, 4u);
+
+  a_->backlog = warp::mqtt::Subscriber::kOffline;
+  ASSERT_TRUE(trie_.subscribe("$share/workers/test", a_, 1));
+  ASSERT_TRUE(trie_.subscribe("$share/workers/test", b_, 1));
+  deliver(trie_, "test", 4);
+  EXPECT_EQ(a_->received, 0u);
+  EXPECT_EQ(b_->received, 8u);
+}
+
+TEST_F(TrieTest, RouteTest) {
+  warp::mqtt::TopicTable topics;
+  auto const topic = topics.intern("test/foo");
+  std::vector<warp::mqtt::Trie::Match> out;
+  ASSERT_TRUE(trie_.subscribe("test/#", a_, 1));
+  trie_.match(*topic, out);
+  EXPECT_EQ(out.size(), 1u);
+
+  ASSERT_TRUE(trie_.subscribe("test/+", b_, 0));
+  out.clear();
+  trie_.match(*topic, out);
+  EXPECT_EQ(out.size(), 2u);
+
+  ASSERT_TRUE(trie_.unsubscribe("test/#", a_.get()));
+  out.clear();
+  trie_.match(*topic, out);
+  ASSERT_EQ(out.size(), 1u);
+  EXPECT_EQ(out.front().subscriber, b_);
+
+  // Filters under another first level leave the route alone; those that
+  // start with a wildcard may match anything and refresh it.
+  ASSERT_TRUE(trie_.subscribe("other/#", a_, 1));
+  out.clear();
+  trie_.match(*topic, out);
+  EXPECT_EQ(out.size(), 1u);
+  ASSERT_TRUE(trie_.subscribe("+/foo", a_, 1));
+  out.clear();
+  trie_.match(*topic, out);
+  EXPECT_EQ(out.size(), 2u);
+  ASSERT_TRUE(trie_.unsubscribe("+/foo", a_.get()));
+  ASSERT_TRUE(trie_.unsubscribe("other/#", a_.get()));
+
+  // The cached route does not keep a subscriber alive once the trie lets go.
+  ASSERT_TRUE(trie_.unsubscribe("test/+", b_.get()));
+  out.clear();
+  EXPECT_EQ(b_.use_count(), 1);
+
+  // A full table keeps a topic that subscribers are routed to.
+  warp::mqtt::TopicTable small(1);
+  ASSERT_TRUE(trie_.subscribe("test/#", a_, 1));
+  auto const kept = small.intern("test/foo").get();
+  trie_.match(*small.intern("test/foo"), out);
+  EXPECT_FALSE(small.intern("test/bar")->interned());
+  EXPECT_EQ(small.intern("test/foo").get(), kept);
+  EXPECT_EQ(small.size(), 1u);
+}
@@ -0,0 +1,120 @@
+#include "warp/websocket/deflate.h"
+
+#include <gtest/gtest.h>
+
+#include <string>
+
+#include "warp/websocket/stream.h"
+
+namespace {
+std::unique_ptr<folly::IOBuf> chunk(std::string const& data) {
+  return folly::IOBuf::copyBuffer(data.data(), data.size());
+}
+}  // namespace
+
+class DeflateTest : public ::testing::Test {
+protected:
+  // empty
+};
+
+TEST_F(DeflateTest, NegotiateTest) {
+  warp::websocket::DeflateOptions options;
+  auto agreed = warp::websocket::negotiate(options, "permessage-deflate; client_max_window_bits");
+  ASSERT_TRUE(agreed);
+  EXPECT_EQ(warp::websocket::accept(*agreed), "permessage-deflate");
+
+  options.serverWindowBits = 12;
+  options.clientWindowBits = 10;
+  options.serverNoContextTakeover = true;
+  agreed = warp::websocket::negotiate(options, "permessage-deflate");
+  ASSERT_TRUE(agreed);
+  EXPECT_EQ(agreed->clientWindowBits, 15);
+  EXPECT_EQ(
+      warp::websocket::accept(*agreed),
+      "permessage-deflate; server_no_context_takeover; server_max_window_bits=12"
+  );
+
+  agreed = warp::websocket::negotiate(
+      options,
+      "x-webkit-deflate-frame, permessage-deflate; server_max_window_bits=8, "
+      "permessage-deflate; client_max_window_bits=\"11\"; client_no_context_takeover"
+  );
+  ASSERT_TRUE(agreed);
+  EXPECT_EQ(agreed->clientWindowBits, 10);
+  EXPECT_TRUE(agreed->clientNoContextTakeover);
+
+  EXPECT_FALSE(warp::websocket::negotiate(options, "permessage-deflate; unknown"));
+  EXPECT_FALSE(warp::websocket::negotiate(
+      options, "permessage-deflate; client_no_context_takeover; client_no_context_takeover"
+  ));
+  EXPECT_FALSE(
+      warp::websocket::negotiate(options, "permessage-deflate; server_max_window_bits=16")
+  );
+  EXPECT_FALSE(warp::websocket::negotiate(options, ""));
+  options.enabled = false;
+  EXPECT_FALSE(warp::websocket::negotiate(options, "permessage-deflate"));
+}
+
+TEST_F(DeflateTest, InflateTest) {
+  // "Hello" from RFC 7692, compressed and then split across two frames, as a
+  // server sends them.
+  warp::websocket::Stream stream(
+      warp::websocket::DeflateOptions{}, warp::websocket::Stream::kMaxFrame,
+      warp::websocket::Stream::Role::Client
+  );
+  std::string const whole("\xC1\x07\xF2\x48\xCD\xC9\xC9\x07\x00", 9);
+  std::string const split("\x41\x03\xF2\x48\xCD\x80\x04\xC9\xC9\x07\x00", 11);
+  for (auto const& data : {whole, split}) {
+    auto frames = stream.parse(chunk(data));
+    ASSERT_TRUE(frames);
+    std::string payload;
+    for (auto& frame : *frames) {
+      payload += frame.data->to<std::string>();
+    }
+    EXPECT_EQ(payload, "Hello");
+  }
+
+  warp::websocket::Stream plain(
+      warp::websocket::Stream::kMaxFrame, warp::websocket::Stream::Role::Client
+  );
+  EXPECT_EQ(plain.parse(chunk(whole)).error(), warp::websocket::Stream::Error::Protocol);
+  std::string const corrupt("\xC1\x02\xFF\xFF", 4);
+  EXPECT_EQ(stream.parse(chunk(corrupt)).error(), warp::websocket::Stream::Error::BadData);
+}
+
+TEST_F(DeflateTest, RoundTripTest) {
+  warp::websocket::DeflateOptions options;
+  options.threshold = 64;
+  warp::websocket::Stream server(options);
+  warp::websocket::Stream client(
+      options, warp::websocket::Stream::kMaxFrame, warp::websocket::Stream::Role::Client
+  );
+  std::string const json = R"({"sensor":"temperature","value":21.5,"unit":"celsius"})";
+  std::string message;
+  for (int i = 0; i < 20; ++i) {
+    message += json;
+  }
+
+  // Later messages refer back to the first, so they come out smaller.
+  size_t first = message.size();
+  for (int i = 0; i < 3; ++i) {
+    auto framed = server.frame(chunk(message), 0x2);
+    auto const bytes = framed->computeChainDataLength();
+    EXPECT_EQ(framed->data()[0], 0xC2);
+    EXPECT_LT(bytes, first);
+    if (i == 0) first = bytes;
+    auto frames = client.parse(std::move(framed));
+    ASSERT_TRUE(frames);
+    ASSERT_EQ(frames->size(), 1u);
+    EXPECT_EQ((*frames)[0].data->to<std::string>(), message);
+  }
+
+  // Below the threshold, and control frames, go out as they are.
+  auto small = server.frame(chunk(json.substr(0, 32)), 0x2);
+  EXPECT_EQ(small->data()[0], 0x82);
+  auto pong = server.frame(chunk(message), 0xA);
+  EXPECT_EQ(pong->data()[0], 0x8A);
+  auto frames = client.parse(std::move(small));
+  ASSERT_TRUE(frames);
+  EXPECT_EQ((*frames)[0].data->to<std::string>(), json.substr(0, 32));
+}
@@ -0,0 +1,187 @@
+#include "warp/websocket/stream.h"
+
+#include <gtest/gtest.h>
+
+#include <string>
+#include <vector>
+
+namespace {
+// A client frame: always masked.
+std::string masked(std::string const& payload, uint8_t opcode = 0x2, bool fin = true) {
+  uint8_t const mask[4] = {0x11, 0x22, 0x33, 0x44};
+  std::string out;
+  out.push_back(static_cast<char>((fin ? 0x80 : 0x00) | opcode));
+  if (payload.size() < 126) {
+    out.push_back(static_cast<char>(0x80 | payload.size()));
+  } else {
+    out.push_back(static_cast<char>(0x80 | 126));
+    out.push_back(static_cast<char>(payload.size() >> 8));
+    out.push_back(static_cast<char>(payload.size() & 0xFF));
+  }
+  out.append(reinterpret_cast<char const*>(mask), 4);
+  for (size_t i = 0; i < payload.size(); ++i) {
+    out.push_back(static_cast<char>(payload[i] ^ mask[i & 3]));
+  }
+  return out;
+}
+
+std::unique_ptr<folly::IOBuf> chunk(std::string const& data) {
+  return folly::IOBuf::copyBuffer(data.data(), data.size());
+}
+}  // namespace
+
+class StreamTest : public ::testing::Test {
+protected:
+  // empty
+};
+
+TEST_F(StreamTest, ParseTest) {
+  warp::websocket::Stream stream;
+  auto const data = masked("hello") + masked(std::string(300, 'x'), 0x1) + masked("ping", 0x9);
+  auto frames = stream.parse(chunk(data));
+  ASSERT_TRUE(frames);
+  ASSERT_EQ(frames->size(), 3u);
+  EXPECT_EQ((*frames)[0].opcode, warp::websocket::OpCode::Binary);
+  EXPECT_EQ((*frames)[0].data->to<std::string>(), "hello");
+  EXPECT_EQ((*frames)[1].opcode, warp::websocket::OpCode::Text);
+  EXPECT_EQ((*frames)[1].data->computeChainDataLength(), 300u);
+  EXPECT_EQ((*frames)[2].opcode, warp::websocket::OpCode::Ping);
+  EXPECT_EQ((*frames)[2].data->to<std::string>(), "ping");
+  EXPECT_EQ(stream.pending(), 0u);
+}
+
+TEST_F(StreamTest, PartialTest) {
+  warp::websocket::Stream stream;
+  auto const data = masked(std::string(200, 'a'), 0x2, false) + masked("tail", 0x0);
+  // Split inside the extended length, the mask, and the payload.
+  size_t const cuts[] = {3, 7, 100, 210, data.size()};
+  std::string payload;
+  size_t at = 0;
+  size_t count = 0;
+  for (auto const cut : cuts) {
+    auto frames = stream.parse(chunk(data.substr(at, cut - at)));
+    at = cut;
+    ASSERT_TRUE(frames);
+    for (auto& frame : *frames) {
+      payload += frame.data->to<std::string>();
+      ++count;
+    }
+  }
+  EXPECT_EQ(count, 2u);
+  EXPECT_EQ(payload, std::string(200, 'a') + "tail");
+  EXPECT_EQ(stream.pending(), 0u);
+}
+
+TEST_F(StreamTest, TooLargeTest) {
+  warp::websocket::Stream stream;
+  std::string data = {'\x82', '\xFF'};
+  data.append(std::string(1, '\x01'));
+  data.append(std::string(7, '\x00'));
+  auto frames = stream.parse(chunk(data));
+  ASSERT_FALSE(frames);
+  EXPECT_EQ(frames.error(), warp::websocket::Stream::Error::TooLarge);
+}
+
+TEST_F(StreamTest, LimitTest) {
+  warp::websocket::Stream stream(200);
+  auto frames = stream.parse(chunk(masked(std::string(200, 'a'))));
+  ASSERT_TRUE(frames);
+  EXPECT_EQ(frames->size(), 1u);
+  // Refused from the header alone, before the payload is in.
+  frames = stream.parse(chunk(masked(std::string(201, 'a')).substr(0, 8)));
+  ASSERT_FALSE(frames);
+  EXPECT_EQ(frames.error(), warp::websocket::Stream::Error::TooLarge);
+}
+
+TEST_F(StreamTest, MaskTest) {
+  // A server fails the connection on an unmasked frame; a client on a masked one.
+  warp::websocket::Stream server;
+  auto frames = server.parse(chunk(std::string("\x82\x02hi", 4)));
+  ASSERT_FALSE(frames);
+  EXPECT_EQ(frames.error(), warp::websocket::Stream::Error::Protocol);
+
+  warp::websocket::Stream client(
+      warp::websocket::Stream::kMaxFrame, warp::websocket::Stream::Role::Client
+  );
+  frames = client.parse(chunk(masked("hi")));
+  ASSERT_FALSE(frames);
+  EXPECT_EQ(frames.error(), warp::websocket::Stream::Error::Protocol);
+}
+
+TEST_F(StreamTest, ControlTest) {
+  // Control frames fit 125 bytes and are never fragmented.
+  for (auto const& data : {masked(std::string(126, 'x'), 0x9), masked("ping", 0x9, false)}) {
+    warp::websocket::Stream stream;
+    auto frames = stream.parse(chunk(data));
+    ASSERT_FALSE(frames);
+    EXPECT_EQ(frames.error(), warp::websocket::Stream::Error::Protocol);
+  }
+  warp::websocket::Stream stream;
+  auto frames = stream.parse(chunk(masked(std::string(125, 'x'), 0x9)));
+  ASSERT_TRUE(frames);
+  EXPECT_EQ(frames->size(), 1u);
+}
+
+TEST_F(StreamTest, OpcodeTest) {
+  // Opcodes 0x3-0x7 and 0xB-0xF are reserved.
+  for (uint8_t const opcode : {0x3, 0x7, 0xB, 0xF}) {
+    warp::websocket::Stream stream;
+    auto frames = stream.parse(chunk(masked("hi", opcode)));
+    ASSERT_FALSE(frames);
+    EXPECT_EQ(frames.error(), warp::websocket::Stream::Error::Protocol);
+  }
+}
+
+TEST_F(StreamTest, FragmentTest) {
+  // A continuation without a message, and a new message inside one, are errors.
+  for (auto const& data :
+       {masked("hi", 0x0), masked("hi", 0x1, false) + masked("hi", 0x2),
+        masked("hi", 0x2, false) + masked("hi", 0x0) + masked("hi", 0x0)}) {
+    warp::websocket::Stream stream;
+    auto frames = stream.parse(chunk(data));
+    ASSERT_FALSE(frames);
+    EXPECT_EQ(frames.error(), warp::websocket::Stream::Error::Protocol);
+  }
+  // Control frames may come between the fragments.
+  warp::websocket::Stream stream;
+  auto frames = stream.parse(
+      chunk(masked("he", 0x1, false) + masked("ping", 0x9) + masked("llo", 0x0) + masked("hi", 0x2))
+  );
+  ASSERT_TRUE(frames);
+  EXPECT_EQ(frames->size(), 4u);
+}
+
+TEST_F(StreamTest, FailedTest) {
+  // After the first error nothing more is parsed, and nothing is held.
+  warp::websocket::Stream stream(200);
+  auto frames = stream.parse(chunk(masked(std::string(201, 'a')) + masked("hello")));
+  ASSERT_FALSE(frames);
+  EXPECT_EQ(frames.error(), warp::websocket::Stream::Error::TooLarge);
+  EXPECT_EQ(stream.pending(), 0u);
+  frames = stream.parse(chunk(masked("hello")));
+  ASSERT_FALSE(frames);
+  EXPECT_EQ(frames.error(), warp::websocket::Stream::Error::TooLarge);
+  EXPECT_EQ(stream.pending(), 0u);
+}
+
+TEST_F(StreamTest, UnmaskTest) {
+  uint8_t const mask[4] = {0xA1, 0xB2, 0xC3, 0xD4};
+  std::vector<uint8_t> src(1000);
+  for (size_t i = 0; i < src.size(); ++i) {
+    src[i] = static_cast<uint8_t>(i * 7);
+  }
+  // Every length around the word and register sizes, from every mask offset.
+  for (size_t size = 0; size <= 100; ++size) {
+    for (size_t offset = 0; offset < 4; ++offset) {
+      std::vector<uint8_t> dst(size);
+      warp::websocket::unmask(dst.data(), src.data() + 3, size, mask, offset);
+      for (size_t i = 0; i < size; ++i) {
+        ASSERT_EQ(dst[i], src[3 + i] ^ mask[(offset + i) & 3]) << size << " " << offset;
+      }
+    }
+  }
+  auto copy = src;
+  warp::websocket::unmask(copy.data(), copy.data(), copy.size(), mask);
+  warp::websocket::unmask(copy.data(), copy.data(), copy.size(), mask);
+  EXPECT_EQ(copy, src);
+}